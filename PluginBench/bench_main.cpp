@@ -0,0 +1,601 @@
+/// <summary> Benchmark of a plug-in over a sweep of frame layouts </summary>
+/* Host file that loads any plug-in through its PluginApi and times it on synthetic frames */
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include "UspPlugin.h"
+#include "UspDll.h"
+#include "UspDebug.h"
+#include "UspRecording.h"
+#include "Parameters.h"
+#include "scale_reference.h"
+
+// Command line: plugin_bench [name=value ...] [memio] [csv] [verify]
+//  plugin=path       The plug-in to load (default plugins/ and the plugin_b file name of the platform, see USP_DLL_NAME)
+//  kernels=dir       Directory handed to InitializeCL, where the plug-in finds its kernels (default "plugins")
+//  device=any|cpu|gpu  OpenCL device type. any takes a GPU if there is one and the CPU otherwise (default any)
+//  frames=N          Timed frames per sweep point (default 100)
+//  warmup=N          Frames processed before the timing starts (default 5)
+//  nlinesamples=a,b  The sweep: every combination of the listed values is one point.
+//  nlines=a,b          The defaults are the ProFocus parameters of TheApplication
+//  emissions=a,b
+//  interleave=a,b
+//  numb_avg=a,b
+//  memio             Times ProcessMemIO on host memory instead of ProcessCLIO, also the
+//                    default when GetPluginInfo reports that the plug-in does not use OpenCL
+//  recording=file    Runs the frames and parameters of a recording (see UspRecording.h) instead of the sweep
+//  csv               Comma separated rows under a header line instead of one JSON object per line
+// Each point reports the InitializeCL (kernel build) time of the run, the Prepare time of the point,
+// the steady-state throughput of frames enqueued back to back, and the p50/p99 latency of single frames.
+//
+// Gates, for checking a change of the kernels. plugin_bench exits with 1 if a point fails one of them
+//  verify            Compares the outputs of the first frames, and the intermediate buffers the plug-in
+//                    lists in GetDbgOclMem, with the double precision reference of scale_reference.h
+//  rtol=x            Largest error of a float value, relative to the largest magnitude in its buffer (default 1e-3).
+//                    The uint8 outputs may differ by one level
+//  maxbad=x          Fraction of the values of a buffer that may be off by more, e.g. where the
+//                    arctan wraps around (default 0.002)
+//  baseline=file     The JSON output of an earlier run. A point fails if its steady-state frame time
+//                    is longer than that of the same point in the file by more than regress percent
+//  regress=pct       (default 10)
+#define MAX_SWEEP_VALUES 16
+#define MAX_BUFFERS      4
+#define BENCH_INPUTS     4     // Distinct synthetic frames the timed frames cycle through
+#define VERIFY_FRAMES    2     // Frames compared with the reference by verify
+
+UspDllHandle hLib;
+const char* dllname = "plugins/" USP_DLL_NAME("plugin_b");
+
+PluginBinding plugin; // Plain API of the loaded DLL, the benchmark does not create instances
+PluginInfo pluginInfo;
+GetDbgOclMemPtr getDbgOclMem; // Optional, NULL if the DLL does not list its intermediate buffers
+
+void* FindSymbol(const char *name)
+{
+    return UspDllSymbol(hLib, name);
+}
+
+/// <summary> Loads the DLL and finds the functions of the PluginApi. Returns -1 if one is missing. </summary>
+int LoadDLL(const char *name)
+{
+    hLib = UspDllOpen(name);
+    if (hLib == NULL) {
+        fprintf(stderr, "Could not load library %s: %s\n", name, UspDllError());
+        return -1;
+    }
+    memset(&plugin, 0, sizeof(plugin));
+    plugin.api.GetPluginInfo = (GetPluginInfoPtr) FindSymbol("GetPluginInfo");
+    plugin.api.Initialize = (InitializePtr) FindSymbol("Initialize");
+    plugin.api.InitializeCL = (InitializeCLPtr) FindSymbol("InitializeCL");
+    plugin.api.SetParams = (SetParamsPtr) FindSymbol("SetParams");
+    plugin.api.SetInBufSize = (SetInBufSizePtr) FindSymbol("SetInBufSize");
+    plugin.api.Prepare = (PreparePtr) FindSymbol("Prepare");
+    plugin.api.GetOutBufSize = (GetOutBufSizePtr) FindSymbol("GetOutBufSize");
+    plugin.api.ProcessCLIO = (ProcessCLIOPtr) FindSymbol("ProcessCLIO");
+    plugin.api.ProcessMemIO = (ProcessMemIOPtr) FindSymbol("ProcessMemIO");
+    plugin.api.Cleanup = (CleanupPtr) FindSymbol("Cleanup");
+
+    if (   plugin.api.GetPluginInfo == NULL
+        || plugin.api.Initialize == NULL
+        || plugin.api.InitializeCL == NULL
+        || plugin.api.SetParams == NULL
+        || plugin.api.SetInBufSize == NULL
+        || plugin.api.Prepare == NULL
+        || plugin.api.GetOutBufSize == NULL
+        || plugin.api.ProcessCLIO == NULL
+        || plugin.api.ProcessMemIO == NULL
+        || plugin.api.Cleanup == NULL )
+    { // If a pointer is equal to NULL
+        fprintf(stderr, " One or more functions from the API were not found \n");
+        return -1;
+    }
+    return 0;
+}
+
+/// <summary> Check for Error and print out error code detail </summary>
+void checkError(int err, const char *detail){
+	if(err<0){
+		fprintf(stderr,"Error: %s \nError code: %d\n",detail,err);
+		exit(1);
+	}
+}
+
+/// <summary> Milliseconds since t0 </summary>
+static double ms_since(std::chrono::steady_clock::time_point t0){
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+/// <summary> Parses a comma separated list of positive integers. Returns the number of values, 0 if the list is malformed </summary>
+static int parse_list(const char* s, int* values){
+	int n = 0;
+	while (*s != '\0' && n < MAX_SWEEP_VALUES) {
+		char* end;
+		long v = strtol(s, &end, 10);
+		if (end == s || v <= 0 || (*end != ',' && *end != '\0')) return 0;
+		values[n++] = (int)v;
+		s = (*end == ',') ? end + 1 : end;
+	}
+	return (*s == '\0') ? n : 0;
+}
+
+/// <summary> Finds the first device of the given type on any platform </summary>
+static cl_int find_device(cl_device_type type, cl_device_id* device){
+	cl_platform_id platforms[8];
+	cl_uint nplatforms = 0;
+	cl_int err = clGetPlatformIDs(8, platforms, &nplatforms);
+	if (err != CL_SUCCESS) return err;
+	for (cl_uint p = 0; p < nplatforms && p < 8; p++) {
+		if (clGetDeviceIDs(platforms[p], type, 1, device, NULL) == CL_SUCCESS) return CL_SUCCESS;
+	}
+	return CL_DEVICE_NOT_FOUND;
+}
+
+/// <summary> Fills one interleaved INT16X2 frame with a slowly rotating phasor, as from a moving
+/// scatterer, in pseudo-random noise. The seed makes the BENCH_INPUTS frames differ from each other.
+/// </summary>
+static void synth_frame(short* iq, size_t nsamples, unsigned int seed){
+	unsigned int state = 2463534242u ^ (seed*2654435761u);
+	for (size_t s = 0; s < nsamples; s++) {
+		double phase = 0.05*(double)s + 0.3*seed;
+		state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+		int noise_i = (int)(state & 0x3ff) - 512;
+		int noise_q = (int)((state >> 10) & 0x3ff) - 512;
+		iq[2*s]     = (short)(4000.0*cos(phase) + noise_i);
+		iq[2*s + 1] = (short)(4000.0*sin(phase) + noise_q);
+	}
+}
+
+/// <summary> Nearest-rank percentile of sorted latencies </summary>
+static double percentile(const std::vector<double>& sorted, double p){
+	if (sorted.empty()) return 0.0;
+	size_t rank = (size_t)ceil(p*sorted.size());
+	return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+/// <summary> Settings of the run, the same for every point </summary>
+struct BenchConfig {
+	bool memio;
+	bool verify;
+	int nframes, nwarmup;
+	double rtol, maxbad;
+	cl_context context;
+	cl_command_queue queue;
+	const Recording* rec;    // NULL for synthetic frames
+};
+
+/// <summary> Results of one sweep point </summary>
+struct BenchPoint {
+	int nlinesamples, nlines, emissions, interleave, numb_avg;
+	int status;              // First error of the plug-in, 0 if the point ran
+	double prepare_ms;
+	size_t frame_bytes;      // Input bytes of one frame
+	double fps;              // Frames per second enqueued back to back
+	double p50_us, p99_us;   // Latency of a single frame
+	int verify;              // -1 not verified, 0 passed, 1 failed
+	double verify_bad;       // Largest fraction of values out of tolerance in one buffer
+	bool has_baseline;
+	double baseline_pct;     // Change of the steady-state frame time from the baseline, in percent
+};
+
+/// <summary> Parameters of a sweep point, the ProFocus parameters of TheApplication for the rest </summary>
+static void point_params(const BenchPoint& pt, float* floatParams, int* intParams){
+	memset(floatParams, 0, FloatParamCount*sizeof(float));
+	memset(intParams, 0, IntParamCount*sizeof(int));
+	intParams[ind_emissions]    = pt.emissions;
+	intParams[ind_nlines]       = pt.nlines;
+	intParams[ind_nlinesamples] = pt.nlinesamples;
+	intParams[ind_numb_avg]     = pt.numb_avg;
+	intParams[ind_avg_offset]   = 1;
+	intParams[ind_lag_axial]    = 1;
+	intParams[ind_lag_TO]       = 2;
+	intParams[ind_lag_acq]      = 1;
+	intParams[ind_interleave]   = pt.interleave;
+	intParams[ind_fused]        = 1;
+	intParams[ind_replay]       = 1;
+	intParams[ind_storage]      = storage_short2;
+	floatParams[ind_fs]       = 7500000;
+	floatParams[ind_f0]       = 5000000;
+	floatParams[ind_c]        =    1540;
+	floatParams[ind_fprf]     =    3106;
+	floatParams[ind_depth]    = static_cast<float>(0.02);
+	floatParams[ind_lambda_X] = static_cast<float>(0.0022);
+}
+
+/// <summary> Sizes the INT16X2 input like TheApplication: nlinesamples*4 samples per line, all lines of all emissions </summary>
+static void input_size(const BenchPoint& pt, BuffSize* insize){
+	insize->sampleType = SAMPLE_FORMAT_INT16X2;
+	insize->width      = (size_t)pt.nlinesamples*4*pt.nlines*pt.emissions; // 4 = 4CCLR
+	insize->height     = 1;
+	insize->depth      = 1;
+	insize->widthLen   = insize->width  * sizeof(short)*2;
+	insize->heightLen  = insize->height * insize->widthLen;
+	insize->depthLen   = insize->depth  * insize->heightLen;
+}
+
+/// <summary> Processes one frame, and with wait returns once it is done </summary>
+static int process_frame(const BenchConfig& cfg, int numin, int numout, cl_mem* inbuf, cl_mem* outbuf, void** in, void** out, bool wait){
+	if (cfg.memio) return plugin.api.ProcessMemIO(in, numin, out, numout);
+	cl_event done = NULL;
+	int err = plugin.api.ProcessCLIO(inbuf, numin, outbuf, numout, cfg.queue, NULL, &done);
+	if (err == 0 && wait) err = (done != NULL) ? clWaitForEvents(1, &done) : clFinish(cfg.queue);
+	if (done != NULL) clReleaseEvent(done);
+	return err;
+}
+
+/// <summary> Fraction of the n values that differ from the reference by more than rtol times
+/// the largest magnitude of the reference. NaN counts as a difference.
+/// </summary>
+static double bad_floats(const float* x, const double* ref, size_t n, double rtol){
+	double peak = 0.0;
+	size_t i, bad = 0;
+	for (i = 0; i < n; i++) peak = std::max(peak, fabs(ref[i]));
+	for (i = 0; i < n; i++) if (!(fabs(x[i] - ref[i]) <= rtol*peak)) bad++;
+	return (n > 0) ? (double)bad/n : 0.0;
+}
+
+/// <summary> Fraction of the n values that differ from the reference by more than one level </summary>
+static double bad_levels(const unsigned char* x, const unsigned char* ref, size_t n){
+	size_t bad = 0;
+	for (size_t i = 0; i < n; i++) if (abs((int)x[i] - (int)ref[i]) > 1) bad++;
+	return (n > 0) ? (double)bad/n : 0.0;
+}
+
+/// <summary> Compares the outputs of a frame, and the intermediate buffers the plug-in lists in GetDbgOclMem,
+/// with the reference. Reports the buffers with more than maxbad of their values off on stderr.
+/// Returns the largest fraction of values off in one buffer, or a negative OpenCL error if a buffer cannot be read.
+/// @param out The two uint8 outputs of the frame, on the host
+/// </summary>
+static double verify_frame(const BenchConfig& cfg, const ScaleReference& ref, unsigned char* const* out, int frame){
+	size_t Nsamples = ref.outZ.size();
+	const char* names[2] = { "outZ", "outX" };
+	double bad[2] = { bad_levels(out[0], &ref.outZ[0], Nsamples), bad_levels(out[1], &ref.outX[0], Nsamples) };
+	double worst = 0.0;
+	for (int o = 0; o < 2; o++) {
+		if (bad[o] > cfg.maxbad) fprintf(stderr, "verify: frame %d, %s: %.4f of the values are off\n", frame, names[o], bad[o]);
+		worst = std::max(worst, bad[o]);
+	}
+
+	// The intermediate buffers only exist on the OpenCL path
+	uint32_t ndbg = 0;
+	DbgOclMem* dbg = (!cfg.memio && getDbgOclMem != NULL) ? getDbgOclMem(&ndbg) : NULL;
+	const std::vector<double>* values[5] = { &ref.temp_re, &ref.temp_im, &ref.to_vel_est_sum12_re_im, &ref.outbufZ, &ref.outbufX };
+	const char* dbg_names[5] = { "temp_re", "temp_im", "to_vel_est_sum12_re_im", "outbufZ", "outbufX" };
+	std::vector<float> host;
+	if (!cfg.memio && ndbg == 0 && frame == 0) fprintf(stderr, "verify: the plug-in lists no intermediate buffers, only the outputs are compared\n");
+	for (uint32_t d = 0; d < ndbg; d++) {
+		if (dbg[d].name == NULL || dbg[d].bufSize.sampleType != SAMPLE_FORMAT_FLOAT32) continue;
+		for (int v = 0; v < 5; v++) {
+			if (strcmp(dbg[d].name, dbg_names[v]) != 0) continue;
+			size_t n = std::min(dbg[d].bufSize.depthLen/sizeof(float), values[v]->size());
+			if (n < values[v]->size() && frame == 0) {
+				fprintf(stderr, "verify: %s holds the first %lu of %lu values, e.g. the first part of a frame split across devices\n",
+					dbg_names[v], (unsigned long)n, (unsigned long)values[v]->size());
+			}
+			host.resize(n);
+			cl_int err = clEnqueueReadBuffer(cfg.queue, dbg[d].mem, CL_TRUE, 0, n*sizeof(float), &host[0], 0, NULL, NULL);
+			if (err != CL_SUCCESS) return err;
+			double b = bad_floats(&host[0], &(*values[v])[0], n, cfg.rtol);
+			if (b > cfg.maxbad) fprintf(stderr, "verify: frame %d, %s: %.4f of the values are off\n", frame, dbg_names[v], b);
+			worst = std::max(worst, b);
+		}
+	}
+	return worst;
+}
+
+/// <summary> Sets the parameters of a point, prepares the plug-in and runs its frames.
+/// Returns the first error of the plug-in, the point is left incomplete then.
+/// </summary>
+static int run_point(BenchPoint& pt, const BenchConfig& cfg, const float* floatParams, size_t numFloatParams, const int* intParams, size_t numIntParams){
+	int numin  = std::min(std::max(pluginInfo.NumInBuffers, 1), MAX_BUFFERS);
+	int numout = std::min(std::max(pluginInfo.NumOutBuffers, 1), MAX_BUFFERS);
+	BuffSize insize, outsize[MAX_BUFFERS];
+	if (cfg.rec != NULL) RecordingFrameSize(cfg.rec, &insize);
+	else input_size(pt, &insize);
+	pt.frame_bytes = insize.depthLen*numin;
+	pt.verify = -1;
+
+	int err = plugin.api.SetParams((float*)floatParams, numFloatParams, (int*)intParams, numIntParams);
+	for (int i = 0; i < numin && err == 0; i++) err = plugin.api.SetInBufSize(&insize, i);
+	if (err != 0) return err;
+
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	err = plugin.api.Prepare();
+	pt.prepare_ms = ms_since(t0);
+	for (int i = 0; i < numout && err == 0; i++) err = plugin.api.GetOutBufSize(&outsize[i], i);
+	if (err != 0) return err;
+
+	// BENCH_INPUTS frames on the host, and the same on the device for ProcessCLIO
+	std::vector<short> host_in[BENCH_INPUTS];
+	std::vector<unsigned char> host_out[MAX_BUFFERS];
+	void* in[BENCH_INPUTS][MAX_BUFFERS];
+	void* out[MAX_BUFFERS];
+	cl_mem inbuf[BENCH_INPUTS][MAX_BUFFERS];
+	cl_mem outbuf[MAX_BUFFERS];
+	memset(inbuf, 0, sizeof(inbuf));
+	memset(outbuf, 0, sizeof(outbuf));
+	for (int f = 0; f < BENCH_INPUTS; f++) {
+		host_in[f].resize(insize.depthLen/sizeof(short));
+		if (cfg.rec != NULL) memcpy(&host_in[f][0], RecordingFrame(cfg.rec, f % cfg.rec->header->numFrames), insize.depthLen);
+		else synth_frame(&host_in[f][0], insize.depthLen/(2*sizeof(short)), f);
+		for (int i = 0; i < numin; i++) in[f][i] = &host_in[f][0];
+	}
+	for (int o = 0; o < numout; o++) {
+		host_out[o].resize(outsize[o].depthLen);
+		out[o] = &host_out[o][0];
+	}
+	if (!cfg.memio) {
+		for (int f = 0; f < BENCH_INPUTS && err == 0; f++) {
+			for (int i = 0; i < numin && err == 0; i++) {
+				inbuf[f][i] = clCreateBuffer(cfg.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, insize.depthLen, &host_in[f][0], &err);
+			}
+		}
+		for (int o = 0; o < numout && err == 0; o++) {
+			outbuf[o] = clCreateBuffer(cfg.context, CL_MEM_WRITE_ONLY, outsize[o].depthLen, NULL, &err);
+		}
+	}
+
+	// The first frames against the reference, before any timing. It knows the outputs of Plugin_B only
+	if (cfg.verify && numout >= 2 && err == 0) {
+		ParamStruct params;
+		ScaleReference ref;
+		ReferenceParams(&params, floatParams, numFloatParams, intParams, numIntParams);
+		pt.verify = 0;
+		for (int f = 0; f < VERIFY_FRAMES && err == 0; f++) {
+			err = process_frame(cfg, numin, numout, inbuf[f], outbuf, in[f], out, true);
+			for (int o = 0; o < 2 && err == 0 && !cfg.memio; o++) {
+				err = clEnqueueReadBuffer(cfg.queue, outbuf[o], CL_TRUE, 0, outsize[o].depthLen, out[o], 0, NULL, NULL);
+			}
+			if (err != 0) break;
+			if (ReferenceFrame(&params, &host_in[f][0], ref) != 0 || host_out[0].size() < ref.outZ.size() || host_out[1].size() < ref.outX.size()) {
+				fprintf(stderr, "verify: the reference does not take these parameters\n");
+				pt.verify = 1;
+				break;
+			}
+			double bad = verify_frame(cfg, ref, (unsigned char* const*)out, f);
+			if (bad < 0) { err = (int)bad; break; }
+			pt.verify_bad = std::max(pt.verify_bad, bad);
+			if (bad > cfg.maxbad) pt.verify = 1;
+		}
+	}
+
+	// One frame, waited for, so its time is the latency
+	std::vector<double> latency;
+	latency.reserve(cfg.nframes);
+	for (int j = 0; j < cfg.nwarmup + cfg.nframes && err == 0; j++) {
+		int f = j % BENCH_INPUTS;
+		t0 = std::chrono::steady_clock::now();
+		err = process_frame(cfg, numin, numout, inbuf[f], outbuf, in[f], out, true);
+		if (j >= cfg.nwarmup) latency.push_back(1000.0*ms_since(t0));
+	}
+
+	// Frames back to back, the steady state of a stream
+	if (err == 0) {
+		t0 = std::chrono::steady_clock::now();
+		for (int j = 0; j < cfg.nframes && err == 0; j++) {
+			int f = j % BENCH_INPUTS;
+			err = process_frame(cfg, numin, numout, inbuf[f], outbuf, in[f], out, false);
+		}
+		if (!cfg.memio && err == 0) err = clFinish(cfg.queue);
+		double total_ms = ms_since(t0);
+		pt.fps = (total_ms > 0.0) ? 1000.0*cfg.nframes/total_ms : 0.0;
+	}
+
+	std::sort(latency.begin(), latency.end());
+	pt.p50_us = percentile(latency, 0.50);
+	pt.p99_us = percentile(latency, 0.99);
+
+	for (int f = 0; f < BENCH_INPUTS; f++) {
+		for (int i = 0; i < numin; i++) if (inbuf[f][i] != NULL) clReleaseMemObject(inbuf[f][i]);
+	}
+	for (int o = 0; o < numout; o++) if (outbuf[o] != NULL) clReleaseMemObject(outbuf[o]);
+	return err;
+}
+
+/// <summary> Reads the lines of an earlier JSON output. Returns -1 if the file cannot be read </summary>
+static int load_baseline(const char* path, std::vector<std::string>& lines){
+	FILE* file = fopen(path, "r");
+	if (!file) return -1;
+	char line[4096];
+	while (fgets(line, sizeof(line), file) != NULL) lines.push_back(line);
+	fclose(file);
+	return 0;
+}
+
+/// <summary> Finds the same point in the baseline and compares the frame times. Leaves has_baseline false if it is not there </summary>
+static void compare_baseline(BenchPoint& pt, const std::vector<std::string>& lines, const char* path){
+	char key[256];
+	snprintf(key, sizeof(key), "\"path\":\"%s\",\"nlinesamples\":%d,\"nlines\":%d,\"emissions\":%d,\"interleave\":%d,\"numb_avg\":%d,",
+		path, pt.nlinesamples, pt.nlines, pt.emissions, pt.interleave, pt.numb_avg);
+	for (size_t n = 0; n < lines.size(); n++) {
+		const char* fps = strstr(lines[n].c_str(), "\"fps\":");
+		if (strstr(lines[n].c_str(), key) == NULL || fps == NULL) continue;
+		double base_fps = atof(fps + 6);
+		if (base_fps <= 0.0 || pt.fps <= 0.0) return;
+		pt.has_baseline = true;
+		pt.baseline_pct = 100.0*(base_fps/pt.fps - 1.0); // frame times are 1/fps
+		return;
+	}
+}
+
+/// <summary> Prints one point as a JSON object or a CSV row </summary>
+static void print_point(const BenchPoint& pt, bool csv, const char* device, bool memio, double init_ms, int nframes){
+	double mbps = pt.fps*pt.frame_bytes/1.0e6;
+	const char* path = memio ? "memio" : "clio";
+	const char* verify = (pt.verify < 0) ? "off" : (pt.verify == 0 ? "pass" : "fail");
+	char baseline[32] = "";
+	if (pt.has_baseline) snprintf(baseline, sizeof(baseline), "%.1f", pt.baseline_pct);
+	if (csv) {
+		printf("%s,%s,%s,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%d,%lu,%.2f,%.2f,%.1f,%.1f,%s,%.5f,%s\n",
+			dllname, device, path, pt.nlinesamples, pt.nlines, pt.emissions, pt.interleave, pt.numb_avg,
+			pt.status, init_ms, pt.prepare_ms, nframes, (unsigned long)pt.frame_bytes, pt.fps, mbps, pt.p50_us, pt.p99_us,
+			verify, pt.verify_bad, baseline);
+	} else {
+		printf("{\"plugin\":\"%s\",\"device\":\"%s\",\"path\":\"%s\",\"nlinesamples\":%d,\"nlines\":%d,\"emissions\":%d,"
+			"\"interleave\":%d,\"numb_avg\":%d,\"status\":%d,\"init_ms\":%.3f,\"prepare_ms\":%.3f,\"frames\":%d,"
+			"\"frame_bytes\":%lu,\"fps\":%.2f,\"mb_per_s\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+			"\"verify\":\"%s\",\"verify_bad\":%.5f,\"baseline_pct\":%s}\n",
+			dllname, device, path, pt.nlinesamples, pt.nlines, pt.emissions, pt.interleave, pt.numb_avg,
+			pt.status, init_ms, pt.prepare_ms, nframes, (unsigned long)pt.frame_bytes, pt.fps, mbps, pt.p50_us, pt.p99_us,
+			verify, pt.verify_bad, pt.has_baseline ? baseline : "null");
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	const char* kernels = "plugins";
+	const char* devtype = "any";
+	const char* recordfile = NULL;
+	const char* baselinefile = NULL;
+	double regress = 10.0;
+	bool csv = false;
+	BenchConfig cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nframes = 100;
+	cfg.nwarmup = 5;
+	cfg.rtol    = 1e-3;
+	cfg.maxbad  = 0.002;
+	int sweep[5][MAX_SWEEP_VALUES] = { {208}, {28}, {16}, {16}, {6} };
+	int nsweep[5] = { 1, 1, 1, 1, 1 };
+	const char* sweep_names[5] = { "nlinesamples=", "nlines=", "emissions=", "interleave=", "numb_avg=" };
+
+	for (int a = 1; a < argc; a++) {
+		bool known = true;
+		if      (strncmp(argv[a], "plugin=", 7) == 0)    dllname = argv[a] + 7;
+		else if (strncmp(argv[a], "kernels=", 8) == 0)   kernels = argv[a] + 8;
+		else if (strncmp(argv[a], "device=", 7) == 0)    devtype = argv[a] + 7;
+		else if (strncmp(argv[a], "frames=", 7) == 0)    known = (cfg.nframes = atoi(argv[a] + 7)) > 0;
+		else if (strncmp(argv[a], "warmup=", 7) == 0)    known = (cfg.nwarmup = atoi(argv[a] + 7)) >= 0;
+		else if (strncmp(argv[a], "recording=", 10) == 0) recordfile = argv[a] + 10;
+		else if (strncmp(argv[a], "rtol=", 5) == 0)      known = (cfg.rtol = atof(argv[a] + 5)) > 0.0;
+		else if (strncmp(argv[a], "maxbad=", 7) == 0)    known = (cfg.maxbad = atof(argv[a] + 7)) >= 0.0;
+		else if (strncmp(argv[a], "baseline=", 9) == 0)  baselinefile = argv[a] + 9;
+		else if (strncmp(argv[a], "regress=", 8) == 0)   known = (regress = atof(argv[a] + 8)) >= 0.0;
+		else if (strcmp(argv[a], "memio") == 0)          cfg.memio = true;
+		else if (strcmp(argv[a], "verify") == 0)         cfg.verify = true;
+		else if (strcmp(argv[a], "csv") == 0)            csv = true;
+		else {
+			known = false;
+			for (int s = 0; s < 5; s++) {
+				size_t len = strlen(sweep_names[s]);
+				if (strncmp(argv[a], sweep_names[s], len) == 0) {
+					known = (nsweep[s] = parse_list(argv[a] + len, sweep[s])) > 0;
+					break;
+				}
+			}
+		}
+		if (!known) {
+			fprintf(stderr, "Bad argument: %s\n", argv[a]);
+			return 1;
+		}
+	}
+
+	std::vector<std::string> baseline;
+	if (baselinefile != NULL) checkError(load_baseline(baselinefile, baseline),"Failed to read the baseline");
+
+	// The frames and the parameters of a recording replace the sweep
+	Recording rec;
+	if (recordfile != NULL) {
+		checkError(OpenRecording(recordfile, &rec),"Failed to open the recording");
+		if (rec.header->numFrames == 0) checkError(-1,"The recording has no frames");
+		cfg.rec = &rec;
+	}
+
+	int err = LoadDLL(dllname);
+	checkError(err,"Failed to load the plug-in");
+	getDbgOclMem = (GetDbgOclMemPtr) FindSymbol("GetDbgOclMem");
+	plugin.api.GetPluginInfo(&pluginInfo);
+	if (!pluginInfo.UseOpenCL) cfg.memio = true;
+
+	// A GPU if there is one, the CPU runtime otherwise
+	cl_device_id device_id = NULL;
+	char device[256] = "host";
+	double init_ms = 0.0;
+	std::chrono::steady_clock::time_point t0;
+	if (!cfg.memio) {
+		if (strcmp(devtype, "cpu") == 0)       err = find_device(CL_DEVICE_TYPE_CPU, &device_id);
+		else if (strcmp(devtype, "gpu") == 0)  err = find_device(CL_DEVICE_TYPE_GPU, &device_id);
+		else {
+			err = find_device(CL_DEVICE_TYPE_GPU, &device_id);
+			if (err != CL_SUCCESS) err = find_device(CL_DEVICE_TYPE_CPU, &device_id);
+			if (err != CL_SUCCESS) err = find_device(CL_DEVICE_TYPE_ALL, &device_id);
+		}
+		checkError(err,"Failed to find an OpenCL device");
+		clGetDeviceInfo(device_id, CL_DEVICE_NAME, sizeof(device) - 1, device, NULL);
+		device[sizeof(device) - 1] = '\0';
+		for (char* c = device; *c != '\0'; c++) if (*c == '"' || *c == '\\' || *c == ',') *c = ' ';
+		cfg.context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err);
+		checkError(err,"Failed to create a compute context!");
+		cfg.queue = clCreateCommandQueue(cfg.context, device_id, 0, &err);
+		checkError(err,"Failed to create a command queue!");
+
+		// Mostly the build of the kernels, or their load from the program cache
+		t0 = std::chrono::steady_clock::now();
+		err = plugin.api.InitializeCL(cfg.context, device_id, kernels);
+		init_ms = ms_since(t0);
+		checkError(err,"Failed initialization of CL");
+	} else {
+		t0 = std::chrono::steady_clock::now();
+		err = plugin.api.Initialize(kernels);
+		init_ms = ms_since(t0);
+		checkError(err,"Failed initialization");
+	}
+
+	if (csv) printf("plugin,device,path,nlinesamples,nlines,emissions,interleave,numb_avg,status,init_ms,prepare_ms,frames,frame_bytes,fps,mb_per_s,p50_us,p99_us,verify,verify_bad,baseline_pct\n");
+
+	int failed = 0;
+	int idx[5] = { 0, 0, 0, 0, 0 };
+	for (;;) {
+		BenchPoint pt;
+		memset(&pt, 0, sizeof(pt));
+		float floatParams[FloatParamCount];
+		int intParams[IntParamCount];
+		if (cfg.rec != NULL) {
+			size_t nfp = std::min((size_t)rec.header->numFloatParams, (size_t)FloatParamCount);
+			size_t nip = std::min((size_t)rec.header->numIntParams, (size_t)IntParamCount);
+			memset(intParams, 0, sizeof(intParams));
+			memset(floatParams, 0, sizeof(floatParams));
+			for (size_t n = 0; n < nip; n++) intParams[n] = rec.header->intParams[n];
+			memcpy(floatParams, rec.header->floatParams, nfp*sizeof(float));
+			pt.nlinesamples = intParams[ind_nlinesamples];
+			pt.nlines       = intParams[ind_nlines];
+			pt.emissions    = intParams[ind_emissions];
+			pt.interleave   = intParams[ind_interleave];
+			pt.numb_avg     = intParams[ind_numb_avg];
+			pt.status = run_point(pt, cfg, floatParams, nfp, intParams, nip);
+		} else {
+			pt.nlinesamples = sweep[0][idx[0]];
+			pt.nlines       = sweep[1][idx[1]];
+			pt.emissions    = sweep[2][idx[2]];
+			pt.interleave   = sweep[3][idx[3]];
+			pt.numb_avg     = sweep[4][idx[4]];
+			point_params(pt, floatParams, intParams);
+			pt.status = run_point(pt, cfg, floatParams, FloatParamCount, intParams, IntParamCount);
+		}
+		if (pt.status == 0 && baselinefile != NULL) compare_baseline(pt, baseline, cfg.memio ? "memio" : "clio");
+		print_point(pt, csv, device, cfg.memio, init_ms, cfg.nframes);
+
+		if (pt.status != 0 || pt.verify == 1 || (pt.has_baseline && pt.baseline_pct > regress)) failed = 1;
+		if (pt.has_baseline && pt.baseline_pct > regress) {
+			fprintf(stderr, "regress: nlinesamples=%d nlines=%d emissions=%d interleave=%d numb_avg=%d is %.1f%% slower than the baseline\n",
+				pt.nlinesamples, pt.nlines, pt.emissions, pt.interleave, pt.numb_avg, pt.baseline_pct);
+		}
+
+		// Next combination, the last parameter changing fastest
+		int s = 4;
+		while (s >= 0 && ++idx[s] == nsweep[s]) idx[s--] = 0;
+		if (s < 0 || cfg.rec != NULL) break;
+	}
+
+	plugin.api.Cleanup();
+	if (cfg.queue != NULL) clReleaseCommandQueue(cfg.queue);
+	if (cfg.context != NULL) clReleaseContext(cfg.context);
+	if (cfg.rec != NULL) CloseRecording(&rec);
+	return failed;
+}
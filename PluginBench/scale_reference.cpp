@@ -0,0 +1,155 @@
+#include "scale_reference.h"
+
+#include <cmath>
+
+static const double PI = 3.14159265358979323846;
+
+void ReferenceParams(ParamStruct* params, const float* pfp, size_t nfp, const int* pip, size_t nip)
+{
+	int ip[IntParamCount] = {0};
+	float fp[FloatParamCount] = {0};
+	for (size_t n = 0; n < nip && n < IntParamCount; n++) ip[n] = pip[n];
+	for (size_t n = 0; n < nfp && n < FloatParamCount; n++) fp[n] = pfp[n];
+
+	params->emissions    = ip[ind_emissions];
+	params->nlines       = ip[ind_nlines];
+	params->nlinesamples = ip[ind_nlinesamples];
+	params->numb_avg     = ip[ind_numb_avg];
+	params->avg_offset   = ip[ind_avg_offset];
+	params->lag_axial    = ip[ind_lag_axial];
+	params->lag_TO       = ip[ind_lag_TO];
+	params->lag_acq      = ip[ind_lag_acq];
+	params->interleave   = ip[ind_interleave];
+	params->fused        = ip[ind_fused];
+	params->replay       = ip[ind_replay];
+	params->storage      = ip[ind_storage];
+	params->fs       = fp[ind_fs];
+	params->f0       = fp[ind_f0];
+	params->c        = fp[ind_c];
+	params->fprf     = fp[ind_fprf];
+	params->depth    = fp[ind_depth];
+	params->lambda_X = fp[ind_lambda_X];
+}
+
+/// <summary> Sample s of emission e in one channel of a line, as a complex number </summary>
+static inline void Sample(const short* channel, size_t stride, int e, int s, double& re, double& im)
+{
+	const short* p = channel + stride*e + 2*s;
+	re = p[0];
+	im = p[1];
+}
+
+/// <summary> convert_uchar_sat_rte </summary>
+static unsigned char Saturate(double x)
+{
+	if (!(x > 0.0)) return 0;
+	if (x >= 255.0) return 255;
+	return (unsigned char)std::nearbyint(x);
+}
+
+int ReferenceFrame(const ParamStruct* params, const short* inbuf, ScaleReference& ref)
+{
+	const int nlinesamples = params->nlinesamples;
+	const int nlines       = params->nlines;
+	const int emissions    = params->emissions;
+	const int interleave   = params->interleave;
+	const int lag_TO       = params->lag_TO;
+	const int numb_avg     = params->numb_avg;
+	const int avg_offset   = params->avg_offset;
+	if (nlinesamples < 1 || nlines < 1 || emissions < 2 || interleave < 4 || numb_avg < 1 || avg_offset < 1) return -1;
+
+	const int positions  = interleave/4;
+	const size_t stride  = (size_t)2*interleave*nlinesamples; // shorts from one emission to the next
+	const size_t Nsamples = (size_t)nlines*nlinesamples;
+	ref.temp_re.assign(Nsamples, 0.0);
+	ref.temp_im.assign(Nsamples, 0.0);
+	ref.to_vel_est_sum12_re_im.assign(4*Nsamples, 0.0);
+	ref.outbufZ.assign(Nsamples, 0.0);
+	ref.outbufX.assign(Nsamples, 0.0);
+	ref.outZ.assign(Nsamples, 0);
+	ref.outX.assign(Nsamples, 0);
+
+	// split, velocity_est and to_velocity_est. Z, L and R are channels 0, 2 and 3 of a line
+	for (int line = 0; line < nlines; line++) {
+		const short* Z = inbuf + 2*((size_t)((line/positions)*emissions*interleave + (line%positions)*4)*nlinesamples);
+		const short* L = Z + 2*2*nlinesamples;
+		const short* R = Z + 3*2*nlinesamples;
+		for (int s = 0; s < nlinesamples; s++) {
+			size_t g = (size_t)line*nlinesamples + s;
+			double re, im;
+			int e;
+
+			// mean of each channel over the emissions
+			double avg[6] = {0, 0, 0, 0, 0, 0};
+			for (e = 0; e < emissions; e++) {
+				Sample(Z, stride, e, s, re, im); avg[0] += re; avg[1] += im;
+				Sample(L, stride, e, s, re, im); avg[2] += re; avg[3] += im;
+				Sample(R, stride, e, s, re, im); avg[4] += re; avg[5] += im;
+			}
+			for (int k = 0; k < 6; k++) avg[k] /= emissions;
+
+			// axial autocorrelation, lag 1: sum of conj(z[e])*z[e+1]
+			double sum_re = 0, sum_im = 0;
+			for (e = 0; e < emissions-1; e++) {
+				double z0re, z0im, z1re, z1im;
+				Sample(Z, stride, e, s, z0re, z0im);
+				Sample(Z, stride, e+1, s, z1re, z1im);
+				z0re -= avg[0]; z0im -= avg[1];
+				z1re -= avg[0]; z1im -= avg[1];
+				sum_re += z0re*z1re + z0im*z1im;
+				sum_im += z0re*z1im - z0im*z1re;
+			}
+			ref.temp_re[g] = sum_re;
+			ref.temp_im[g] = sum_im;
+
+			// transverse oscillation, r1 = r_sq + j*r_sqh and r2 = r_sq - j*r_sqh of the left and right beams, lag_TO
+			double sum12[4] = {0, 0, 0, 0};
+			for (e = 0; e < emissions-lag_TO; e++) {
+				double r[2][4];
+				for (int k = 0; k < 2; k++) {
+					double Lre, Lim, Rre, Rim;
+					Sample(L, stride, e + k*lag_TO, s, Lre, Lim);
+					Sample(R, stride, e + k*lag_TO, s, Rre, Rim);
+					Lre -= avg[2]; Lim -= avg[3];
+					Rre -= avg[4]; Rim -= avg[5];
+					r[k][0] = Lre - Rim; // r1.x
+					r[k][1] = Rre + Lim; // r1.y
+					r[k][2] = Lre + Rim; // r2.x
+					r[k][3] = Rre - Lim; // r2.y
+				}
+				sum12[0] += r[0][0]*r[1][0] + r[0][1]*r[1][1];
+				sum12[1] += r[0][0]*r[1][1] - r[0][1]*r[1][0];
+				sum12[2] += r[0][2]*r[1][2] + r[0][3]*r[1][3];
+				sum12[3] += r[0][2]*r[1][3] - r[0][3]*r[1][2];
+			}
+			for (int k = 0; k < 4; k++) ref.to_vel_est_sum12_re_im[4*g + k] = sum12[k];
+		}
+	}
+
+	// arctan, to_arctan and combine. A window of numb_avg values stops at the end of the line it starts in
+	const double scale   = params->c*params->fprf/(4.0*PI*params->f0*params->lag_axial)/params->lag_acq;
+	const double k_trans = params->fprf*params->c*params->lambda_X/(2.0*params->fs*params->depth*2.0*PI*2.0*params->lag_TO*params->lag_acq);
+	const double a = 1.0/(2.0*PI*scale);
+	for (size_t g = 0; g < Nsamples; g++) {
+		size_t first = g*avg_offset;
+		size_t last = (first/nlinesamples + 1)*nlinesamples;
+		if (last > first + numb_avg) last = first + numb_avg;
+		if (last > Nsamples) last = Nsamples;
+		if (last < first) last = first;
+
+		double avg[6] = {0, 0, 0, 0, 0, 0};
+		for (size_t i = first; i < last; i++) {
+			avg[0] += ref.temp_re[i];
+			avg[1] += ref.temp_im[i];
+			for (int k = 0; k < 4; k++) avg[2+k] += ref.to_vel_est_sum12_re_im[4*i + k];
+		}
+		double count = (last > first) ? (double)(last - first) : 1.0;
+		for (int k = 0; k < 6; k++) avg[k] /= count;
+
+		ref.outbufZ[g] = -scale*atan2(avg[1], avg[0]);
+		ref.outbufX[g] = k_trans*(double)(g % nlinesamples)*atan2(avg[3]*avg[4] + avg[5]*avg[2], avg[2]*avg[4] - avg[3]*avg[5]);
+		ref.outZ[g] = Saturate((-a*ref.outbufZ[g] + 1.0)/2.0*255.0);
+		ref.outX[g] = Saturate(( a*ref.outbufX[g] + 1.0)/2.0*255.0);
+	}
+	return 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+/**\file scale_reference.h
+ * Double precision reference of the Plugin_B pipeline, for plugin_bench verify.
+ *
+ * Written for clarity, not speed: one sample at a time and the averaging windows
+ * summed from scratch. The stages and the intermediate values are the ones of
+ * scale.cl, so each can be compared with the buffer the plug-in lists in
+ * GetDbgOclMem under the same name.
+ */
+
+#include "Parameters.h"
+#include <cstddef>
+#include <vector>
+
+/// <summary> Intermediate and final values of one frame </summary>
+struct ScaleReference {
+	std::vector<double> temp_re, temp_im;           // axial autocorrelation, one per sample
+	std::vector<double> to_vel_est_sum12_re_im;     // sum1_re, sum1_im, sum2_re, sum2_im per sample
+	std::vector<double> outbufZ, outbufX;           // axial and transverse velocities
+	std::vector<unsigned char> outZ, outX;          // the uint8 outputs of combine
+};
+
+/// <summary> Fills a ParamStruct from the parameter arrays given to SetParams.
+/// The optional parameters missing from the arrays are 0.
+/// </summary>
+void ReferenceParams(ParamStruct* params, const float* pfp, size_t nfp, const int* pip, size_t nip);
+
+/// <summary> Runs the whole pipeline on one frame.
+/// Returns -1 if the parameters cannot describe a frame, else 0.
+/// @param params Scanner parameters, see SetParams
+/// @param inbuf INPUT packed short2 frame, see split in scale.cl
+/// @param ref OUTPUT all values of the frame
+/// </summary>
+int ReferenceFrame(const ParamStruct* params, const short* inbuf, ScaleReference& ref);
@@ -1,9 +1,12 @@
 #define USP_PLUGIN_DLL   1
 #include "UspPlugin.h"
+#include "UspProgramCache.h"
+#include "UspTiming.h"
 #undef USP_PLUGIN_DLL   
 
 #include <cstdio>
 #include <cstdlib>
+#include <new>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -25,21 +28,22 @@ const char *KernelSource = "\n" \
 
 
 
-/// <summary>Statically defined structure describing plug-in capabilities. </summary>
-
-static bool dll_initialized = false;
-static cl_context g_ctx;
-static cl_device_id g_dev_id;
-static char* g_path_to_dll = NULL;
-static cl_kernel g_kernel;
-static cl_program g_program;
-
-
+/// <summary>State of one plug-in instance, see CreateInstance. </summary>
+struct PluginInstance
+{
+    cl_context ctx;
+    cl_device_id dev_id;
+    char* path_to_dll;
+    cl_kernel kernel;
+    cl_program program;
 
+    BuffSize inSize;
+    BuffSize outSize;
+    cl_uint count;
+};
 
-static BuffSize gInSize;
-static BuffSize gOutSize;
-static cl_uint g_count;
+/// <summary>The instance used by the plain API. </summary>
+static PluginInstance g_instance;
 
 
 
@@ -53,72 +57,80 @@ PLUGIN_API void __cdecl GetPluginInfo(PluginInfo* info)
     info->NumOutBuffers = 1;
 }
 
-PLUGIN_API int __cdecl InitializeCL( cl_context ctx, cl_device_id id, char* path_to_dll )
+PLUGIN_API PluginHandle __cdecl CreateInstance(void)
+{
+    return new (std::nothrow) PluginInstance();
+}
+
+PLUGIN_API void __cdecl DestroyInstance(PluginHandle inst)
+{
+    delete inst;
+}
+
+PLUGIN_API int __cdecl InitializeCLInst(PluginHandle inst, cl_context ctx, cl_device_id id, char* path_to_dll )
 {
     int err;
-    g_ctx = ctx;
-    g_dev_id = id;
-    g_path_to_dll = path_to_dll;
+    inst->ctx = ctx;
+    inst->dev_id = id;
+    inst->path_to_dll = path_to_dll;
 
-    g_program = clCreateProgramWithSource(g_ctx, 1, (const char **) & KernelSource, NULL, &err);
-    if (!g_program)
+    // Build the program executable, or load the binary cached next to the DLL
+    //
+    err = BuildProgramCached(inst->ctx, inst->dev_id, KernelSource, NULL, inst->path_to_dll, &inst->program);
+    if (!inst->program)
     {
         printf("Error: Failed to create compute program!\n");
         return -1;
     }
-
-
-    // Build the program executable
-    //
-    err = clBuildProgram(g_program, 0, NULL, NULL, NULL, NULL);
     if (err != CL_SUCCESS)
     {
         size_t len;
         char buffer[2048];
 
         printf("Error: Failed to build program executable!\n");
-        clGetProgramBuildInfo(g_program, g_dev_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+        clGetProgramBuildInfo(inst->program, inst->dev_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
         printf("%s\n", buffer);
-        exit(1);
+        return err;
     }
 
     // Create the compute kernel in the program we wish to run
     //
-    g_kernel = clCreateKernel(g_program, "square", &err);
-    if (!g_kernel || err != CL_SUCCESS)
+    inst->kernel = clCreateKernel(inst->program, "square", &err);
+    if (!inst->kernel || err != CL_SUCCESS)
     {
         printf("Error: Failed to create compute kernel!\n");
-        exit(1);
+        return (err != CL_SUCCESS) ? err : -1;
     }
 
     return 0;
 }
 
 
-PLUGIN_API int __cdecl Initialize( char* path_to_dll )
+PLUGIN_API int __cdecl InitializeInst(PluginHandle inst, char* path_to_dll )
 {
     return 0;
 }
 
-PLUGIN_API int __cdecl Cleanup(void)
+PLUGIN_API int __cdecl CleanupInst(PluginHandle inst)
 {
 
-    clReleaseProgram(g_program);
-    clReleaseKernel(g_kernel);
+    TimingReset();   // the events of the last frame
+    clReleaseProgram(inst->program);
+    clReleaseKernel(inst->kernel);
 
     return 0;
 }
 
-PLUGIN_API int __cdecl SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
+PLUGIN_API int __cdecl SetParamsInst(PluginHandle inst, float* pfp, size_t nfp, int* pip, size_t nip)
 {
     return 0;
 }
 
-PLUGIN_API int __cdecl SetInBufSize(BuffSize* buf, int bufnum)
+PLUGIN_API int __cdecl SetInBufSizeInst(PluginHandle inst, BuffSize* buf, int bufnum)
 {
     if (bufnum == 0) {
-        gInSize = *buf;       // 1 buffer
-        gOutSize = gInSize;   // Output is equal to input
+        inst->inSize = *buf;          // 1 buffer
+        inst->outSize = inst->inSize; // Output is equal to input
     } else {
         return -1;
     }
@@ -127,63 +139,110 @@ PLUGIN_API int __cdecl SetInBufSize(BuffSize* buf, int bufnum)
 
 
 
-PLUGIN_API int __cdecl Prepare(void)
+PLUGIN_API int __cdecl PrepareInst(PluginHandle inst)
 {
     // This is typically the place to initialize internal buffers etc.
     
-    g_count = (cl_uint) gInSize.width;
+    inst->count = (cl_uint) inst->inSize.width;
     return 0;
 }
 
-PLUGIN_API int __cdecl GetOutBufSize(BuffSize* buf, int bufnum)
+PLUGIN_API int __cdecl GetOutBufSizeInst(PluginHandle inst, BuffSize* buf, int bufnum)
 {
-    *buf = gOutSize;
+    *buf = inst->outSize;
     return 0;
 }
 
-PLUGIN_API int __cdecl ProcessCLIO(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue commands, cl_event inEv, cl_event* outEv)
+PLUGIN_API int __cdecl ProcessCLIOInst(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue commands, cl_event inEv, cl_event* outEv)
 {
 
     int err = 0;
     size_t global;                      // global domain size for our calculation
     size_t local;                       // local domain size for our calculation
 
-    err  = clSetKernelArg(g_kernel, 0, sizeof(cl_mem), inbuf);
-    err |= clSetKernelArg(g_kernel, 1, sizeof(cl_mem), outbuf);
-    err |= clSetKernelArg(g_kernel, 2, sizeof(g_count), &g_count);
+    err  = clSetKernelArg(inst->kernel, 0, sizeof(cl_mem), inbuf);
+    err |= clSetKernelArg(inst->kernel, 1, sizeof(cl_mem), outbuf);
+    err |= clSetKernelArg(inst->kernel, 2, sizeof(inst->count), &inst->count);
     if (err != CL_SUCCESS)
     {
         printf("Error: Failed to set kernel arguments! %d\n", err);
-        exit(1);
+        return err;
     }
 
     // Get the maximum work group size for executing the kernel on the device
     //
-    err = clGetKernelWorkGroupInfo(g_kernel, g_dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(local), &local, NULL);
+    err = clGetKernelWorkGroupInfo(inst->kernel, inst->dev_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(local), &local, NULL);
     if (err != CL_SUCCESS)
     {
         printf("Error: Failed to retrieve kernel work group info! %d\n", err);
-        exit(1);
+        return err;
     }
 
     // Execute the kernel over the entire range of our 1d input data set
     // using the maximum number of work group items for this device
     //
-    global = g_count;
-    err = clEnqueueNDRangeKernel(commands, g_kernel, 1, NULL, &global, &local, 1, &inEv, outEv);
+    global = inst->count;
+    err = clEnqueueNDRangeKernel(commands, inst->kernel, 1, NULL, &global, &local, 1, &inEv, outEv);
     if (err)
     {
         printf("Error: Failed to execute kernel!\n");
         return EXIT_FAILURE;
     }
+    if (outEv != NULL) TimingEnqueued("square", commands, *outEv);
     clFinish(commands);
     return 0;
 }
 
 
-PLUGIN_API int __cdecl ProcessMemIO(void* inbuf[], size_t numin, void* outbuf[], size_t numout)
+PLUGIN_API int __cdecl ProcessMemIOInst(PluginHandle inst, void* inbuf[], size_t numin, void* outbuf[], size_t numout)
 {
     return 0;
 }
 
 
+// The plain API, working on g_instance
+
+PLUGIN_API int __cdecl InitializeCL( cl_context ctx, cl_device_id id, char* path_to_dll )
+{
+    return InitializeCLInst(&g_instance, ctx, id, path_to_dll);
+}
+
+PLUGIN_API int __cdecl Initialize( char* path_to_dll )
+{
+    return InitializeInst(&g_instance, path_to_dll);
+}
+
+PLUGIN_API int __cdecl Cleanup(void)
+{
+    return CleanupInst(&g_instance);
+}
+
+PLUGIN_API int __cdecl SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
+{
+    return SetParamsInst(&g_instance, pfp, nfp, pip, nip);
+}
+
+PLUGIN_API int __cdecl SetInBufSize(BuffSize* buf, int bufnum)
+{
+    return SetInBufSizeInst(&g_instance, buf, bufnum);
+}
+
+PLUGIN_API int __cdecl Prepare(void)
+{
+    return PrepareInst(&g_instance);
+}
+
+PLUGIN_API int __cdecl GetOutBufSize(BuffSize* buf, int bufnum)
+{
+    return GetOutBufSizeInst(&g_instance, buf, bufnum);
+}
+
+PLUGIN_API int __cdecl ProcessCLIO(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue commands, cl_event inEv, cl_event* outEv)
+{
+    return ProcessCLIOInst(&g_instance, inbuf, numin, outbuf, numout, commands, inEv, outEv);
+}
+
+PLUGIN_API int __cdecl ProcessMemIO(void* inbuf[], size_t numin, void* outbuf[], size_t numout)
+{
+    return ProcessMemIOInst(&g_instance, inbuf, numin, outbuf, numout);
+}
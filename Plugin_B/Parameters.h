@@ -1,8 +1,4 @@
-// TODO: these should be moved to into Int Parameter Array
-//#define DATA_SIZE_IN (1136*75*32)
-//#define DATA_SIZE_OUT (1136*75)
-#define DATA_SIZE_IN (208*28*16)
-#define DATA_SIZE_OUT (208*28)
+#pragma once
 
 /// <summary> Integer Parameter Array Enumerated Indices </summary>
 typedef enum IntParamIndex {
@@ -15,9 +11,18 @@ typedef enum IntParamIndex {
 	ind_lag_TO,        // = 2, //
 	ind_lag_acq,       // = 1, //
 	ind_interleave,    // = 12 or 16, //
+	ind_fused,         // = 0 or 1, use the fused split/autocorrelation kernel (optional)
+	ind_replay,        // = 0 or 1, enqueue the kernel chain without events between kernels (optional)
+	ind_storage,       // = 0 or 1, StorageFormat of the intermediate Z/L/R buffers (optional)
 	IntParamCount
 };
 
+/// <summary> Formats of the intermediate Z/L/R buffers, see ind_storage </summary>
+typedef enum StorageFormat {
+	storage_short2,    // The 16-bit input samples as they are, converted to float by the kernels that read them
+	storage_float2,    // Converted to float by the split kernel
+};
+
 /// <summary> Float Parameter Array Enumerated Indices </summary>
 typedef enum FloatParamIndex {
 	ind_fs,       //The sampling freqency. [Hz]
@@ -41,6 +46,9 @@ typedef struct ParamStruct{
 	int lag_TO; // = 2; //
 	int lag_acq; // = 1;
 	int interleave; // = 12 or 16;
+	int fused; // = 0 or 1;
+	int replay; // = 0 or 1;
+	int storage; // = 0 or 1;
 
 	float fs; //The sampling freqency. [Hz]
 	float f0; //The central frequency of the excitation. [Hz]
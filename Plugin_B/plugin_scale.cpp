@@ -2,10 +2,15 @@
 #define USP_PLUGIN_DLL 1
 #include "UspPlugin.h"
 #include "UspDebug.h"
+#include "UspProgramCache.h"
+#include "UspTiming.h"
 #include "Parameters.h"
+#include "scale_cpu.h"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <new>
+#include <vector>
 
 // Macros for size calculations
 #define CEIL(num, div) (num + div -1)/div
@@ -15,44 +20,103 @@
 #define snprintf _snprintf
 #endif
 
-// Struct containing the many elements used by the OpenCL
-static struct Glob{
+#ifdef WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+// Most kernels of one frame: split, std_dev, std_dev_finish, velocity_est, arctan,
+// to_velocity_est, to_arctan, maxabsval and combine
+#define MAX_LAUNCHES 9
+
+// Most devices a frame is split across, see InitializeCL
+#define MAX_PARTS 16
+
+// One kernel launch of the chain recorded by PrepareFrames. All arguments except
+// the input and output buffers are bound when it is recorded.
+typedef struct KernelLaunch{
+	cl_kernel kernel;
+	const char* name;  // for GetKernelTimings
+	cl_uint dims;
+	size_t globWrkSize[3];
+	size_t locWrkSize[3];
+} KernelLaunch;
+
+// One part of a frame that is split across the devices of the context, see InitializeCL.
+// The part is a whole instance on one device, set up for its lateral line groups as if they
+// were a frame of their own; the lines of the chain do not depend on each other.
+typedef struct FramePart{
+	PluginInstance* inst;
+	cl_command_queue queue;         // on inst->device, created at the first frame
+	cl_uint compute_units;          // the part's share of the frame is in proportion to these
+	int first_latgroup, latgroups;  // lateral line groups of the frame, none if the frame has too few
+	cl_mem in_stage, out_stage[2];  // copies of the part's slices of the buffers, if they cannot be sub-buffers
+	size_t in_stage_size, out_stage_size[2];
+	// Input, outbufZ and outbufX slices of the last frame, a sub-buffer or the stage. Kept while the
+	// buffer, origin and length stay the same, so the part's kernels stay bound to them
+	cl_mem slice[3], slice_of[3];
+	size_t slice_origin[3], slice_len[3];
+} FramePart;
+
+// Struct containing the many elements used by the OpenCL.
+// One per instance, see CreateInstance. The plain API uses default_instance.
+struct PluginInstance{
     cl_context ctx;             // OpenCL context. Sent by the host application
     cl_device_id device;        // The device id is also sent by the host application
     char srcOpenCL[1024];
+    char moduleDir[1024];       // directory of scale.cl, also used for the program cache
     char * program_source;
 
     cl_program prog;
+    int prog_storage;           // StorageFormat prog was built for
 	
-	cl_kernel split_kernel, combine_kernel, std_dev_kernel, vel_est_kernel, arctan_kernel, to_vel_est_kernel, to_arctan_kernel, maxabsval_kernel, maxabsval2_kernel;
-
-	cl_event event0, event1, event2, event3, event4, event5, event6, event7, event8;
-
-	// for split kernel
+	cl_kernel split_kernel, combine_kernel, std_dev_kernel, vel_est_kernel, arctan_kernel, to_vel_est_kernel, to_arctan_kernel, maxabsval_kernel;
+	cl_kernel split_vel_est_kernel; // fused split, velocity_est and to_velocity_est
+	cl_kernel std_dev_finish_kernel; // second stage of std_dev
+	cl_kernel split_3d_kernel;      // optional, 0 if not found in scale.cl
+
+	// Kernel chain of one frame, each launch waits for the one before it through events[]
+	KernelLaunch launches[MAX_LAUNCHES];
+	cl_event events[MAX_LAUNCHES];
+	int nlaunches;
+	cl_mem bound_in, bound_out[2];   // buffers the first kernel and combine were last bound to
+	cl_command_queue checked_queue;  // last queue checked for in-order execution, see EnqueueFrames
+	bool in_order;
+
+	// Scratch arena. The buffers that depend on the frame size are sub-buffers of it, see CreateScratchBuffers.
+	// host_scratch is the region given by SetScratchBuffer, own_scratch an arena allocated here when there is
+	// none or it is too small. Both are kept from one Prepare to the next.
+	cl_mem host_scratch;
+	size_t host_scratch_offset, host_scratch_size;
+	cl_mem own_scratch;
+	size_t own_scratch_size;
+	size_t scratch_align;       // CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes, for the origin of each sub-buffer
+
+	// for split kernel, in the format of params.storage. In fused mode only the first emission of Z is kept.
+	// Z2 is not used by the velocity estimators and is not split out.
 	cl_mem Z;
-	cl_mem Z2; // don't care?
 	cl_mem L;
 	cl_mem R;
 
 	cl_mem std_dev_sum1_real; //could pack as float2 std_dev_sum1
 	cl_mem std_dev_sum1_imag;
 	cl_mem std_dev_sum2;
-	cl_mem std_dev;
+	cl_mem std_dev;   // the size does not depend on the frame, created by InitializeCL
 
 	// For vel_est (output) and arctan (input) kernels
-	cl_mem temp0;
 	cl_mem temp_re;
 	cl_mem temp_im;
 
 	cl_mem to_vel_est_sum12_re_im;
 
-	// For maxabsval
-	cl_mem scratch, result1, result2;
-	
-	// For maxabsval2
+	// For maxabsval. Running maximum and finished group count per buffer, created by InitializeCL
+	cl_mem max_partial, max_counter;
 	cl_mem maximum;
 
-	// for combine kernel
+	// for combine kernel. outbufZ and outbufX are the two halves of velocities
+	cl_mem velocities;
+	cl_int velocities_stride; // floats from outbufZ to outbufX
 	cl_mem outbufZ;
 	cl_mem outbufZX; //don't care?
 	cl_mem outbufX;
@@ -62,20 +126,42 @@ static struct Glob{
     size_t dataLen, length;
 
 	size_t split_globWrkSize;    	size_t split_locWrkSize;
+	size_t split_3d_globWrkSize[3];	size_t split_3d_locWrkSize[3];
+	size_t split_vel_est_globWrkSize; size_t split_vel_est_locWrkSize;
 	size_t globWrkSize;             size_t locWrkSize;
 	size_t std_dev_globWrkSize;    	size_t std_dev_locWrkSize;
+	size_t std_dev_finish_globWrkSize; size_t std_dev_finish_locWrkSize;
 	size_t arctan_globWrkSize;      size_t arctan_locWrkSize;
 	size_t to_vel_est_globWrkSize;	size_t to_vel_est_locWrkSize;
 	size_t to_arctan_globWrkSize;	size_t to_arctan_locWrkSize;
-	size_t maxabsval_globWrkSize;	size_t maxabsval_locWrkSize;
-	size_t maxabsval2_globWrkSize;	size_t maxabsval2_locWrkSize;
+	size_t maxabsval_globWrkSize[2];	size_t maxabsval_locWrkSize[2];
 	size_t combine_globWrkSize;    	size_t combine_locWrkSize;
 
 	//Parameter struct sent by the host application
 	ParamStruct params; 
+	ParamStruct prepared;  // params the kernel chain was last set up with, see PrepareFrames
 
 	bool memAllocated;
-}glob;
+	bool split_3d; // Prepare() selected the 3-D split kernel
+	bool cpu;      // Initialize() was called instead of InitializeCL(), see scale_cpu.h
+	bool list_dbg; // PrepareFrames lists the intermediate buffers in GetDbgOclMem, see RegisterDbgBuffers
+	ScaleCPU scale_cpu;
+
+	// Frames packed in each buffer, 1 for ProcessCLIO. K frames have the same layout as
+	// one frame of K*nlines lines, so the buffers and NDRanges are set up for nlines lines.
+	// 0 until PrepareFrames has set up the buffers and the chain.
+	int nframes;
+	int nlines;
+
+	// With several devices in the context each frame is split across them, see InitializeCL. The parts
+	// then run the chain and this instance only hands out the slices. nparts is 0 with one device.
+	FramePart parts[MAX_PARTS];
+	int nparts;
+	cl_event out_copied;            // the staged output slices of the last frame are in the output buffers, see EnqueueParts
+};
+
+static PluginInstance default_instance;
+static PluginInstance* dbg_instance = NULL;   // the instance whose buffers GetDbgOclMem lists, see RegisterDbgBuffers
 
 const float PI = static_cast<float>(3.1415927);
 
@@ -86,7 +172,7 @@ const float PI = static_cast<float>(3.1415927);
 /// The function returns boolean false if file is not found 
 /// or whole file is not read, else returns boolean succes.
 /// </summary>
-bool LoadOpenCLSrc()
+bool LoadOpenCLSrc(PluginInstance& glob)
 {
     bool success = true;
 
@@ -118,65 +204,193 @@ bool LoadOpenCLSrc()
     return success;
 }
 
+/// <summary> Releases the kernels and the program, if they have been created.
+/// Returns an OpenCL error number if releasing fails, else returns 0.
+/// </summary>
+static int ReleaseKernels(PluginInstance& glob)
+{
+	cl_kernel* kernels[] = { &glob.split_kernel, &glob.split_vel_est_kernel, &glob.split_3d_kernel, &glob.vel_est_kernel,
+		&glob.std_dev_kernel, &glob.std_dev_finish_kernel, &glob.arctan_kernel, &glob.to_vel_est_kernel,
+		&glob.to_arctan_kernel, &glob.maxabsval_kernel, &glob.combine_kernel };
+	int err = CL_SUCCESS;
+	for (size_t n = 0; n < sizeof(kernels)/sizeof(kernels[0]); n++) {
+		if (*kernels[n] != 0) { err |= clReleaseKernel(*kernels[n]); *kernels[n] = 0; }
+	}
+	if (glob.prog != 0) { err |= clReleaseProgram(glob.prog); glob.prog = 0; }
+	return err;
+}
+
+// Buffers that are sub-buffers of the scratch arena, in the order they are laid out in it
+enum ScratchBuffer {
+	scratch_Z, scratch_L, scratch_R,
+	scratch_sum1_real, scratch_sum1_imag, scratch_sum2,
+	scratch_temp_re, scratch_temp_im, scratch_sum12,
+	scratch_velocities, scratch_outbufZX,
+	SCRATCH_BUFFERS
+};
+
+/// <summary> Sizes in bytes of the scratch buffers for nframes packed frames, 0 for the ones not used.
+/// Follows the work sizes PrepareFrames sets up.
+/// </summary>
+static void ScratchSizes(const PluginInstance& glob, int nframes, size_t sizes[SCRATCH_BUFFERS])
+{
+	size_t Nsamples    = (size_t)glob.params.nlines * nframes * glob.params.nlinesamples;
+	size_t sample_size = (glob.params.storage == storage_float2) ? sizeof(cl_float2) : sizeof(cl_short2);
+	size_t zlr_size    = Nsamples * glob.params.emissions * sample_size;
+	size_t std_dev_groups = ROUND_UP(CEIL(Nsamples,8),64)/64;      // std_dev work groups of 64
+	size_t globWrkSize = ROUND_UP(Nsamples,64);                     // velocity_est work items
+	size_t align_floats = glob.scratch_align/sizeof(cl_float);
+
+	// The fused kernel reads L/R from the input, Z keeps the first emission for std_dev
+	sizes[scratch_Z]         = glob.params.fused ? Nsamples*sample_size : zlr_size;
+	sizes[scratch_L]         = glob.params.fused ? 0 : zlr_size;
+	sizes[scratch_R]         = glob.params.fused ? 0 : zlr_size;
+	sizes[scratch_sum1_real] = std_dev_groups*sizeof(cl_float);     // one partial sum per group
+	sizes[scratch_sum1_imag] = std_dev_groups*sizeof(cl_float);
+	sizes[scratch_sum2]      = std_dev_groups*sizeof(cl_float);
+	sizes[scratch_temp_re]   = globWrkSize*sizeof(cl_float);
+	sizes[scratch_temp_im]   = globWrkSize*sizeof(cl_float);
+	sizes[scratch_sum12]     = globWrkSize*sizeof(cl_float4);
+	sizes[scratch_velocities]= 2*ROUND_UP(Nsamples,align_floats)*sizeof(cl_float); // outbufZ and outbufX, each aligned
+	sizes[scratch_outbufZX]  = Nsamples*sizeof(cl_float);
+}
+
+/// <summary> Places the scratch buffers one after the other, each at a multiple of scratch_align.
+/// Returns the size of the arena they need.
+/// </summary>
+static size_t ScratchLayout(const PluginInstance& glob, const size_t sizes[SCRATCH_BUFFERS], size_t offsets[SCRATCH_BUFFERS])
+{
+	size_t total = 0;
+	for (int n = 0; n < SCRATCH_BUFFERS; n++) {
+		offsets[n] = total;
+		total += ROUND_UP(sizes[n], glob.scratch_align);
+	}
+	return total;
+}
+
+/// <summary> Releases the sub-buffers of the scratch arena, the arenas themselves are kept.
+/// Returns an OpenCL error number if releasing fails, else returns 0.
+/// </summary>
+static int ReleaseScratchBuffers(PluginInstance& glob)
+{
+	cl_mem* bufs[] = { &glob.Z, &glob.L, &glob.R, &glob.std_dev_sum1_real, &glob.std_dev_sum1_imag, &glob.std_dev_sum2,
+		&glob.temp_re, &glob.temp_im, &glob.to_vel_est_sum12_re_im, &glob.outbufZ, &glob.outbufX, &glob.velocities, &glob.outbufZX };
+	int err = CL_SUCCESS;
+	if (dbg_instance == &glob) {
+		DbgOclMemClear();
+		dbg_instance = NULL;
+	}
+	for (size_t n = 0; n < sizeof(bufs)/sizeof(bufs[0]); n++) {
+		if (*bufs[n] != 0) { err |= clReleaseMemObject(*bufs[n]); *bufs[n] = 0; }
+	}
+	return err;
+}
+
+/// <summary> Creates the buffers that depend on the frame size as sub-buffers of the scratch arena.
+/// Uses the region from SetScratchBuffer if it is large enough, else the instance's own arena,
+/// which is only reallocated when it has to grow. No memory is allocated as long as the arena fits.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// @param nframes Number of frames packed in each input and output buffer
+/// </summary>
+static int CreateScratchBuffers(PluginInstance& glob, int nframes)
+{
+	size_t sizes[SCRATCH_BUFFERS], offsets[SCRATCH_BUFFERS];
+	ScratchSizes(glob, nframes, sizes);
+	size_t total = ScratchLayout(glob, sizes, offsets);
+
+	cl_int err = ReleaseScratchBuffers(glob);
+	if (err != CL_SUCCESS)return err;
+
+	cl_mem arena = glob.host_scratch;
+	size_t base  = glob.host_scratch_offset;
+	if (arena == 0 || total > glob.host_scratch_size) {
+		if (glob.own_scratch_size < total) {
+			if (glob.own_scratch != 0) { clReleaseMemObject(glob.own_scratch); glob.own_scratch = 0; glob.own_scratch_size = 0; }
+			glob.own_scratch = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, total, NULL, &err);
+			if (err != CL_SUCCESS)return err;
+			glob.own_scratch_size = total;
+		}
+		arena = glob.own_scratch;
+		base  = 0;
+	} else if (glob.own_scratch != 0) {
+		// The host's region is used from now on
+		clReleaseMemObject(glob.own_scratch);
+		glob.own_scratch = 0;
+		glob.own_scratch_size = 0;
+	}
+
+	cl_mem* bufs[SCRATCH_BUFFERS] = { &glob.Z, &glob.L, &glob.R, &glob.std_dev_sum1_real, &glob.std_dev_sum1_imag, &glob.std_dev_sum2,
+		&glob.temp_re, &glob.temp_im, &glob.to_vel_est_sum12_re_im, &glob.velocities, &glob.outbufZX };
+	cl_buffer_region region;
+	for (int n = 0; n < SCRATCH_BUFFERS; n++) {
+		if (sizes[n] == 0) continue;
+		region.origin = base + offsets[n]; region.size = sizes[n];
+		*bufs[n] = clCreateSubBuffer(arena, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+		if (err != CL_SUCCESS)return err;
+	}
+
+	// outbufZ and outbufX are packed in velocities so maxabsval reduces both in one launch.
+	// Sub-buffers of a sub-buffer are not allowed, so they are made from the arena too
+	size_t Nsamples = (size_t)glob.params.nlines * nframes * glob.params.nlinesamples;
+	glob.velocities_stride = (cl_int)(sizes[scratch_velocities]/2/sizeof(cl_float));
+	region.origin = base + offsets[scratch_velocities]; region.size = Nsamples*sizeof(cl_float);
+	glob.outbufZ  = clCreateSubBuffer(arena, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+	if (err != CL_SUCCESS)return err;
+	region.origin += glob.velocities_stride*sizeof(cl_float);
+	glob.outbufX  = clCreateSubBuffer(arena, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+	return err;
+}
+
 /// <summary> A clean up function.
 /// The OpenCL objects are released with relevant OpenCL functions.
 /// Allocated memory is also freed.
 /// This function must not be called until after ProcessCL
 /// Returns an OpenCL error number if releasing fails, else returns 0.
 /// </summary>
-PLUGIN_API int  Cleanup(void)
+PLUGIN_API int  CleanupInst(PluginHandle inst)
 {
-	// Step 13: Free objects
-	int err = CL_SUCCESS;
-    err |= clReleaseProgram(glob.prog);
-    
-	err |= clReleaseKernel(glob.split_kernel);
-	err |= clReleaseKernel(glob.vel_est_kernel);
-	err |= clReleaseKernel(glob.std_dev_kernel);
-	err |= clReleaseKernel(glob.arctan_kernel);
-	err |= clReleaseKernel(glob.to_vel_est_kernel);
-	err |= clReleaseKernel(glob.to_arctan_kernel);
-	err |= clReleaseKernel(glob.maxabsval_kernel);
-	err |= clReleaseKernel(glob.maxabsval2_kernel);
-	err |= clReleaseKernel(glob.combine_kernel);
-
-	err |= clReleaseEvent(glob.event0);
-	err |= clReleaseEvent(glob.event1);
-	err |= clReleaseEvent(glob.event2);
-	err |= clReleaseEvent(glob.event3);
-	err |= clReleaseEvent(glob.event4);
-	err |= clReleaseEvent(glob.event5);
-	err |= clReleaseEvent(glob.event6);
-	err |= clReleaseEvent(glob.event7);
-	err |= clReleaseEvent(glob.event8);
-
-	// for split kernel
-	err |= clReleaseMemObject(glob.Z);
-	err |= clReleaseMemObject(glob.Z2); // don't care?
-	err |= clReleaseMemObject(glob.L);
-	err |= clReleaseMemObject(glob.R);
-
-	err |= clReleaseMemObject(glob.std_dev_sum1_real);
-	err |= clReleaseMemObject(glob.std_dev_sum1_imag);
-	err |= clReleaseMemObject(glob.std_dev_sum2);
-	err |= clReleaseMemObject(glob.std_dev);
-	err |= clReleaseMemObject(glob.temp0);
-	err |= clReleaseMemObject(glob.temp_re);
-	err |= clReleaseMemObject(glob.temp_im);
-	err |= clReleaseMemObject(glob.to_vel_est_sum12_re_im);
-
-	// for maxabsval kernel
-	err |= clReleaseMemObject(glob.scratch);
-	err |= clReleaseMemObject(glob.result1);
-	err |= clReleaseMemObject(glob.result2);
-	
-	// for maxabsval2 kernel
-	err |= clReleaseMemObject(glob.maximum);
+	PluginInstance& glob = *inst;
+	if (glob.cpu) {
+		CleanupCPU(glob.scale_cpu);
+		return 0;
+	}
 
-	// for combine kernel
-	err |= clReleaseMemObject(glob.outbufZ);
-	err |= clReleaseMemObject(glob.outbufZX); //don't care?
-	err |= clReleaseMemObject(glob.outbufX);
+	// Step 13: Free objects. The kernel events kept for GetKernelTimings first, they hold on to the queues
+	TimingReset();
+	int err = ReleaseKernels(glob);
+
+	// The parts of a split frame, see InitializeCL. Their commands have finished with the host's queue
+	for (int p = 0; p < glob.nparts; p++) {
+		FramePart& part = glob.parts[p];
+		err |= CleanupInst(part.inst);
+		delete part.inst;
+		if (part.queue        != 0) err |= clReleaseCommandQueue(part.queue);
+		if (part.in_stage     != 0) err |= clReleaseMemObject(part.in_stage);
+		if (part.out_stage[0] != 0) err |= clReleaseMemObject(part.out_stage[0]);
+		if (part.out_stage[1] != 0) err |= clReleaseMemObject(part.out_stage[1]);
+		for (int b = 0; b < 3; b++) {
+			if (part.slice[b] != 0) err |= clReleaseMemObject(part.slice[b]);
+		}
+		memset(&part, 0, sizeof(part));
+	}
+	glob.nparts = 0;
+	if (glob.out_copied != 0) { err |= clReleaseEvent(glob.out_copied); glob.out_copied = 0; }
+
+	for (int n = 0; n < MAX_LAUNCHES; n++) {
+		if (glob.events[n] != 0) { err |= clReleaseEvent(glob.events[n]); glob.events[n] = 0; }
+	}
+
+	// Sub-buffers before their arena
+	err |= ReleaseScratchBuffers(glob);
+	if (glob.own_scratch  != 0) { err |= clReleaseMemObject(glob.own_scratch);  glob.own_scratch  = 0; glob.own_scratch_size = 0; }
+	if (glob.host_scratch != 0) { err |= clReleaseMemObject(glob.host_scratch); glob.host_scratch = 0; glob.host_scratch_size = 0; }
+
+	// Buffers of a fixed size, for std_dev and maxabsval
+	if (glob.std_dev     != 0) { err |= clReleaseMemObject(glob.std_dev);     glob.std_dev     = 0; }
+	if (glob.max_partial != 0) { err |= clReleaseMemObject(glob.max_partial); glob.max_partial = 0; }
+	if (glob.max_counter != 0) { err |= clReleaseMemObject(glob.max_counter); glob.max_counter = 0; }
+	if (glob.maximum     != 0) { err |= clReleaseMemObject(glob.maximum);     glob.maximum     = 0; }
+	glob.nframes = 0;
 
 	if(err != CL_SUCCESS)return err;
 
@@ -194,53 +408,34 @@ PLUGIN_API int  Cleanup(void)
 /// </summary>
 PLUGIN_API void  GetPluginInfo(PluginInfo* info)
 {
-    info->UseOpenCL = 1;
-	info->InCLMem = 1;  //1 or 0
-    info->OutCLMem = 1; //1 or 0
+	// Without an OpenCL platform, or with PLUGIN_B_MEMIO set, the host uses the native ProcessMemIO path
+	cl_uint num_platforms = 0;
+	int use_cl = (getenv("PLUGIN_B_MEMIO") == NULL) && (clGetPlatformIDs(0, NULL, &num_platforms) == CL_SUCCESS) && (num_platforms > 0);
+    info->UseOpenCL = use_cl;
+	info->InCLMem = use_cl;  //1 or 0
+    info->OutCLMem = use_cl; //1 or 0
 	info->NumInBuffers = 1;
 	info->NumOutBuffers = 2;
 }
 
-/// <summary> Creates OpenCL program and initializes important OpenCL objects.
-/// Sets the path to OpenCL program file, loads content of file and creates OpenCL program.
-/// Then builds program and if this fails, debugging information is printed.
-/// Afterwards an OpenCL event and kernels are created.
-/// Function returns -1 or -2 respectively if setting file path fails or loading of file fails.
+/// <summary> Builds the OpenCL program for a storage format of the intermediate buffers and creates the kernels.
+/// The program and kernels of an earlier build are released first.
 /// An OpenCL error code is returned if any OpenCL function call fails.
-/// @param ctx An OpenCL context in which the program and kernels are to be created.
-/// @param id An OpenCL device ID also for the program and kernels.
-/// @param path_to_kernel_file A char pointer to dll path
+/// @param storage A StorageFormat. storage_float2 builds scale.cl with -D SAMPLE_FLOAT2
 /// </summary>
-PLUGIN_API int  InitializeCL( cl_context ctx, cl_device_id id, char* path_to_module )
+static int BuildKernels(PluginInstance& glob, int storage)
 {
-    int err = 0;
-    glob.ctx = ctx;
-    glob.device = id;
-
-	//Set path to OpenCL program file
-	memset(glob.srcOpenCL, 0, sizeof(glob.srcOpenCL));
-	if (0 > snprintf(glob.srcOpenCL, sizeof(glob.srcOpenCL), "%s\\%s\0", path_to_module, "scale.cl")){
-		printf("Function: Initialize, Error in setting path\n");
-        return - 1;
-	}
-	//printf("OpenCL file: %s \n", glob.srcOpenCL);
+	int err = ReleaseKernels(glob);
+	if (err != CL_SUCCESS) return err;
 
-	// Step 06: Read kernel file
-	if (!LoadOpenCLSrc())
-	{
-		printf("Function: Initialize, Error in LoadOpenCLSrc()\n");
-		return -2;
-	}
-	
-	// Step 07: Create Kernel program from the read in source
-    glob.prog = clCreateProgramWithSource(glob.ctx, 1, (const char **) & glob.program_source, NULL, &err);
-    if (err != CL_SUCCESS) {
+	// Step 07: Create Kernel program from the read in source, or the binary cached next to the DLL
+	// Step 08: Build Kernel Program
+	const char* options = (storage == storage_float2) ? "-D SAMPLE_FLOAT2" : NULL;
+    err = BuildProgramCached(glob.ctx, glob.device, glob.program_source, options, glob.moduleDir, &glob.prog);
+    if (glob.prog == NULL) {
         printf("Error: Failed to create program with source!\n");
 		return err;
 	}
-
-	// Step 08: Build Kernel Program
-	err |= clBuildProgram(glob.prog, 0, NULL, NULL, NULL, NULL);
     if (err != CL_SUCCESS)
     {
         size_t len;
@@ -248,44 +443,201 @@ PLUGIN_API int  InitializeCL( cl_context ctx, cl_device_id id, char* path_to_mod
         printf("Error: Failed to build program executable!\n");
         clGetProgramBuildInfo(glob.prog, glob.device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
         printf("%s\n", buffer);
-        exit(1);
+        clReleaseProgram(glob.prog);
+        glob.prog = 0;
+        glob.prog_storage = -1;   // built again at the next Prepare
+        return err;
     }
+	glob.prog_storage = storage;
 
     // Step 09: Create OpenCL Kernels
     int glob_err = 0;
-	int step = 0;
 
 	glob.split_kernel      = clCreateKernel(glob.prog, "split",           &err); glob_err |= err; 
+	glob.split_vel_est_kernel = clCreateKernel(glob.prog, "split_velocity_est", &err); glob_err |= err; 
 	glob.vel_est_kernel    = clCreateKernel(glob.prog, "velocity_est",    &err); glob_err |= err; 
 	glob.std_dev_kernel    = clCreateKernel(glob.prog, "std_dev",         &err); glob_err |= err; 
+	glob.std_dev_finish_kernel = clCreateKernel(glob.prog, "std_dev_finish", &err); glob_err |= err; 
 	glob.arctan_kernel     = clCreateKernel(glob.prog, "arctan",          &err); glob_err |= err; 
 	glob.to_vel_est_kernel = clCreateKernel(glob.prog, "to_velocity_est", &err); glob_err |= err; 
 	glob.to_arctan_kernel  = clCreateKernel(glob.prog, "to_arctan",       &err); glob_err |= err; 
 	glob.maxabsval_kernel  = clCreateKernel(glob.prog, "maxabsval",       &err); glob_err |= err; 
-	glob.maxabsval2_kernel = clCreateKernel(glob.prog, "maxabsval2",      &err); glob_err |= err;
 	glob.combine_kernel    = clCreateKernel(glob.prog, "combine",         &err); glob_err |= err;
     if (glob_err != CL_SUCCESS) return glob_err;
-	
-	// Create user event objects
-	glob.event0 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event1 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event2 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event3 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event4 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event5 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event6 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event7 = clCreateUserEvent(glob.ctx, &err); 
-	glob.event8 = clCreateUserEvent(glob.ctx, &err); 
+
+	// Optional kernels. Prepare() falls back to the 1-D split if scale.cl does not have split_3d
+	glob.split_3d_kernel   = clCreateKernel(glob.prog, "split_3d",        &err); if (err != CL_SUCCESS) glob.split_3d_kernel = 0;
+	return 0;
+}
+
+/// <summary> Sets up an instance for one device, see InitializeCL.
+/// Function returns -1 or -2 respectively if setting file path fails or loading of file fails.
+/// An OpenCL error code is returned if any OpenCL function call fails.
+/// </summary>
+static int InitializeDevice(PluginInstance& glob, cl_context ctx, cl_device_id id, char* path_to_module)
+{
+    int err = 0;
+    glob.ctx = ctx;
+    glob.device = id;
+	glob.cpu = false;
+
+	//Set path to OpenCL program file
+	memset(glob.srcOpenCL, 0, sizeof(glob.srcOpenCL));
+	if (0 > snprintf(glob.srcOpenCL, sizeof(glob.srcOpenCL), "%s" PATH_SEP "%s", path_to_module, "scale.cl")){
+		printf("Function: Initialize, Error in setting path\n");
+        return - 1;
+	}
+	memset(glob.moduleDir, 0, sizeof(glob.moduleDir));
+	strncpy(glob.moduleDir, path_to_module, sizeof(glob.moduleDir) - 1);
+	//printf("OpenCL file: %s \n", glob.srcOpenCL);
+
+	// Step 06: Read kernel file
+	if (!LoadOpenCLSrc(glob))
+	{
+		printf("Function: Initialize, Error in LoadOpenCLSrc()\n");
+		return -2;
+	}
+
+	err = BuildKernels(glob, storage_short2);
+	if (err != CL_SUCCESS) return err;
+
+	// Each sub-buffer of the scratch arena must start on the device base address alignment
+	cl_uint align_bits = 0;
+	err = clGetDeviceInfo(glob.device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align_bits), &align_bits, NULL);
+	if (err != CL_SUCCESS) return err;
+	glob.scratch_align = (align_bits/8 > sizeof(cl_float4)) ? align_bits/8 : sizeof(cl_float4);
+
+	// Step 05: Create the buffers whose size does not depend on the frame. The maxabsval kernel
+	// resets max_partial and max_counter itself, they only start at zero
+	if (glob.std_dev == 0) {
+		cl_int zeros[2] = {0, 0};
+		int glob_err = 0;
+		glob.std_dev     = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, sizeof(cl_float), NULL, &err); glob_err |= err;
+		glob.max_partial = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 2*sizeof(cl_int), zeros, &err); glob_err |= err;
+		glob.max_counter = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 2*sizeof(cl_int), zeros, &err); glob_err |= err;
+		glob.maximum     = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, 2*sizeof(cl_float), NULL, &err); glob_err |= err; // one per buffer
+		if (glob_err != CL_SUCCESS) return glob_err;
+	}
+	return 0;
+}
+
+/// <summary> Lists the devices of ctx that a frame is split across: id first, then the other devices of
+/// the same type, at most MAX_PARTS. Devices of another type are left out, as the frame would wait for
+/// the slowest part. Setting PLUGIN_B_ONE_DEVICE keeps the plug-in on id.
+/// Returns the number of devices, 1 if the context has no other device.
+/// </summary>
+static cl_uint ContextDevices(cl_context ctx, cl_device_id id, cl_device_id devices[MAX_PARTS])
+{
+	devices[0] = id;
+	cl_uint ndev = 0;
+	if (getenv("PLUGIN_B_ONE_DEVICE") != NULL) return 1;
+	if (clGetContextInfo(ctx, CL_CONTEXT_NUM_DEVICES, sizeof(ndev), &ndev, NULL) != CL_SUCCESS || ndev < 2) return 1;
+	std::vector<cl_device_id> all(ndev);
+	if (clGetContextInfo(ctx, CL_CONTEXT_DEVICES, ndev*sizeof(cl_device_id), &all[0], NULL) != CL_SUCCESS) return 1;
+
+	cl_device_type type = 0;
+	if (clGetDeviceInfo(id, CL_DEVICE_TYPE, sizeof(type), &type, NULL) != CL_SUCCESS) return 1;
+	cl_uint n = 1;
+	for (cl_uint d = 0; d < ndev && n < MAX_PARTS; d++) {
+		cl_device_type t = 0;
+		if (all[d] == id || clGetDeviceInfo(all[d], CL_DEVICE_TYPE, sizeof(t), &t, NULL) != CL_SUCCESS || t != type) continue;
+		devices[n++] = all[d];
+	}
+	return n;
+}
+
+/// <summary> Sets up one part per device, each a whole instance.
+/// The parts get their share of the frame from SetParams, see SplitFrame.
+/// An OpenCL error code is returned if any OpenCL function call fails.
+/// </summary>
+static int InitializeParts(PluginInstance& glob, const cl_device_id* devices, cl_uint ndev, char* path_to_module)
+{
+	int err = 0;
+	for (cl_uint p = 0; p < ndev; p++) {
+		FramePart& part = glob.parts[p];
+		part.inst = new (std::nothrow) PluginInstance();
+		if (part.inst == NULL) return CL_OUT_OF_HOST_MEMORY;
+		glob.nparts = p + 1;   // CleanupInst frees the parts set up so far
+		err = InitializeDevice(*part.inst, glob.ctx, devices[p], path_to_module);
+		if (err != CL_SUCCESS) return err;
+
+		part.compute_units = 1;
+		clGetDeviceInfo(devices[p], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(part.compute_units), &part.compute_units, NULL);
+		if (part.compute_units == 0) part.compute_units = 1;
+		// The regions of the parts in a scratch arena start on the largest alignment of them all
+		if (part.inst->scratch_align > glob.scratch_align) glob.scratch_align = part.inst->scratch_align;
+	}
+	return 0;
+}
+
+/// <summary> Creates OpenCL program and initializes important OpenCL objects.
+/// Sets the path to OpenCL program file, loads content of file and creates OpenCL program.
+/// Then builds program and if this fails, debugging information is printed.
+/// Afterwards the kernels are created, see BuildKernels. The program is built for short2
+/// intermediate buffers, Prepare() rebuilds it if SetParams selects another StorageFormat.
+/// If ctx holds more devices of the type of id, e.g. several GPUs or the NUMA nodes of a CPU split
+/// into sub-devices, each frame is split across them by lateral line groups and every device runs
+/// the chain on its share, see EnqueueParts.
+/// Function returns -1 or -2 respectively if setting file path fails or loading of file fails.
+/// An OpenCL error code is returned if any OpenCL function call fails.
+/// @param ctx An OpenCL context in which the program and kernels are to be created.
+/// @param id An OpenCL device ID also for the program and kernels.
+/// @param path_to_kernel_file A char pointer to dll path
+/// </summary>
+PLUGIN_API int  InitializeCLInst(PluginHandle inst, cl_context ctx, cl_device_id id, char* path_to_module )
+{
+	PluginInstance& glob = *inst;
+	cl_device_id devices[MAX_PARTS];
+	cl_uint ndev = ContextDevices(ctx, id, devices);
+	int err = 0;
+	if (ndev < 2) {
+		err = InitializeDevice(glob, ctx, id, path_to_module);
+		glob.list_dbg = true;
+	} else if (glob.nparts == 0) {   // else the parts of an earlier call are kept
+		glob.ctx = ctx;
+		glob.device = id;
+		glob.cpu = false;
+		err = InitializeParts(glob, devices, ndev, path_to_module);
+	}
+	if (err != CL_SUCCESS) return err;
+
 	printf("end initialize\n");
 	return 0;
 }
 
-/// <summary> Not needed in current implementation </summary>
-PLUGIN_API int  Initialize( char* path_to_dll )
+/// <summary> Selects the native CPU implementation, used when GetPluginInfo reports no OpenCL.
+/// Prepare and ProcessMemIO then work without any OpenCL objects.
+/// </summary>
+PLUGIN_API int  InitializeInst(PluginHandle inst, char* path_to_dll )
 {
+	PluginInstance& glob = *inst;
+	glob.cpu = true;
     return 0;
 }
 
+/// <summary> Shares the lateral line groups of a frame out to the parts in proportion to their compute units,
+/// and gives each part the parameters of its share. A part left without a line group sits the frame out.
+/// </summary>
+static void SplitFrame(PluginInstance& glob)
+{
+	int group_lines = glob.params.interleave/4;
+	int groups = (group_lines > 0) ? glob.params.nlines/group_lines : 0;
+	cl_uint total = 0, units = 0;
+	for (int p = 0; p < glob.nparts; p++) total += glob.parts[p].compute_units;
+
+	int first = 0;
+	for (int p = 0; p < glob.nparts; p++) {
+		FramePart& part = glob.parts[p];
+		units += part.compute_units;
+		int end = (int)((size_t)groups*units/total);   // cumulative, so the shares always add up to the frame
+		part.first_latgroup = first;
+		part.latgroups      = end - first;
+		part.inst->params   = glob.params;
+		part.inst->params.nlines = part.latgroups*group_lines;
+		first = end;
+	}
+}
+
 /// <summary>Sets parameters
 /// Returns zero no matter what.
 /// @param pfp A pointer to a Float array of parameters
@@ -293,8 +645,9 @@ PLUGIN_API int  Initialize( char* path_to_dll )
 /// @param pip A pointer to a Integer array of parameters
 /// @param nip Integer value number of int parameters
 /// </summary>
-PLUGIN_API int  SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
+PLUGIN_API int  SetParamsInst(PluginHandle inst, float* pfp, size_t nfp, int* pip, size_t nip)
 {
+	PluginInstance& glob = *inst;
 	// Set parameters in Global struct
 	glob.params.emissions    = pip[ind_emissions];
 	glob.params.nlines       = pip[ind_nlines];
@@ -305,6 +658,9 @@ PLUGIN_API int  SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
 	glob.params.lag_TO       = pip[ind_lag_TO];
 	glob.params.lag_acq      = pip[ind_lag_acq];
 	glob.params.interleave   = pip[ind_interleave];
+	glob.params.fused        = (nip > ind_fused) ? pip[ind_fused] : 0; // optional
+	glob.params.replay       = (nip > ind_replay) ? pip[ind_replay] : 0; // optional
+	glob.params.storage      = (nip > ind_storage) ? pip[ind_storage] : storage_short2; // optional
 	
 	glob.params.fs           = pfp[ind_fs];
 	glob.params.f0           = pfp[ind_f0];
@@ -312,6 +668,7 @@ PLUGIN_API int  SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
 	glob.params.fprf         = pfp[ind_fprf];
 	glob.params.depth        = pfp[ind_depth];
 	glob.params.lambda_X     = pfp[ind_lambda_X];
+	if (glob.nparts > 0) SplitFrame(glob);
 	return 0;
 }
 
@@ -323,47 +680,155 @@ PLUGIN_API int  SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
 /// @param buf A pointer to a BuffSize struct containing input buffer information
 /// @param bufnum Integer value
 /// </summary>
-PLUGIN_API int  SetInBufSize(BuffSize* buf, int bufnum)
+PLUGIN_API int  SetInBufSizeInst(PluginHandle inst, BuffSize* buf, int bufnum)
 {
+	PluginInstance& glob = *inst;
 	if (buf->sampleType != SAMPLE_FORMAT_INT16X2) return -1;
     glob.inSize[bufnum]  = *buf;
 	return 0;
 }
 
-/// <summary>Prepares OpenCL kernels for execution.
-/// Calculates global work size based on hardcoded local work size for the two kernels.
-/// Then does some memory handling of intermediate buffers and creates buffers.
-/// At last the kernel arguments that doesn't change are set.
-/// This function must not be called before InitializeCL
+/// <summary>Appends a kernel to the chain that EnqueueFrames enqueues.
+/// @param dims Number of dimensions of the NDRange, 1 to 3
+/// </summary>
+static void RecordLaunch(PluginInstance& glob, cl_kernel kernel, const char* name, cl_uint dims, const size_t* globWrkSize, const size_t* locWrkSize)
+{
+	KernelLaunch& k = glob.launches[glob.nlaunches++];
+	k.kernel = kernel;
+	k.name   = name;
+	k.dims   = dims;
+	for (cl_uint d = 0; d < 3; d++) {
+		k.globWrkSize[d] = (d < dims) ? globWrkSize[d] : 1;
+		k.locWrkSize[d]  = (d < dims) ? locWrkSize[d]  : 1;
+	}
+}
+
+/// <summary> True if going from parameters a to b changes the size of a buffer, a work size or the chain of kernels.
+/// The parameters not compared here only enter the scalar kernel arguments, see SetScalarArgs.
+/// </summary>
+static bool LayoutChanged(const ParamStruct& a, const ParamStruct& b)
+{
+	return a.emissions != b.emissions || a.nlines != b.nlines || a.nlinesamples != b.nlinesamples
+		|| a.numb_avg != b.numb_avg || a.avg_offset != b.avg_offset || a.interleave != b.interleave
+		|| a.fused != b.fused || a.storage != b.storage;
+}
+
+/// <summary>Sets the kernel arguments that are derived from the scalar parameters: the velocity scale factors
+/// (from c, fprf, f0, fs, depth, lambda_X and the lags) and lag_TO. Cheap, no buffer is touched.
 /// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
 /// </summary>
-PLUGIN_API int  Prepare(void)
+static int SetScalarArgs(PluginInstance& glob)
 {
-	// Set parameters and arguments for stand-alone DLL in UseCase
 	float scale   = static_cast<float>(glob.params.c*glob.params.fprf/(4.0*PI*glob.params.f0*glob.params.lag_axial)/glob.params.lag_acq);
 	float k_axial = static_cast<float>(glob.params.c*glob.params.fprf/(2.0*PI*4.0*glob.params.f0)/glob.params.lag_acq);
 	float k_trans = static_cast<float>(glob.params.fprf*glob.params.c*glob.params.lambda_X/(2.0*glob.params.fs*glob.params.depth*2.0*PI*2.0*glob.params.lag_TO*glob.params.lag_acq));
-	int Nsamples  = glob.params.nlines * glob.params.nlinesamples;
+
+	cl_int err = CL_SUCCESS;
+	if (glob.params.fused) {
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 5, sizeof(cl_int), &glob.params.lag_TO);
+	} else {
+		err |= clSetKernelArg(glob.to_vel_est_kernel, 2, sizeof(cl_int), &glob.params.lag_TO);
+	}
+	err |= clSetKernelArg(glob.arctan_kernel,     2, sizeof(cl_float), &scale);
+	err |= clSetKernelArg(glob.to_arctan_kernel,  1, sizeof(cl_float), &k_axial);
+	err |= clSetKernelArg(glob.to_arctan_kernel,  2, sizeof(cl_float), &k_trans);
+	err |= clSetKernelArg(glob.combine_kernel,    3, sizeof(cl_float), &scale);
+	return err;
+}
+
+/// <summary> Lists the intermediate buffers of the instance in GetDbgOclMem, under the names of their
+/// fields, so a host can read them back after a frame. Only the first frame of each is listed.
+/// Called by PrepareFrames for the instance last prepared; with a split frame that is the first part
+/// with a share, whose lines are the first of the frame. ReleaseScratchBuffers empties the list again.
+/// </summary>
+static void RegisterDbgBuffers(PluginInstance& glob)
+{
+	size_t Nsamples = (size_t)glob.params.nlines*glob.params.nlinesamples;
+	DbgOclMemClear();   // also fills numBytesPerSample the first time
+	dbg_instance = &glob;
+	DbgOclMem dbg[5] = {
+		DBG_OCL_BUF1(glob.temp_re, SAMPLE_FORMAT_FLOAT32, Nsamples),
+		DBG_OCL_BUF1(glob.temp_im, SAMPLE_FORMAT_FLOAT32, Nsamples),
+		DBG_OCL_BUF1(glob.to_vel_est_sum12_re_im, SAMPLE_FORMAT_FLOAT32, 4*Nsamples),   // sum1_re, sum1_im, sum2_re, sum2_im
+		DBG_OCL_BUF1(glob.outbufZ, SAMPLE_FORMAT_FLOAT32, Nsamples),
+		DBG_OCL_BUF1(glob.outbufX, SAMPLE_FORMAT_FLOAT32, Nsamples) };
+	const char* names[5] = { "temp_re", "temp_im", "to_vel_est_sum12_re_im", "outbufZ", "outbufX" };
+	for (int n = 0; n < 5; n++) {
+		dbg[n].name = (char*)names[n];
+		DbgOclMemAppend(dbg[n]);
+	}
+}
+
+/// <summary>Prepares OpenCL kernels for execution of nframes packed frames.
+/// If the chain is already set up for nframes and only scalar parameters have changed since
+/// (e.g. fprf or lambda_X), only their kernel arguments are set again, see SetScalarArgs.
+/// Otherwise calculates global work size based on hardcoded local work size for the two kernels.
+/// Then creates the intermediate buffers in the scratch arena, see CreateScratchBuffers.
+/// At last all kernel arguments except the input and output buffers are set, and
+/// the chain of kernels is recorded for EnqueueFrames.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// @param nframes Number of frames in each input and output buffer
+/// </summary>
+int PrepareFrames(PluginInstance& glob, int nframes)
+{
+	if (glob.nframes == nframes && !LayoutChanged(glob.prepared, glob.params)) {
+		glob.prepared = glob.params;
+		if (glob.list_dbg) RegisterDbgBuffers(glob);
+		return SetScalarArgs(glob);
+	}
+
+	glob.nframes  = 0;   // Set once the chain is complete
+	glob.nlines   = glob.params.nlines * nframes;
+	int Nsamples  = glob.nlines * glob.params.nlinesamples;
 
     // This is typically the place to initialize internal buffers etc.
     // The right way is to keep track if buffers have been allocated
     // and to release them if reallocation is needed
     cl_int err = CL_SUCCESS;
 
+	// The storage format of Z/L/R is a build option of scale.cl
+	if (glob.params.storage != glob.prog_storage) {
+		err = BuildKernels(glob, glob.params.storage);
+		if (err != CL_SUCCESS)return err;
+	}
+
 	// Split kernel
 	glob.split_locWrkSize = 64;       glob.split_globWrkSize = (size_t)(ROUND_UP(glob.params.nlinesamples,glob.split_locWrkSize));
 	//printf("split:            global work size: %d, local work size: %d\n",glob.split_globWrkSize,glob.split_locWrkSize);
 
+	// 3-D split kernel, one work item per [line sample, Z/L/R block, emission*latgroup]. Used when available
+	glob.split_3d = (glob.split_3d_kernel != 0);
+	if (glob.split_3d) {
+		size_t maxWrkSize = 64;
+		err = clGetKernelWorkGroupInfo(glob.split_3d_kernel, glob.device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxWrkSize), &maxWrkSize, NULL);
+		if (err != CL_SUCCESS)return err;
+		glob.split_3d_locWrkSize[0] = (maxWrkSize < 64) ? maxWrkSize : 64;
+		glob.split_3d_locWrkSize[1] = 1;
+		glob.split_3d_locWrkSize[2] = 1;
+		glob.split_3d_globWrkSize[0] = (size_t)(ROUND_UP(glob.params.nlinesamples,glob.split_3d_locWrkSize[0]));
+		glob.split_3d_globWrkSize[1] = 3*(glob.params.interleave/4); // Z, L and R of each position
+		glob.split_3d_globWrkSize[2] = glob.params.emissions * (glob.nlines/(glob.params.interleave/4)); // emissions * latgroups
+	}
+
+	// Fused split/velocity_est/to_velocity_est kernel
+	glob.split_vel_est_locWrkSize = 64; glob.split_vel_est_globWrkSize = (size_t)(ROUND_UP(Nsamples,glob.split_vel_est_locWrkSize));
+	//printf("split_velocity_est: global work size: %d, local work size: %d\n",glob.split_vel_est_globWrkSize,glob.split_vel_est_locWrkSize);
+
 	// Standard deviation kernel
 	glob.std_dev_locWrkSize = 64;    glob.std_dev_globWrkSize = (size_t)(ROUND_UP(CEIL(Nsamples,8),glob.std_dev_locWrkSize));
 	//printf("std_dev:          global work size: %d, local work size: %d\n",glob.std_dev_globWrkSize,glob.std_dev_locWrkSize);
+	int std_dev_groups = (int)(glob.std_dev_globWrkSize/glob.std_dev_locWrkSize);
+
+	// std_dev_finish kernel, a single work group
+	glob.std_dev_finish_locWrkSize = 64; glob.std_dev_finish_globWrkSize = glob.std_dev_finish_locWrkSize;
 
 	// velocity_est kernel
 	glob.locWrkSize = 64;            glob.globWrkSize = (size_t)(ROUND_UP(Nsamples,glob.locWrkSize));
 	//printf("velocity_est:     global work size: %d, local work size: %d\n",glob.globWrkSize,glob.locWrkSize);
 
-	// Arctan kernel
+	// Arctan kernel. Each group keeps sums of the values its windows cover in local memory
 	glob.arctan_locWrkSize = 64;     glob.arctan_globWrkSize = (size_t)(ROUND_UP(Nsamples,glob.arctan_locWrkSize));
+	size_t arctan_tile = (glob.arctan_locWrkSize - 1)*glob.params.avg_offset + glob.params.numb_avg;
 	//printf("arctan:           global work size: %d, local work size: %d\n",glob.arctan_globWrkSize,glob.arctan_locWrkSize);
 
 	// to_velocity_est kernel
@@ -372,117 +837,273 @@ PLUGIN_API int  Prepare(void)
 
 	// TO_Arctan kernel
 	glob.to_arctan_locWrkSize = 64;  glob.to_arctan_globWrkSize = (size_t)(ROUND_UP(Nsamples,glob.to_arctan_locWrkSize));
+	size_t to_arctan_tile = (glob.to_arctan_locWrkSize - 1)*glob.params.avg_offset + glob.params.numb_avg;
 	//printf("to_arctan:        global work size: %d, local work size: %d\n",glob.to_arctan_globWrkSize,glob.to_arctan_locWrkSize);
 
-	// maxabsval kernel
-	glob.maxabsval_locWrkSize = 64;  glob.maxabsval_globWrkSize = (size_t)(ROUND_UP(Nsamples,glob.maxabsval_locWrkSize));
-	//printf("maxabsval:          global work size: %d, local work size: %d\n",glob.maxabsval_globWrkSize,glob.maxabsval_locWrkSize);
-
-	// maxabsval2 kernel
-	glob.maxabsval2_locWrkSize = 1;  glob.maxabsval2_globWrkSize = (size_t)(ROUND_UP(1,glob.maxabsval2_locWrkSize));
-	//printf("maxabsval2:       global work size: %d, local work size: %d\n",glob.maxabsval2_globWrkSize,glob.maxabsval2_locWrkSize);
+	// maxabsval kernel, dimension 1 is one row per buffer (outbufZ and outbufX)
+	glob.maxabsval_locWrkSize[0] = 64; glob.maxabsval_globWrkSize[0] = (size_t)(ROUND_UP(Nsamples,glob.maxabsval_locWrkSize[0]));
+	glob.maxabsval_locWrkSize[1] = 1;  glob.maxabsval_globWrkSize[1] = 2;
+	//printf("maxabsval:        global work size: %d, local work size: %d\n",glob.maxabsval_globWrkSize[0],glob.maxabsval_locWrkSize[0]);
 
 	// Combine kernel
 	glob.combine_locWrkSize = 64;    glob.combine_globWrkSize = (size_t)(ROUND_UP(Nsamples,glob.combine_locWrkSize));
 	//printf("combine:          global work size: %d, local work size: %d\n",glob.combine_globWrkSize,glob.combine_locWrkSize);
 
-	// Buffer memory checking and handling for split kernel
-	if (glob.Z  != 0) { clReleaseMemObject(glob.Z);  glob.Z  = 0; }
-	if (glob.Z2 != 0) { clReleaseMemObject(glob.Z2); glob.Z2 = 0; }
-	if (glob.R  != 0) { clReleaseMemObject(glob.R);  glob.R  = 0; }
-	if (glob.L  != 0) { clReleaseMemObject(glob.L);  glob.L  = 0; }
-
-	// Buffer memory checking and handling for std deviation kernel
-	if (glob.std_dev_sum1_real != 0) { clReleaseMemObject(glob.std_dev_sum1_real); glob.std_dev_sum1_real = 0; } //could pack as float2
-	if (glob.std_dev_sum1_imag != 0) { clReleaseMemObject(glob.std_dev_sum1_imag); glob.std_dev_sum1_imag = 0; }
-	if (glob.std_dev_sum2      != 0) { clReleaseMemObject(glob.std_dev_sum2);      glob.std_dev_sum2 = 0;      }
-	if (glob.std_dev           != 0) { clReleaseMemObject(glob.std_dev);           glob.std_dev = 0;           }
-	
-	// Buffer memory checking and handling for vel_est/arctan kernels
-	if (glob.temp0    != 0) { clReleaseMemObject(glob.temp0);    glob.temp0   = 0; }
-	if (glob.temp_re  != 0) { clReleaseMemObject(glob.temp_re);  glob.temp_re = 0;  }
-	if (glob.temp_im  != 0) { clReleaseMemObject(glob.temp_im);  glob.temp_im = 0;  }
-	
-	// Buffer memory checking and handling for to_vel_est/to_arctan kernels
-	if(glob.to_vel_est_sum12_re_im != 0){ clReleaseMemObject(glob.to_vel_est_sum12_re_im); glob.to_vel_est_sum12_re_im = 0; }
-
-	// Buffer memory checking and handling for maxabsval kernel
-	if (glob.scratch != 0) { clReleaseMemObject(glob.scratch); glob.scratch = 0; }
-	if (glob.result1 != 0) { clReleaseMemObject(glob.result1); glob.result1 = 0; }
-	if (glob.result2 != 0) { clReleaseMemObject(glob.result2); glob.result2 = 0; }
-			
-	// Buffer memory checking and handling for maxabsval2 kernel?
-	if (glob.maximum != 0) { clReleaseMemObject(glob.maximum); glob.maximum = 0; }
-
-	// Buffer memory checking and handling for combine kernel
-	if (glob.outbufZ != 0) { clReleaseMemObject(glob.outbufZ);  glob.outbufZ = 0; }
-	if (glob.outbufZX!= 0) { clReleaseMemObject(glob.outbufZX); glob.outbufZX= 0; } //don't care?
-	if (glob.outbufX != 0) { clReleaseMemObject(glob.outbufX);  glob.outbufX = 0; }
-
-	// Step 05: Create memory buffer objects
-	glob.Z  = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*glob.params.emissions*sizeof(cl_float2), NULL, &err);
-	glob.Z2 = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*glob.params.emissions*sizeof(cl_float2), NULL, &err);
-	glob.L  = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*glob.params.emissions*sizeof(cl_float2), NULL, &err);
-	glob.R  = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*glob.params.emissions*sizeof(cl_float2), NULL, &err); 
-
-	// Buffer creation for std deviation kernel
-	glob.std_dev_sum1_real   = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*sizeof(float), NULL, &err);
-	glob.std_dev_sum1_imag   = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*sizeof(float), NULL, &err); 
-	glob.std_dev_sum2        = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*sizeof(float), NULL, &err); 
-	glob.std_dev             = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, sizeof(float), NULL, &err); 
-
-	// Buffer creation for vel_est/arctan kernels
-	glob.temp_re             = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.globWrkSize*sizeof(cl_float), NULL, &err);
-	glob.temp_im             = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.globWrkSize*sizeof(cl_float), NULL, &err);
-
-	// Buffer creation for to_vel_est/to_arctan kernels
-	glob.to_vel_est_sum12_re_im = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.globWrkSize*sizeof(cl_float4), NULL, &err);
-
-	// Buffer creation for arctan_kernel 
-	glob.outbufZ     = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*sizeof(cl_float), NULL, &err); 
-
-	// Buffer creation for to_arctan_kernel
-	glob.outbufZX    = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*sizeof(cl_float), NULL, &err); //don't care?
-	glob.outbufX     = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, glob.params.nlinesamples*glob.params.nlines*sizeof(cl_float), NULL, &err); 
-
-	// Buffer creation for maxabsval_kernel
-	glob.scratch = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, 64*sizeof(cl_float), NULL, &err);
-	glob.result1 = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, ROUND_UP(glob.params.nlinesamples*glob.params.nlines,64)*sizeof(cl_float), NULL, &err); // 64 is local work size
-	glob.result2 = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, ROUND_UP(glob.params.nlinesamples*glob.params.nlines,64)*sizeof(cl_float), NULL, &err); // 64 is local work size
+	// Step 05: Create memory buffer objects, as sub-buffers of the scratch arena. Nothing is allocated if it is large enough
+	err = CreateScratchBuffers(glob, nframes);
 	if (err != CL_SUCCESS)return err;
 
-	// Buffer creation for maxabsval2_kernel
-	glob.maximum = clCreateBuffer(glob.ctx, CL_MEM_READ_WRITE, 1*sizeof(cl_float), NULL, &err); //just need one
-	if (err != CL_SUCCESS)return err;
+	// Step 10: Set OpenCL kernel arguments. Only the input and output buffers change from frame to frame,
+	// EnqueueFrames binds those. The ones derived from scalar parameters are set by SetScalarArgs
+	glob.bound_in = 0;
+	glob.bound_out[0] = glob.bound_out[1] = 0;
+	glob.nlaunches = 0;
+
+	if (glob.params.fused) {
+		// Fused kernel arguments. Replaces split, velocity_est and to_velocity_est
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 1, sizeof(cl_int), &glob.params.nlinesamples);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 2, sizeof(cl_int), &glob.nlines);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 3, sizeof(cl_int), &glob.params.interleave);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 4, sizeof(cl_int), &glob.params.emissions);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 6, sizeof(cl_mem), &glob.Z);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 7, sizeof(cl_mem), &glob.temp_re);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 8, sizeof(cl_mem), &glob.temp_im);
+		err |= clSetKernelArg(glob.split_vel_est_kernel, 9, sizeof(cl_mem), &glob.to_vel_est_sum12_re_im);
+		RecordLaunch(glob, glob.split_vel_est_kernel, "split_velocity_est", 1, &glob.split_vel_est_globWrkSize, &glob.split_vel_est_locWrkSize);
+	} else {
+		// Split kernel arguments, the same for the 1-D and the 3-D kernel
+		cl_kernel split = glob.split_3d ? glob.split_3d_kernel : glob.split_kernel;
+		err |= clSetKernelArg(split,  1, sizeof(cl_int), &glob.params.nlinesamples);
+		err |= clSetKernelArg(split,  2, sizeof(cl_int), &glob.nlines);
+		err |= clSetKernelArg(split,  3, sizeof(cl_int), &glob.params.interleave);
+		err |= clSetKernelArg(split,  4, sizeof(cl_int), &glob.params.emissions);
+		err |= clSetKernelArg(split,  5, sizeof(cl_mem), &glob.Z);
+		err |= clSetKernelArg(split,  6, sizeof(cl_mem), &glob.L);
+		err |= clSetKernelArg(split,  7, sizeof(cl_mem), &glob.R);
+		if (glob.split_3d) RecordLaunch(glob, split, "split_3d", 3, glob.split_3d_globWrkSize, glob.split_3d_locWrkSize);
+		else               RecordLaunch(glob, split, "split",    1, &glob.split_globWrkSize,  &glob.split_locWrkSize);
+	}
 
-	// Step 10: Set OpenCL kernel arguments	that don't change
-	err |= clSetKernelArg(glob.std_dev_kernel,    5, sizeof(cl_int),   &glob.params.emissions);    
-		
-	err |= clSetKernelArg(glob.vel_est_kernel,    3, sizeof(cl_int),   &glob.params.emissions);   
-	err |= clSetKernelArg(glob.vel_est_kernel,    4, sizeof(cl_int),   &Nsamples);
-	
-	err |= clSetKernelArg(glob.to_vel_est_kernel, 2, sizeof(cl_int),   &glob.params.lag_TO);       
-	err |= clSetKernelArg(glob.to_vel_est_kernel, 3, sizeof(cl_int),   &glob.params.emissions);    
-	err |= clSetKernelArg(glob.to_vel_est_kernel, 4, sizeof(cl_int),   &Nsamples);
-	
-	err |= clSetKernelArg(glob.to_arctan_kernel,  1, sizeof(cl_float), &k_axial);
-	err |= clSetKernelArg(glob.to_arctan_kernel,  2, sizeof(cl_float), &k_trans);
+	// Standard deviation kernel arguments
+	err |= clSetKernelArg(glob.std_dev_kernel,    0, sizeof(cl_mem), &glob.Z);
+	err |= clSetKernelArg(glob.std_dev_kernel,    1, sizeof(cl_float)*glob.std_dev_locWrkSize, NULL);
+	err |= clSetKernelArg(glob.std_dev_kernel,    2, sizeof(cl_float)*glob.std_dev_locWrkSize, NULL);
+	err |= clSetKernelArg(glob.std_dev_kernel,    3, sizeof(cl_float)*glob.std_dev_locWrkSize, NULL);
+	err |= clSetKernelArg(glob.std_dev_kernel,    4, sizeof(cl_int), &Nsamples);
+	err |= clSetKernelArg(glob.std_dev_kernel,    5, sizeof(cl_mem), &glob.std_dev_sum1_real); //could pack as float2
+	err |= clSetKernelArg(glob.std_dev_kernel,    6, sizeof(cl_mem), &glob.std_dev_sum1_imag);
+	err |= clSetKernelArg(glob.std_dev_kernel,    7, sizeof(cl_mem), &glob.std_dev_sum2);
+	RecordLaunch(glob, glob.std_dev_kernel, "std_dev", 1, &glob.std_dev_globWrkSize, &glob.std_dev_locWrkSize);
+
+	// Second stage of the standard deviation, reduces the partial sums of std_dev
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 0, sizeof(cl_mem), &glob.std_dev_sum1_real);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 1, sizeof(cl_mem), &glob.std_dev_sum1_imag);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 2, sizeof(cl_mem), &glob.std_dev_sum2);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 3, sizeof(cl_int), &std_dev_groups);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 4, sizeof(cl_int), &Nsamples);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 5, sizeof(cl_float)*glob.std_dev_finish_locWrkSize, NULL);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 6, sizeof(cl_float)*glob.std_dev_finish_locWrkSize, NULL);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 7, sizeof(cl_float)*glob.std_dev_finish_locWrkSize, NULL);
+	err |= clSetKernelArg(glob.std_dev_finish_kernel, 8, sizeof(cl_mem), &glob.std_dev);
+	RecordLaunch(glob, glob.std_dev_finish_kernel, "std_dev_finish", 1, &glob.std_dev_finish_globWrkSize, &glob.std_dev_finish_locWrkSize);
+
+	if (!glob.params.fused) {
+		err |= clSetKernelArg(glob.vel_est_kernel,    0, sizeof(cl_mem), &glob.Z);
+		err |= clSetKernelArg(glob.vel_est_kernel,    1, sizeof(cl_mem), &glob.temp_re);
+		err |= clSetKernelArg(glob.vel_est_kernel,    2, sizeof(cl_mem), &glob.temp_im);
+		err |= clSetKernelArg(glob.vel_est_kernel,    3, sizeof(cl_int), &glob.params.emissions);
+		err |= clSetKernelArg(glob.vel_est_kernel,    4, sizeof(cl_int), &Nsamples);
+		err |= clSetKernelArg(glob.vel_est_kernel,    5, sizeof(cl_mem), &glob.std_dev);
+		RecordLaunch(glob, glob.vel_est_kernel, "velocity_est", 1, &glob.globWrkSize, &glob.locWrkSize);
+	}
+
+	err |= clSetKernelArg(glob.arctan_kernel,     0, sizeof(cl_mem),   &glob.temp_re);
+	err |= clSetKernelArg(glob.arctan_kernel,     1, sizeof(cl_mem),   &glob.temp_im);
+	err |= clSetKernelArg(glob.arctan_kernel,     3, sizeof(cl_int),   &glob.params.numb_avg);
+	err |= clSetKernelArg(glob.arctan_kernel,     4, sizeof(cl_int),   &glob.params.avg_offset);
+	err |= clSetKernelArg(glob.arctan_kernel,     5, sizeof(cl_int),   &glob.params.nlinesamples);
+	err |= clSetKernelArg(glob.arctan_kernel,     6, sizeof(cl_int),   &Nsamples);
+	err |= clSetKernelArg(glob.arctan_kernel,     7, sizeof(cl_float4)*arctan_tile, NULL);   // block sums of the group's windows
+	err |= clSetKernelArg(glob.arctan_kernel,     8, sizeof(cl_float4)*arctan_tile, NULL);
+	err |= clSetKernelArg(glob.arctan_kernel,     9, sizeof(cl_mem),   &glob.outbufZ);
+	RecordLaunch(glob, glob.arctan_kernel, "arctan", 1, &glob.arctan_globWrkSize, &glob.arctan_locWrkSize);
+
+	if (!glob.params.fused) {
+		err |= clSetKernelArg(glob.to_vel_est_kernel, 0, sizeof(cl_mem), &glob.L);
+		err |= clSetKernelArg(glob.to_vel_est_kernel, 1, sizeof(cl_mem), &glob.R);
+		err |= clSetKernelArg(glob.to_vel_est_kernel, 3, sizeof(cl_int), &glob.params.emissions);
+		err |= clSetKernelArg(glob.to_vel_est_kernel, 4, sizeof(cl_int), &Nsamples);
+		err |= clSetKernelArg(glob.to_vel_est_kernel, 5, sizeof(cl_mem), &glob.to_vel_est_sum12_re_im);
+		RecordLaunch(glob, glob.to_vel_est_kernel, "to_velocity_est", 1, &glob.to_vel_est_globWrkSize, &glob.to_vel_est_locWrkSize);
+	}
+
+	err |= clSetKernelArg(glob.to_arctan_kernel,  0, sizeof(cl_mem),   &glob.to_vel_est_sum12_re_im);
 	err |= clSetKernelArg(glob.to_arctan_kernel,  3, sizeof(cl_int),   &glob.params.numb_avg);     
 	err |= clSetKernelArg(glob.to_arctan_kernel,  4, sizeof(cl_int),   &glob.params.avg_offset);   
-    err |= clSetKernelArg(glob.to_arctan_kernel,  5, sizeof(cl_int),   &glob.params.nlinesamples); 
+	err |= clSetKernelArg(glob.to_arctan_kernel,  5, sizeof(cl_int),   &glob.params.nlinesamples); 
+	err |= clSetKernelArg(glob.to_arctan_kernel,  6, sizeof(cl_int),   &Nsamples);
+	err |= clSetKernelArg(glob.to_arctan_kernel,  7, sizeof(cl_float4)*to_arctan_tile, NULL);
+	err |= clSetKernelArg(glob.to_arctan_kernel,  8, sizeof(cl_float4)*to_arctan_tile, NULL);
+	err |= clSetKernelArg(glob.to_arctan_kernel,  9, sizeof(cl_mem),   &glob.outbufZX); //maybe don't care?
+	err |= clSetKernelArg(glob.to_arctan_kernel, 10, sizeof(cl_mem),   &glob.outbufX);
+	RecordLaunch(glob, glob.to_arctan_kernel, "to_arctan", 1, &glob.to_arctan_globWrkSize, &glob.to_arctan_locWrkSize);
+
+	// Largest absolute value of outbufZ and outbufX in one launch
+	err |= clSetKernelArg(glob.maxabsval_kernel,  0, sizeof(cl_mem),   &glob.velocities);
+	err |= clSetKernelArg(glob.maxabsval_kernel,  1, sizeof(cl_float)*glob.maxabsval_locWrkSize[0], NULL);
+	err |= clSetKernelArg(glob.maxabsval_kernel,  2, sizeof(cl_int),   &Nsamples);
+	err |= clSetKernelArg(glob.maxabsval_kernel,  3, sizeof(cl_int),   &glob.velocities_stride);
+	err |= clSetKernelArg(glob.maxabsval_kernel,  4, sizeof(cl_mem),   &glob.max_partial);
+	err |= clSetKernelArg(glob.maxabsval_kernel,  5, sizeof(cl_mem),   &glob.max_counter);
+	err |= clSetKernelArg(glob.maxabsval_kernel,  6, sizeof(cl_mem),   &glob.maximum);
+	RecordLaunch(glob, glob.maxabsval_kernel, "maxabsval", 2, glob.maxabsval_globWrkSize, glob.maxabsval_locWrkSize);
+
+	// Combine kernel arguments, 5 and 6 are the output buffers
+	err |= clSetKernelArg(glob.combine_kernel,    0, sizeof(cl_mem),   &glob.outbufZ);
+	err |= clSetKernelArg(glob.combine_kernel,    1, sizeof(cl_mem),   &glob.outbufX);
+	err |= clSetKernelArg(glob.combine_kernel,    2, sizeof(cl_mem),   &glob.maximum);
+	err |= clSetKernelArg(glob.combine_kernel,    4, sizeof(cl_int),   &Nsamples);		// derived parameter
+	RecordLaunch(glob, glob.combine_kernel, "combine", 1, &glob.combine_globWrkSize, &glob.combine_locWrkSize);
+	err |= SetScalarArgs(glob);
 	if (err != CL_SUCCESS)return err;
 
+	glob.prepared = glob.params;
+	glob.nframes  = nframes;
+	if (glob.list_dbg) RegisterDbgBuffers(glob);
+	return 0;
+}
+
+/// <summary>Reports the size of the scratch arena for one frame with the current parameters.
+/// Must be called after SetParams. The CPU implementation needs no scratch, the size is then 0.
+/// Returns -1 if neither InitializeCL nor Initialize has been called, else 0.
+/// @param req OUTPUT size and alignment of the region to give to SetScratchBuffer
+/// </summary>
+PLUGIN_API int  GetScratchRequirementsInst(PluginHandle inst, ScratchRequirements* req)
+{
+	PluginInstance& glob = *inst;
+	if (glob.cpu) {
+		req->size = 0;
+		req->alignment = 1;
+		return 0;
+	}
+	if (glob.scratch_align == 0) return -1;   // InitializeCL has not been called
+	if (glob.nparts > 0) {
+		// The regions of the parts one after the other, see SetScratchBuffer
+		req->size = 0;
+		for (int p = 0; p < glob.nparts; p++) {
+			ScratchRequirements part_req;
+			if (glob.parts[p].latgroups == 0 || GetScratchRequirementsInst(glob.parts[p].inst, &part_req) != 0) continue;
+			req->size += ROUND_UP(part_req.size, glob.scratch_align);
+		}
+		req->alignment = glob.scratch_align;
+		return 0;
+	}
+	size_t sizes[SCRATCH_BUFFERS], offsets[SCRATCH_BUFFERS];
+	ScratchSizes(glob, 1, sizes);
+	req->size      = ScratchLayout(glob, sizes, offsets);
+	req->alignment = glob.scratch_align;
+	return 0;
+}
+
+/// <summary>Gives the instance a region of a host buffer for its intermediate buffers, used from the next Prepare on.
+/// The buffer is retained until another region is given or CleanupInst. A NULL arena makes the instance
+/// use an arena of its own again.
+/// Returns -1 if InitializeCL has not been called or offset is not a multiple of the alignment from
+/// GetScratchRequirements, else an OpenCL error number or 0.
+/// @param arena Buffer created by the host in the context given to InitializeCL, or NULL
+/// @param offset Start of the region in arena, in bytes
+/// @param size Size of the region in bytes
+/// </summary>
+PLUGIN_API int  SetScratchBufferInst(PluginHandle inst, cl_mem arena, size_t offset, size_t size)
+{
+	PluginInstance& glob = *inst;
+	if (glob.cpu) return 0;
+	if (glob.scratch_align == 0 || (arena != 0 && offset % glob.scratch_align != 0)) return -1;
+
+	int err = CL_SUCCESS;
+	if (glob.nparts > 0) {
+		// Each part gets its region in turn. A part whose region does not fit uses an arena of its own
+		size_t end = offset + size;
+		for (int p = 0; p < glob.nparts; p++) {
+			FramePart& part = glob.parts[p];
+			ScratchRequirements part_req;
+			if (arena == 0 || part.latgroups == 0 || offset >= end || GetScratchRequirementsInst(part.inst, &part_req) != 0) {
+				err |= SetScratchBufferInst(part.inst, NULL, 0, 0);
+				continue;
+			}
+			size_t len = ROUND_UP(part_req.size, glob.scratch_align);
+			err |= SetScratchBufferInst(part.inst, arena, offset, (len < end - offset) ? len : end - offset);
+			offset += len;
+		}
+		// Parts whose region moved are set up again before the next frame
+		for (int p = 0; p < glob.nparts; p++) {
+			if (glob.parts[p].latgroups > 0 && glob.parts[p].inst->nframes == 0) glob.nframes = 0;
+		}
+		return err;
+	}
+
+	// The host hands over the same region before every Prepare; the buffers in it stay as they are
+	if (arena == glob.host_scratch && (arena == 0 || (offset == glob.host_scratch_offset && size == glob.host_scratch_size))) return 0;
+
+	// The intermediate buffers may be in the old region. They are made again before the next frame
+	err = ReleaseScratchBuffers(glob);
+	glob.nframes = 0;
+	if (arena != 0) err |= clRetainMemObject(arena);
+	if (glob.host_scratch != 0) err |= clReleaseMemObject(glob.host_scratch);
+	glob.host_scratch        = arena;
+	glob.host_scratch_offset = offset;
+	glob.host_scratch_size   = (arena != 0) ? size : 0;
+	return err;
+}
+
+/// <summary>Prepares each part for its share of one frame, see SplitFrame.
+/// Returns -1 if the frame has no line group, else an OpenCL error number if any OpenCL function fails, else 0.
+/// </summary>
+static int PrepareParts(PluginInstance& glob)
+{
+	cl_int err = CL_SUCCESS;
+	int nactive = 0;
+	glob.nframes = 0;   // Set once every part is set up
+	for (int p = 0; p < glob.nparts; p++) {
+		FramePart& part = glob.parts[p];
+		part.inst->list_dbg = false;
+		if (part.latgroups == 0) continue;
+		part.inst->list_dbg = (nactive == 0);   // the first lines of the frame, for GetDbgOclMem
+		err = PrepareFrames(*part.inst, 1);
+		if (err != CL_SUCCESS)return err;
+		nactive++;
+	}
+	if (nactive == 0) return -1;
+	glob.nframes = 1;
 	return 0;
 }
 
+/// <summary>Prepares OpenCL kernels for execution.
+/// Sets up the buffers for one frame at a time, see PrepareFrames.
+/// This function must not be called before InitializeCL or Initialize
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+PLUGIN_API int  PrepareInst(PluginHandle inst)
+{
+	PluginInstance& glob = *inst;
+	if (glob.cpu) {
+		float scale   = static_cast<float>(glob.params.c*glob.params.fprf/(4.0*PI*glob.params.f0*glob.params.lag_axial)/glob.params.lag_acq);
+		float k_trans = static_cast<float>(glob.params.fprf*glob.params.c*glob.params.lambda_X/(2.0*glob.params.fs*glob.params.depth*2.0*PI*2.0*glob.params.lag_TO*glob.params.lag_acq));
+		return PrepareCPU(glob.scale_cpu, &glob.params, scale, k_trans);
+	}
+	if (glob.nparts > 0) return PrepareParts(glob);
+	return PrepareFrames(glob, 1);
+}
+
 /// <summary>Gets size of output buffer.
 /// Copies the information on output buffer into passed BuffSize struct.
 /// returns 0 no matter what.
 /// @param buf A pointer to a BuffSize struct to contain copied information.
 /// @param bufnum An integer that has no effect at the moment.
 /// </summary>
-PLUGIN_API int  GetOutBufSize(BuffSize* buf, int bufnum)
+PLUGIN_API int  GetOutBufSizeInst(PluginHandle inst, BuffSize* buf, int bufnum)
 {
+	PluginInstance& glob = *inst;
 	glob.outSize[bufnum].sampleType = SAMPLE_FORMAT_UINT8;
 	glob.outSize[bufnum].width      = glob.params.nlinesamples;
 	glob.outSize[bufnum].height     = glob.params.nlines;
@@ -502,130 +1123,370 @@ PLUGIN_API int  GetOutBufSize(BuffSize* buf, int bufnum)
 	return 0;
 }
 
-/// <summary>Executes OpenCL kernels program on GPU </summary>
-PLUGIN_API int ProcessCLIO(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+/// <summary>Binds the input buffer to the first kernel and the output buffers to combine,
+/// only when they differ from the last call.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+static int BindBuffers(PluginInstance& glob, cl_mem* inbuf, cl_mem* outbuf)
 {
-	float scale = static_cast<float>(glob.params.c*glob.params.fprf/(4.0*PI*glob.params.f0*glob.params.lag_axial)/glob.params.lag_acq);
-	int Nsamples = glob.params.nlines*glob.params.nlinesamples;
-	int threads = Nsamples/64;
+	cl_int err = CL_SUCCESS;
+	if (glob.bound_in != inbuf[0]) {
+		err = clSetKernelArg(glob.launches[0].kernel, 0, sizeof(cl_mem), inbuf);
+		if (err != CL_SUCCESS)return err;
+		glob.bound_in = inbuf[0];
+	}
+	if (glob.bound_out[0] != outbuf[0] || glob.bound_out[1] != outbuf[1]) {
+		err  = clSetKernelArg(glob.combine_kernel,   5, sizeof(cl_mem), &outbuf[0]);
+		err |= clSetKernelArg(glob.combine_kernel,   6, sizeof(cl_mem), &outbuf[1]);
+		if (err != CL_SUCCESS)return err;
+		glob.bound_out[0] = outbuf[0];
+		glob.bound_out[1] = outbuf[1];
+	}
+	return 0;
+}
 
+/// <summary>Enqueues the launches first to end-1 of the chain that PrepareFrames recorded.
+/// The first waits for inEv, the last returns outEv. With the replay parameter set and an in-order
+/// queue the kernels are enqueued without events between them, the queue keeps them in order.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+static int EnqueueLaunches(PluginInstance& glob, int first, int end, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
 	cl_int err = CL_SUCCESS;
-	// Step 10: Set OpenCL kernel arguments
-	// Step 11: Execute OpenCL kernel in data parallel
-
-	// Split kernel arguments
-	err  = clSetKernelArg(glob.split_kernel,     0, sizeof(cl_mem), inbuf);
-	err |= clSetKernelArg(glob.split_kernel,     1, sizeof(cl_int), &glob.params.nlinesamples);
-	err |= clSetKernelArg(glob.split_kernel,     2, sizeof(cl_int), &glob.params.nlines);
-	err |= clSetKernelArg(glob.split_kernel,     3, sizeof(cl_int), &glob.params.interleave);
-	err |= clSetKernelArg(glob.split_kernel,     4, sizeof(cl_int), &glob.params.emissions);
-	err |= clSetKernelArg(glob.split_kernel,     5, sizeof(cl_mem), &glob.Z);
-	err |= clSetKernelArg(glob.split_kernel,     6, sizeof(cl_mem), &glob.Z2);
-	err |= clSetKernelArg(glob.split_kernel,     7, sizeof(cl_mem), &glob.L);
-	err |= clSetKernelArg(glob.split_kernel,     8, sizeof(cl_mem), &glob.R);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.split_kernel,      1, NULL, &glob.split_globWrkSize,      &glob.split_locWrkSize,      1, &inEv,        &glob.event0);
-	if (err != CL_SUCCESS)return err;
-	//printf("after 1\n");
+	if (glob.checked_queue != clqueue) {
+		cl_command_queue_properties props = 0;
+		err = clGetCommandQueueInfo(clqueue, CL_QUEUE_PROPERTIES, sizeof(props), &props, NULL);
+		if (err != CL_SUCCESS)return err;
+		glob.in_order = (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0;
+		glob.checked_queue = clqueue;
+	}
+	bool chain = !(glob.params.replay && glob.in_order);
+
+	// Step 11: Execute OpenCL kernel in data parallel. Each kernel waits for the one before it
+	int last = end - 1;
+	for (int n = first; n <= last; n++) {
+		const KernelLaunch& k = glob.launches[n];
+		const cl_event* wait = (n == first) ? &inEv : (chain ? &glob.events[n-1] : NULL);
+		cl_uint num_wait = (wait != NULL && *wait != NULL) ? 1 : 0;
+		cl_event* ev = (n == last) ? outEv : (chain ? &glob.events[n] : NULL);
+		if (ev == &glob.events[n] && glob.events[n] != 0) {
+			clReleaseEvent(glob.events[n]); // of the previous frame
+			glob.events[n] = 0;
+		}
+		err = clEnqueueNDRangeKernel(clqueue, k.kernel, k.dims, NULL, k.globWrkSize, k.locWrkSize, num_wait, num_wait ? wait : NULL, ev);
+		if (err != CL_SUCCESS)return err;
+		if (ev != NULL) TimingEnqueued(k.name, clqueue, *ev);
+	}
+	return 0;
+}
 
-	// Standard deviation kernel arguments
-	err  = clSetKernelArg(glob.std_dev_kernel,    0, sizeof(cl_mem), &glob.Z);
-	err |= clSetKernelArg(glob.std_dev_kernel,    1, sizeof(cl_mem), &glob.std_dev_sum1_real); //could pack as float2
-	err |= clSetKernelArg(glob.std_dev_kernel,    2, sizeof(cl_mem), &glob.std_dev_sum1_imag);
-	err |= clSetKernelArg(glob.std_dev_kernel,    3, sizeof(cl_mem), &glob.std_dev_sum2);
-	err |= clSetKernelArg(glob.std_dev_kernel,    4, sizeof(cl_int), &Nsamples);
-	err |= clSetKernelArg(glob.std_dev_kernel,    6, sizeof(cl_mem), &glob.std_dev);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.std_dev_kernel,    1, NULL, &glob.std_dev_globWrkSize,    &glob.std_dev_locWrkSize,    1, &glob.event0, &glob.event1);
+/// <summary>Enqueues the kernels on the frames that PrepareFrames set up for.
+/// Only the input and output buffers are bound here, and only when they differ from the last call.
+/// With the replay parameter set and an in-order queue, the recorded chain is enqueued without
+/// events between the kernels, the queue keeps them in order.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+int EnqueueFrames(PluginInstance& glob, cl_mem* inbuf, cl_mem* outbuf, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+	// Step 10: Set OpenCL kernel arguments that change, the first kernel reads the input and combine writes the output
+	cl_int err = BindBuffers(glob, inbuf, outbuf);
 	if (err != CL_SUCCESS)return err;
-	//printf("after 2\n");
+	return EnqueueLaunches(glob, 0, glob.nlaunches, clqueue, inEv, outEv);
+}
 
-	err  = clSetKernelArg(glob.vel_est_kernel,    0, sizeof(cl_mem), &glob.Z);
-	err |= clSetKernelArg(glob.vel_est_kernel,    1, sizeof(cl_mem), &glob.temp_re);
-	err |= clSetKernelArg(glob.vel_est_kernel,    2, sizeof(cl_mem), &glob.temp_im);
-	err |= clSetKernelArg(glob.vel_est_kernel,    5, sizeof(cl_mem), &glob.std_dev);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.vel_est_kernel,    1, NULL, &glob.globWrkSize,            &glob.locWrkSize,            1, &glob.event1, &glob.event2);
+/// <summary>Gets len bytes of buf from origin as a buffer of their own, for one part of a frame.
+/// That is a sub-buffer if the origin is aligned for the device, else the stage buffer, which the
+/// caller fills or empties. The stage only grows.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// @param slice OUTPUT the buffer, with a reference for the caller
+/// </summary>
+static int SliceBuffer(cl_context ctx, cl_mem buf, size_t origin, size_t len, size_t align,
+	cl_mem* stage, size_t* stage_size, cl_mem* slice)
+{
+	cl_int err = CL_SUCCESS;
+	*slice = 0;
+	if (origin % align == 0) {
+		cl_buffer_region region = { origin, len };
+		*slice = clCreateSubBuffer(buf, 0, CL_BUFFER_CREATE_TYPE_REGION, &region, &err);
+		if (err == CL_SUCCESS)return 0;
+		*slice = 0;   // e.g. buf is a sub-buffer itself
+	}
+	if (*stage_size < len) {
+		if (*stage != 0) { clReleaseMemObject(*stage); *stage = 0; *stage_size = 0; }
+		*stage = clCreateBuffer(ctx, CL_MEM_READ_WRITE, len, NULL, &err);
+		if (err != CL_SUCCESS)return err;
+		*stage_size = len;
+	}
+	err = clRetainMemObject(*stage);
 	if (err != CL_SUCCESS)return err;
-	//printf("after 3\n");
+	*slice = *stage;
+	return 0;
+}
 
-	err  = clSetKernelArg(glob.arctan_kernel,     0, sizeof(cl_mem),   &glob.temp_re);
-	err |= clSetKernelArg(glob.arctan_kernel,     1, sizeof(cl_mem),   &glob.temp_im);
-	err |= clSetKernelArg(glob.arctan_kernel,     2, sizeof(cl_float), &scale);                  // derived parameter
-	err |= clSetKernelArg(glob.arctan_kernel,     3, sizeof(cl_int),   &glob.params.numb_avg);
-	err |= clSetKernelArg(glob.arctan_kernel,     4, sizeof(cl_int),   &glob.params.avg_offset);
-	err |= clSetKernelArg(glob.arctan_kernel,     5, sizeof(cl_mem),   &glob.outbufZ);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.arctan_kernel,     1, NULL, &glob.arctan_globWrkSize,     &glob.arctan_locWrkSize,     1, &glob.event2, &glob.event3);
-	if (err != CL_SUCCESS)return err;
-	//printf("after 4\n");
+/// <summary>Gets the slices of the input and output buffers for one part of a frame, see SliceBuffer.
+/// A slice is made again only if its buffer, origin or length differ from the last frame, so the
+/// kernels of the part stay bound to it.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+static int SliceParts(PluginInstance& glob, FramePart& part, cl_mem* inbuf, cl_mem* outbuf, const size_t origin[3], const size_t len[3])
+{
+	cl_mem bufs[3] = { inbuf[0], outbuf[0], outbuf[1] };
+	cl_mem* stages[3] = { &part.in_stage, &part.out_stage[0], &part.out_stage[1] };
+	size_t* stage_sizes[3] = { &part.in_stage_size, &part.out_stage_size[0], &part.out_stage_size[1] };
+	for (int b = 0; b < 3; b++) {
+		if (part.slice[b] != 0 && part.slice_of[b] == bufs[b] && part.slice_origin[b] == origin[b] && part.slice_len[b] == len[b]) continue;
+		if (part.slice[b] != 0) { clReleaseMemObject(part.slice[b]); part.slice[b] = 0; }
+		cl_int err = SliceBuffer(glob.ctx, bufs[b], origin[b], len[b], part.inst->scratch_align, stages[b], stage_sizes[b], &part.slice[b]);
+		if (err != CL_SUCCESS)return err;
+		part.slice_of[b]     = bufs[b];
+		part.slice_origin[b] = origin[b];
+		part.slice_len[b]    = len[b];
+	}
+	return 0;
+}
 
-	err  = clSetKernelArg(glob.to_vel_est_kernel, 0, sizeof(cl_mem), &glob.L);
-	err |= clSetKernelArg(glob.to_vel_est_kernel, 1, sizeof(cl_mem), &glob.R);
-	err |= clSetKernelArg(glob.to_vel_est_kernel, 5, sizeof(cl_mem), &glob.to_vel_est_sum12_re_im);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.to_vel_est_kernel, 1, NULL, &glob.to_vel_est_globWrkSize, &glob.to_vel_est_locWrkSize, 1, &glob.event3, &glob.event4);
-	if (err != CL_SUCCESS)return err;
-	//printf("after 5\n");
-	
-	err  = clSetKernelArg(glob.to_arctan_kernel,  0, sizeof(cl_mem), &glob.to_vel_est_sum12_re_im);
-	err |= clSetKernelArg(glob.to_arctan_kernel,  6, sizeof(cl_mem), &glob.outbufZX); //maybe don't care?
-	err |= clSetKernelArg(glob.to_arctan_kernel,  7, sizeof(cl_mem), &glob.outbufX);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.to_arctan_kernel,  1, NULL, &glob.to_arctan_globWrkSize,  &glob.to_arctan_locWrkSize,  1, &glob.event4, &glob.event5);
-	if (err != CL_SUCCESS)return err;
-	//printf("after 6\n");
+/// <summary>Creates the queues of the parts on their devices at the first frame,
+/// with profiling if the host's queue has it. The queues execute in order.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+static int CreatePartQueues(PluginInstance& glob, cl_command_queue  clqueue)
+{
+	cl_command_queue_properties props = 0;
+	bool queried = false;
+	cl_int err = CL_SUCCESS;
+	for (int p = 0; p < glob.nparts; p++) {
+		FramePart& part = glob.parts[p];
+		if (part.latgroups == 0 || part.queue != 0) continue;
+		if (!queried) {
+			err = clGetCommandQueueInfo(clqueue, CL_QUEUE_PROPERTIES, sizeof(props), &props, NULL);
+			if (err != CL_SUCCESS)return err;
+			queried = true;
+		}
+		part.queue = clCreateCommandQueue(glob.ctx, part.inst->device, props & CL_QUEUE_PROFILING_ENABLE, &err);
+		if (err != CL_SUCCESS)return err;
+	}
+	return 0;
+}
 
-	// Set Arguments for maxabsval
-	err  = clSetKernelArg(glob.maxabsval_kernel, 0, sizeof(cl_mem),      &glob.outbufZ);
-	err |= clSetKernelArg(glob.maxabsval_kernel, 1, sizeof(cl_float)*64, NULL);
-	err |= clSetKernelArg(glob.maxabsval_kernel, 2, sizeof(cl_int),      &Nsamples);
-	err |= clSetKernelArg(glob.maxabsval_kernel, 3, sizeof(cl_mem),      &glob.result1);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.maxabsval_kernel,  1, NULL, &glob.maxabsval_globWrkSize,  &glob.maxabsval_locWrkSize,  1, &glob.event5, &glob.event6);
+/// <summary>Enqueues frame number frame of the buffers across the parts, see InitializeCL.
+/// Each part runs the whole chain on its line groups, on its own queue, into its lines of the output
+/// buffers. combine scales by the constant from the scale parameter and not by maximum, so the parts do
+/// not wait for each other; should combine normalize by maximum, the maxima of the parts have to be
+/// merged before it. The host's queue waits for all parts, outEv completes with them.
+/// Slices of the buffers that cannot be sub-buffers are copied through the stage buffers of the part.
+/// The staged output slices are copied to the output buffers on the host's queue once all parts are
+/// done, so nothing writes to an output buffer while a part writes to a sub-buffer of it. combine of
+/// the next frame waits for these copies.
+/// Returns an OpenCL error number if any OpenCL function fails, else returns 0.
+/// </summary>
+static int EnqueueParts(PluginInstance& glob, cl_mem* inbuf, cl_mem* outbuf, size_t frame, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+	cl_int err = CreatePartQueues(glob, clqueue);
 	if (err != CL_SUCCESS)return err;
-	//printf("after 7\n");
 
-	// Set Arguments for maxabsval
-	err  = clSetKernelArg(glob.maxabsval_kernel, 0, sizeof(cl_mem),      &glob.outbufX);
-	err |= clSetKernelArg(glob.maxabsval_kernel, 1, sizeof(cl_float)*64, NULL);
-	err |= clSetKernelArg(glob.maxabsval_kernel, 2, sizeof(cl_int),      &Nsamples);
-	err |= clSetKernelArg(glob.maxabsval_kernel, 3, sizeof(cl_mem),      &glob.result2);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.maxabsval_kernel,  1, NULL, &glob.maxabsval_globWrkSize,  &glob.maxabsval_locWrkSize,  1, &glob.event6, &glob.event7);
-	if (err != CL_SUCCESS)return err;
-	//printf("after 8\n");
-	
-	// TODO: check this
-	err  = clSetKernelArg(glob.maxabsval2_kernel, 0, sizeof(cl_mem), &glob.result1);
-	err |= clSetKernelArg(glob.maxabsval2_kernel, 1, sizeof(cl_mem), &glob.result2);
-	err |= clSetKernelArg(glob.maxabsval2_kernel, 2, sizeof(cl_int), &threads);
-	err |= clSetKernelArg(glob.maxabsval2_kernel, 3, sizeof(cl_mem), &glob.maximum);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.maxabsval2_kernel,    1, NULL, &glob.maxabsval2_globWrkSize,    &glob.maxabsval2_locWrkSize,    1, &glob.event7, &glob.event8);
-	if (err != CL_SUCCESS)return err;
-	//printf("after 9\n");
-	
-	// Combine kernel arguments
-	err  = clSetKernelArg(glob.combine_kernel,   0, sizeof(cl_mem), &glob.outbufZ);
-	err |= clSetKernelArg(glob.combine_kernel,   1, sizeof(cl_mem), &glob.outbufX);
-	err |= clSetKernelArg(glob.combine_kernel,   2, sizeof(cl_mem), &glob.maximum);
-	err |= clSetKernelArg(glob.combine_kernel,   3, sizeof(cl_float), &scale);		// derived parameter
-	err |= clSetKernelArg(glob.combine_kernel,   4, sizeof(cl_int), &Nsamples);		// derived parameter
-	err |= clSetKernelArg(glob.combine_kernel,   5, sizeof(cl_mem), &outbuf[0]);
-	err |= clSetKernelArg(glob.combine_kernel,   6, sizeof(cl_mem), &outbuf[1]);
-	if (err != CL_SUCCESS)return err;
-	err = clEnqueueNDRangeKernel(clqueue, glob.combine_kernel,    1, NULL, &glob.combine_globWrkSize,    &glob.combine_locWrkSize,    1, &glob.event8, outEv);
-	if (err != CL_SUCCESS)return err;
-	
-	printf("end CLIO\n");
-	return 0;
+	// Input is [sample][interleave][emissions] per line group, output a line after the other
+	int group_lines  = glob.params.interleave/4;
+	size_t group_in  = (size_t)glob.params.emissions*glob.params.interleave*glob.params.nlinesamples*sizeof(cl_short2);
+	size_t group_out = (size_t)group_lines*glob.params.nlinesamples*sizeof(cl_uchar);
+	size_t frame_in  = (size_t)(glob.params.nlines/group_lines)*group_in;
+	size_t frame_out = (size_t)glob.params.nlines*glob.params.nlinesamples*sizeof(cl_uchar);
+
+	int active[MAX_PARTS];
+	cl_event done[MAX_PARTS];
+	int nactive = 0, ndone = 0;
+	bool any_staged = false;
+
+	// The chain on every part. The queues of the parts are in order
+	for (int p = 0; p < glob.nparts && err == CL_SUCCESS; p++) {
+		FramePart& part = glob.parts[p];
+		PluginInstance& pi = *part.inst;
+		if (part.latgroups == 0) continue;
+		active[nactive++] = p;
+		size_t in_origin  = frame*frame_in  + part.first_latgroup*group_in;
+		size_t out_origin = frame*frame_out + part.first_latgroup*group_out;
+		size_t origin[3] = { in_origin, out_origin, out_origin };
+		size_t len[3]    = { part.latgroups*group_in, part.latgroups*group_out, part.latgroups*group_out };
+		err = SliceParts(glob, part, inbuf, outbuf, origin, len);
+		if (err == CL_SUCCESS) err = BindBuffers(pi, &part.slice[0], &part.slice[1]);
+
+		cl_event ready = 0, chained = 0, ev = 0;
+		if (err == CL_SUCCESS && part.slice[0] == part.in_stage) {
+			err = clEnqueueCopyBuffer(part.queue, inbuf[0], part.in_stage, in_origin, 0, len[0], inEv ? 1 : 0, inEv ? &inEv : NULL, &ready);
+		}
+		// combine writes the output after the staged output of the last frame is out of the way
+		if (err == CL_SUCCESS) err = EnqueueLaunches(pi, 0, pi.nlaunches - 1, part.queue, ready ? ready : inEv, &chained);
+		if (err == CL_SUCCESS && glob.out_copied != 0) err = clEnqueueWaitForEvents(part.queue, 1, &glob.out_copied);
+		if (err == CL_SUCCESS) err = EnqueueLaunches(pi, pi.nlaunches - 1, pi.nlaunches, part.queue, chained, &ev);
+		if (ev != 0) done[ndone++] = ev;
+		if (ready != 0) clReleaseEvent(ready);
+		if (chained != 0) clReleaseEvent(chained);
+		any_staged |= (part.slice[1] == part.out_stage[0] || part.slice[2] == part.out_stage[1]);
+		clFlush(part.queue);   // the host's queue waits for them
+	}
+
+	if (err == CL_SUCCESS && ndone > 0) err = clEnqueueWaitForEvents(clqueue, ndone, done);
+
+	// The staged output slices to their place, one after the other on the host's queue
+	for (int q = 0; q < nactive && err == CL_SUCCESS && any_staged; q++) {
+		FramePart& part = glob.parts[active[q]];
+		for (int b = 0; b < 2 && err == CL_SUCCESS; b++) {
+			if (part.slice[1+b] != part.out_stage[b]) continue;
+			err = clEnqueueCopyBuffer(clqueue, part.out_stage[b], outbuf[b], 0, part.slice_origin[1+b], part.slice_len[1+b], ndone, done, NULL);
+		}
+	}
+	if (glob.out_copied != 0) { clReleaseEvent(glob.out_copied); glob.out_copied = 0; }
+	if (err == CL_SUCCESS && any_staged) err = clEnqueueMarker(clqueue, &glob.out_copied);
+	if (err == CL_SUCCESS && outEv != NULL) {
+		if (glob.out_copied != 0) {
+			err = clRetainEvent(glob.out_copied);
+			*outEv = glob.out_copied;
+		} else {
+			err = clEnqueueMarker(clqueue, outEv);
+		}
+	}
+	for (int q = 0; q < ndone; q++) clReleaseEvent(done[q]);
+	return err;
 }
 
-/// <summary>Executes program on CPU 
-/// Not needed in current implementation
+/// <summary>Executes OpenCL kernels program on GPU.
+/// Returns -1 if the instance was set up with Initialize, use ProcessMemIO then.
+/// The buffers are set up for one frame, so calls alternating with ProcessCLIOBatch
+/// set them up again every time. Keep to one of the two per instance.
 /// </summary>
+PLUGIN_API int ProcessCLIOInst(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+	PluginInstance& glob = *inst;
+	cl_int err = CL_SUCCESS;
+	if (glob.cpu) return -1;
+	if (glob.nparts > 0) {
+		if (glob.nframes != 1) {
+			err = PrepareParts(glob);
+			if (err != CL_SUCCESS)return err;
+		}
+		return EnqueueParts(glob, inbuf, outbuf, 0, clqueue, inEv, outEv);
+	}
+	if (glob.nframes != 1) {
+		err = PrepareFrames(glob, 1);
+		if (err != CL_SUCCESS)return err;
+	}
+	return EnqueueFrames(glob, inbuf, outbuf, clqueue, inEv, outEv);
+}
+
+/// <summary>Executes OpenCL kernels program on GPU for nframes frames packed one after the other.
+/// Each kernel runs once over the whole batch. The buffers are set up again when nframes changes,
+/// which includes every switch between ProcessCLIO and ProcessCLIOBatch, so keep to one of the two per instance.
+/// A frame split across several devices is set up for one frame, the frames of the batch are then split one by one.
+/// Returns -1 if the instance was set up with Initialize.
+/// </summary>
+PLUGIN_API int ProcessCLIOBatchInst(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+	PluginInstance& glob = *inst;
+	cl_int err = CL_SUCCESS;
+	if (glob.cpu || nframes < 1) return -1;
+	if (glob.nparts > 0) {
+		if (glob.nframes != 1) {
+			err = PrepareParts(glob);
+			if (err != CL_SUCCESS)return err;
+		}
+		for (size_t f = 0; f < nframes; f++) {
+			err = EnqueueParts(glob, inbuf, outbuf, f, clqueue, inEv, (f + 1 == nframes) ? outEv : NULL);
+			if (err != CL_SUCCESS)return err;
+		}
+		return 0;
+	}
+	if (glob.nframes != (int)nframes) {
+		err = PrepareFrames(glob, (int)nframes);
+		if (err != CL_SUCCESS)return err;
+	}
+	return EnqueueFrames(glob, inbuf, outbuf, clqueue, inEv, outEv);
+}
+
+/// <summary>Executes program on CPU, see scale_cpu.h
+/// Returns -1 if the buffers are missing or Prepare has not been called.
+/// @param inbuf One packed short2 frame
+/// @param outbuf Two uint8 images, axial (Z) and transverse (X) velocity
+/// </summary>
+PLUGIN_API int  ProcessMemIOInst(PluginHandle inst, void* inbuf[], size_t numin, void* outbuf[], size_t numout)
+{
+	PluginInstance& glob = *inst;
+	if (numin < 1 || numout < 2) return -1;
+    return ProcessCPU(glob.scale_cpu, inbuf[0], (unsigned char*)outbuf[0], (unsigned char*)outbuf[1]);
+}
+
+/// <summary> Allocates the state of a new, independent instance.
+/// Returns NULL if out of memory.
+/// </summary>
+PLUGIN_API PluginHandle CreateInstance(void)
+{
+	return new (std::nothrow) PluginInstance();
+}
+
+/// <summary> Frees an instance. CleanupInst must be called first.
+/// @param inst An instance returned by CreateInstance
+/// </summary>
+PLUGIN_API void DestroyInstance(PluginHandle inst)
+{
+	delete inst;
+}
+
+// The plain API, working on default_instance
+
+PLUGIN_API int  Cleanup(void)
+{
+	return CleanupInst(&default_instance);
+}
+
+PLUGIN_API int  InitializeCL( cl_context ctx, cl_device_id id, char* path_to_module )
+{
+	return InitializeCLInst(&default_instance, ctx, id, path_to_module);
+}
+
+PLUGIN_API int  Initialize( char* path_to_dll )
+{
+	return InitializeInst(&default_instance, path_to_dll);
+}
+
+PLUGIN_API int  SetParams(float* pfp, size_t nfp, int* pip, size_t nip)
+{
+	return SetParamsInst(&default_instance, pfp, nfp, pip, nip);
+}
+
+PLUGIN_API int  SetInBufSize(BuffSize* buf, int bufnum)
+{
+	return SetInBufSizeInst(&default_instance, buf, bufnum);
+}
+
+PLUGIN_API int  Prepare(void)
+{
+	return PrepareInst(&default_instance);
+}
+
+PLUGIN_API int  GetOutBufSize(BuffSize* buf, int bufnum)
+{
+	return GetOutBufSizeInst(&default_instance, buf, bufnum);
+}
+
+PLUGIN_API int  GetScratchRequirements(ScratchRequirements* req)
+{
+	return GetScratchRequirementsInst(&default_instance, req);
+}
+
+PLUGIN_API int  SetScratchBuffer(cl_mem arena, size_t offset, size_t size)
+{
+	return SetScratchBufferInst(&default_instance, arena, offset, size);
+}
+
+PLUGIN_API int ProcessCLIO(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+	return ProcessCLIOInst(&default_instance, inbuf, numin, outbuf, numout, clqueue, inEv, outEv);
+}
+
+PLUGIN_API int ProcessCLIOBatch(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+	return ProcessCLIOBatchInst(&default_instance, inbuf, numin, outbuf, numout, nframes, clqueue, inEv, outEv);
+}
+
 PLUGIN_API int  ProcessMemIO(void* inbuf[], size_t numin, void* outbuf[], size_t numout)
 {
-    return 0;
+	return ProcessMemIOInst(&default_instance, inbuf, numin, outbuf, numout);
 }
@@ -3,6 +3,19 @@
  *	axial and transverse dimensions
  */
 
+/*	Storage format of the intermediate Z, L and R buffers written by the split kernels.
+ *	The input samples are 16-bit IQ pairs, so by default they are kept as short2,
+ *	exactly and in half the memory of float2, and only converted to float where the
+ *	autocorrelation kernels read them. Build with -D SAMPLE_FLOAT2 to store float2.
+ */
+#ifdef SAMPLE_FLOAT2
+typedef float2 sample_t;
+#define STORE_SAMPLE(x) convert_float2(x)
+#else
+typedef short2 sample_t;
+#define STORE_SAMPLE(x) (x)
+#endif
+
 /** Kernel for splitting inbuf into intermediate buffers
  *	@param inbuf - OpenCL buffer containing packed data
  *	@param nlinesamples - integer Number of samples in each line (i.e. 1136)
@@ -15,10 +28,9 @@ __kernel void split(__global short2* inbuf,
 					  const  int     nlines,
 					  const  int     interleave,
 					  const  int     emissions,
-					__global float2* Z,
-					__global float2* Z2,
-					__global float2* L,
-					__global float2* R) {
+					__global sample_t* Z,
+					__global sample_t* L,
+					__global sample_t* R) {
  	// unwrap single inbuf into separate buffers
 	// did assume inbuf will have 'dimensions' in this order [real/imag, line samples, position (Z1/Z2/L/R), lines, emission shots]
 	// now assume inbuf will have 'dimensions' in this order [real/imag, nlinesamples, interleave =Z1/Z2/L/R * position, emissions shots, =nlines/interleave]
@@ -49,16 +61,14 @@ __kernel void split(__global short2* inbuf,
 			for(j=0;j<emissions;j++){ //emission counter: 0-15 or 0-31
 				for(i=0;i<interleave;i++){ //interleave counter: 0-15 or 0-11
 					if     (i%4==0){       Z[j*latgroups*(interleave/4)*nlinesamples + k*(interleave/4)*nlinesamples + (i/4)*nlinesamples + global_id] = 
-						convert_float2(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]);
-					}
-					else if(i%4==1){      Z2[j*latgroups*(interleave/4)*nlinesamples + k*(interleave/4)*nlinesamples + (i/4)*nlinesamples + global_id] = 
-						convert_float2(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]);
+						STORE_SAMPLE(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]);
 					}
+					// i%4==1 is Z2, which is not used by the velocity estimators
 					else if(i%4==2){	   L[j*latgroups*(interleave/4)*nlinesamples + k*(interleave/4)*nlinesamples + (i/4)*nlinesamples + global_id] = 
-						convert_float2(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]); 
+						STORE_SAMPLE(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]); 
 					}
-					else           {	   R[j*latgroups*(interleave/4)*nlinesamples + k*(interleave/4)*nlinesamples + (i/4)*nlinesamples + global_id] = 
-						convert_float2(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]);
+					else if(i%4==3){	   R[j*latgroups*(interleave/4)*nlinesamples + k*(interleave/4)*nlinesamples + (i/4)*nlinesamples + global_id] = 
+						STORE_SAMPLE(inbuf[k*emissions* interleave   *nlinesamples + j* interleave   *nlinesamples +  i   *nlinesamples + global_id]);
 					}
 				}
 			}
@@ -84,86 +94,227 @@ __kernel void split(__global short2* inbuf,
 	*/
 }
 
+/** Kernel for splitting inbuf into intermediate buffers, one work item per sample
+ *	Same result as split, but launched as a 3-D NDRange:
+ *	dimension 0 is the line sample, 1 the block (Z/L/R * position, Z2 is skipped)
+ *	and 2 the emission and lateral group (emission + latgroup*emissions).
+ *	All work items of a group share the same destination buffer, and both
+ *	reads and writes are contiguous along the line samples.
+ *	@param inbuf - OpenCL buffer containing packed data
+ *	@param nlinesamples - integer Number of samples in each line (i.e. 1136)
+ *	@param nlines - Number of lines
+ *	@param interleave - Number of interleaved Z/Z2/L/R blocks (4 * positions)
+ *	@param emissions - Number of emissions in same direction
+ */
+__kernel void split_3d(__global short2* inbuf,
+					   const  int     nlinesamples,
+					   const  int     nlines,
+					   const  int     interleave,
+					   const  int     emissions,
+					 __global sample_t* Z,
+					 __global sample_t* L,
+					 __global sample_t* R) {
+	size_t sample = get_global_id(0); // sample in depth
+	size_t block  = get_global_id(1); // Z/L/R * position: 0-11 or 0-8
+	size_t jk     = get_global_id(2); // emission + latgroup*emissions
+	if (sample >= nlinesamples) return;
+
+	// Z2 is not used by the velocity estimators, so the blocks map to interleave counters 0,2,3,4,6,7,...
+	size_t i = (block/3)*4 + ((block%3 == 0) ? 0 : block%3 + 1); // interleave counter: 0-15 or 0-11
+
+	int positions = interleave/4;
+	int latgroups = nlines/positions;
+	size_t j = jk % emissions; // emission counter
+	size_t k = jk / emissions; // lateral group counter
+
+	// inbuf is [nlinesamples, interleave, emissions, latgroups], the result is [nlinesamples, positions, latgroups, emissions]
+	__global sample_t* out = (i%4 == 0) ? Z : (i%4 == 2) ? L : R;
+	out[j*latgroups*positions*nlinesamples + k*positions*nlinesamples + (i/4)*nlinesamples + sample] =
+		STORE_SAMPLE(inbuf[(jk*interleave + i)*nlinesamples + sample]);
+}
+
+/** Tree reductions of the values in scratch[0..local size-1]
+ *	At every step the lower half of the work group combines the upper half,
+ *	so a group of 64 needs 6 steps. Each work item must have written its own
+ *	scratch element before the call, and all work items must make the call.
+ *	The local size must be a power of two. The result is in scratch[0].
+ */
+void reduce_sum_local(__local float* scratch) {
+	size_t local_id = get_local_id(0);
+	for(size_t offset = get_local_size(0)/2; offset > 0; offset /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (local_id < offset) {
+			scratch[local_id] += scratch[local_id + offset];
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+void reduce_max_local(__local float* scratch) {
+	size_t local_id = get_local_id(0);
+	for(size_t offset = get_local_size(0)/2; offset > 0; offset /= 2) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (local_id < offset) {
+			float other = scratch[local_id + offset];
+			float mine = scratch[local_id];
+			scratch[local_id] = (mine > other) ? mine : other;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/** Sliding-window averages of arctan and to_arctan
+ *	A window is numb_avg values, and stops at the end of the line it starts in and at N.
+ *	Each line is cut into blocks of numb_avg values, so a window is the end of one block
+ *	and possibly the start of the next. With the sums from each value to the end of its
+ *	block (suffix) and from the start of its block (prefix), every window sum is one
+ *	addition, O(1) per sample whatever numb_avg is, and nothing is subtracted.
+ *	The windows of a work group start at base = (first global id of the group)*avg_offset
+ *	and lie within tile_length(base, ...) values, which the group keeps in local memory.
+ */
+int tile_length(size_t base, int numb_avg, int avg_offset, int N) {
+	if (base >= N) return 0;
+	size_t len = (get_local_size(0) - 1)*avg_offset + numb_avg;
+	return (int)min(len, N - base);
+}
+
+/** Turns prefix[0..n-1] and suffix[0..n-1], both holding the n values from base on,
+ *	into the sums within their blocks. Each work item does whole blocks.
+ *	All work items must make the call.
+ */
+void block_sums_local(__local float4* prefix, __local float4* suffix, size_t base, int n,
+					  int numb_avg, int nlinesamples) {
+	int blocks_per_line = (nlinesamples + numb_avg - 1)/numb_avg;
+	size_t first_block = (base/nlinesamples)*blocks_per_line + (base%nlinesamples)/numb_avg;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for(size_t b = first_block + get_local_id(0); ; b += get_local_size(0)){
+		size_t line  = b/blocks_per_line;
+		size_t start = line*nlinesamples + (b%blocks_per_line)*numb_avg;
+		size_t end   = min(start + numb_avg, (line+1)*nlinesamples);
+		if (start >= base + n) break;
+		// Only the part from base to base+n. The windows do not use the sums that are cut off
+		int i0 = (start > base) ? (int)(start - base) : 0;
+		int i1 = (int)min(end - base, (size_t)n);
+		float4 sum = 0.0f;
+		int i;
+		for(i=i0;i<i1;i++){
+			sum += prefix[i];
+			prefix[i] = sum;
+		}
+		sum = 0.0f;
+		for(i=i1-1;i>=i0;i--){
+			sum += suffix[i];
+			suffix[i] = sum;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+/** Average of the window starting at value first, from the block sums */
+float4 window_average(__local float4* prefix, __local float4* suffix, size_t base, size_t first,
+					  int numb_avg, int nlinesamples, int N) {
+	size_t line_start = (first/nlinesamples)*nlinesamples;
+	size_t line_end   = line_start + nlinesamples;
+	size_t last = min(min(first + numb_avg, line_end), (size_t)N); // one past the window
+	if (last <= first) return 0.0f;
+	size_t block_end = min(line_start + ((first - line_start)/numb_avg + 1)*numb_avg, line_end);
+	float4 sum = suffix[first - base];
+	if (last > block_end) sum += prefix[last - 1 - base];
+	return sum/(float)(last - first);
+}
+
 /** Kernel for calculating standard deviation of input array
- *	The standard deviation is calculated through mean and sumproduct
- *	@param data_re OpenCL buffer containing real data for standard deviation
- *	@param data_im OpenCL buffer containing imaginary data for standard deviation
- *	@param global_sum1_real OpenCL buffer to store summation for mean
- *	@param global_sum1_imag OpenCL buffer to store summation for mean
- *	@param global_sum2 OpenCL buffer to store sum product
+ *	The standard deviation is calculated through mean and sumproduct.
+ *	This is the first stage, the parallel reduction: each work item sums
+ *	its share of the samples, the group reduces the sums in local memory
+ *	and writes one partial sum per group. std_dev_finish does the rest.
+ *	@param data OpenCL buffer containing complex data for standard deviation
+ *	@param scratch1_real local memory, one float per work item
+ *	@param scratch1_imag local memory, one float per work item
+ *	@param scratch2 local memory, one float per work item
  *	@param N Nsamples - Number of samples in 2D, meaning data(:,:,i)
- *	@param emissions Emissions in same direction
- *	@param result Final result - standard deviation of Nsamples
+ *	@param global_sum1_real OUTPUT summation for mean, one per group
+ *	@param global_sum1_imag OUTPUT summation for mean, one per group
+ *	@param global_sum2 OUTPUT sum product, one per group
 */
-__kernel void std_dev(__global float8* data, 
+__kernel void std_dev(__global sample_t* data, 
+					  __local  float*  scratch1_real,
+					  __local  float*  scratch1_imag,
+					  __local  float*  scratch2,
+					    const  int     N, 
 					  __global float*  global_sum1_real,
 					  __global float*  global_sum1_imag,
-					  __global float*  global_sum2, 
-					    const  int     N, 
-					    const  int     emissions, 
-					  __global float*  result){
+					  __global float*  global_sum2){
  	// numbers with 1 handles mean, 2 handles std deviation product sum
-	float sum1_real, sum1_imag;
-	float sum2;
-	float4 sum_vector_real, sum_vector_imag;
-	size_t global_addr = get_global_id(0)*2;
+	size_t global_id = get_global_id(0);
 	size_t local_id = get_local_id(0);
-	__local float local_sum1_real[64];
-	__local float local_sum1_imag[64];
-	__local float local_sum2[64];
-
-	// sum for mean calculation
-	float8 tmpdata  = data[global_addr];
-	float8 tmpdata1 = data[global_addr+1];
-	sum_vector_real = tmpdata.even + tmpdata1.even;
-	sum_vector_imag = tmpdata.odd  + tmpdata1.odd;
-
-	local_sum1_real[local_id] = sum_vector_real.s0 + sum_vector_real.s1 + sum_vector_real.s2 + sum_vector_real.s3;
-	local_sum1_imag[local_id] = sum_vector_imag.s0 + sum_vector_imag.s1 + sum_vector_imag.s2 + sum_vector_imag.s3;
-	
-	// sum products for std dev calculation
-	local_sum2[local_id] = dot(sum_vector_real ,sum_vector_real) + dot(sum_vector_imag,sum_vector_imag);
-	
-	// Wait until all local parallel threads in this group are done
-	barrier(CLK_LOCAL_MEM_FENCE);
+	float sum1_real = 0.0f, sum1_imag = 0.0f;
+	float sum2 = 0.0f;
+
+	// Loop over chunks of input vector, skip by global size
+	for(size_t i = global_id; i < N; i += get_global_size(0)){
+		float2 tmpdata = convert_float2(data[i]);
+		sum1_real += tmpdata.x;
+		sum1_imag += tmpdata.y;
+		sum2 += dot(tmpdata, tmpdata);
+	}
+	scratch1_real[local_id] = sum1_real;
+	scratch1_imag[local_id] = sum1_imag;
+	scratch2[local_id] = sum2;
+
+	reduce_sum_local(scratch1_real);
+	reduce_sum_local(scratch1_imag);
+	reduce_sum_local(scratch2);
+
+	if (local_id == 0) {
+		global_sum1_real[get_group_id(0)] = scratch1_real[0];
+		global_sum1_imag[get_group_id(0)] = scratch1_imag[0];
+		global_sum2[get_group_id(0)] = scratch2[0];
+	}
+}
 
-	// The first thread in the group sums the real's, imag's, and square's
-	if(local_id == 0){
-		sum1_real = 0.0f;
-		sum1_imag = 0.0f;
-	
-		sum2 = 0.0f;
-		for(int i=0; i<get_local_size(0); i++){
-			sum1_real += local_sum1_real[i];
-			sum1_imag += local_sum1_imag[i];
-	
-			sum2 += local_sum2[i];
-		}
-		// Write to global memory so other threads can read the sums.
-		global_sum1_real[get_group_id(0)] = sum1_real;
-		global_sum1_imag[get_group_id(0)] = sum1_imag;
+/** Second stage of std_dev, run as a single work group
+ *	Reduces the partial sums from std_dev and computes the standard deviation.
+ *	@param global_sum1_real INPUT summation for mean, one per std_dev group
+ *	@param global_sum1_imag INPUT summation for mean, one per std_dev group
+ *	@param global_sum2 INPUT sum product, one per std_dev group
+ *	@param num_partial Number of std_dev groups
+ *	@param N Nsamples - Number of samples the sums were taken over
+ *	@param scratch1_real local memory, one float per work item
+ *	@param scratch1_imag local memory, one float per work item
+ *	@param scratch2 local memory, one float per work item
+ *	@param result Final result - standard deviation of Nsamples
+ */
+__kernel void std_dev_finish(__global float* global_sum1_real,
+							 __global float* global_sum1_imag,
+							 __global float* global_sum2,
+							   const  int    num_partial,
+							   const  int    N,
+							 __local  float* scratch1_real,
+							 __local  float* scratch1_imag,
+							 __local  float* scratch2,
+							 __global float* result){
+	size_t local_id = get_local_id(0);
+	float sum1_real = 0.0f, sum1_imag = 0.0f;
+	float sum2 = 0.0f;
 
-		global_sum2[get_group_id(0)] = sum2;
+	for(size_t i = local_id; i < num_partial; i += get_local_size(0)){
+		sum1_real += global_sum1_real[i];
+		sum1_imag += global_sum1_imag[i];
+		sum2 += global_sum2[i];
 	}
-	// Wait until all groups are done
-	// Need a second kernel to do this last bit
-	// can't do a barrier that will wait for all the parallel threads to finish
-	barrier(CLK_GLOBAL_MEM_FENCE);
-	
-	if(global_addr == 0){
-		sum1_real = 0.0f; sum1_imag = 0.0f;
-		sum2 = 0.0f;
-		for(int i=0; i<get_num_groups(0); i++){
-			sum1_real += global_sum1_real[i];
-			sum1_imag += global_sum1_imag[i];
-
-			sum2 += global_sum2[i];
-		}
-		sum1_real /= N;
-		sum1_imag /= N;
-		
-		//printf("%f\n", sqrt((sum2 - N*(sum1_real*sum1_real+sum1_imag*sum1_imag))/(N-1)));
-		*result = sqrt((sum2 - N*(sum1_real*sum1_real+sum1_imag*sum1_imag))/(N-1));
+	scratch1_real[local_id] = sum1_real;
+	scratch1_imag[local_id] = sum1_imag;
+	scratch2[local_id] = sum2;
+
+	reduce_sum_local(scratch1_real);
+	reduce_sum_local(scratch1_imag);
+	reduce_sum_local(scratch2);
+
+	if (local_id == 0) {
+		sum1_real = scratch1_real[0] / N;
+		sum1_imag = scratch1_imag[0] / N;
+		*result = sqrt((scratch2[0] - N*(sum1_real*sum1_real+sum1_imag*sum1_imag))/(N-1));
 	}
 }
 
@@ -180,7 +331,7 @@ __kernel void std_dev(__global float8* data,
  *	@param Nsamples Number of samples in 2D, meaning data(:,:,i)
  *	@param std_dev_global INPUT Standard deviation in first Nsamples, calculated by std_dev kernel
  */
-__kernel void velocity_est( __global float2* data,
+__kernel void velocity_est( __global sample_t* data,
 							__global float* global_temp_re,
 							__global float* global_temp_im,
 							  const  int    emissions,
@@ -198,7 +349,7 @@ __kernel void velocity_est( __global float2* data,
 	// std dev calc
 	float sum2 = 0.0f, std_dev;
 	for(i=0;i<emissions;i++){
-		float2 tmpdata  = data[global_id+Nsamples*i];
+		float2 tmpdata  = convert_float2(data[global_id+Nsamples*i]);
 
 		sum_re += tmpdata.x;
 		sum_im += tmpdata.y;
@@ -219,12 +370,12 @@ __kernel void velocity_est( __global float2* data,
 
 	// Subtract the mean (through the emission dimension) from the data
 	for(i=0;i<emissions-1;i++){
-		float2 tmpdata  = data[global_id+Nsamples*i];
+		float2 tmpdata  = convert_float2(data[global_id+Nsamples*i]);
 		// OMIT ECHO CANCELING?
 		array_re[0] = tmpdata.x - avg_re;
 		array_im[0] = tmpdata.y - avg_im;
 	
-		float2 tmpdata1  = data[global_id+Nsamples*(i+1)];
+		float2 tmpdata1  = convert_float2(data[global_id+Nsamples*(i+1)]);
 		// OMIT ECHO CANCELING?
 		array_re[1] = tmpdata1.x - avg_re;
 		array_im[1] = tmpdata1.y - avg_im;
@@ -248,11 +399,16 @@ __kernel void velocity_est( __global float2* data,
 /**	Kernel for calculating average and arctan2 of input arrays
  *	Handles the output from velocity_est kernel and
  *	returns the final velocity estimates
+ *	The average is over numb_avg depths, fewer at the end of a line, see window_average.
  *	@param data_re INPUT OpenCL buffer containing real data from autocorrelation
  *	@param data_im INPUT OpenCL buffer containing imaginary data from autocorrelation
  *	@param scale Scaling factor for after arctan2
  *	@param numb_avg Number of depths to average over
  *	@param avg_offset Step between each average
+ *	@param nlinesamples Number of axial samples per line
+ *	@param N Number of samples in data_re and data_im
+ *	@param prefix local memory, (local size-1)*avg_offset + numb_avg float4
+ *	@param suffix local memory, as prefix
  *	@param global_result OUTPUT OpenCL buffer containing final velocity estimates
  */
 __kernel void arctan(__global float* global_temp_re,
@@ -260,20 +416,22 @@ __kernel void arctan(__global float* global_temp_re,
 					   const  float  scale,
 					   const  int    numb_avg,
 					   const  int    avg_offset,
+					   const  int    nlinesamples,
+					   const  int    N,
+					 __local  float4* prefix,
+					 __local  float4* suffix,
 					 __global float* global_result){
-  	size_t global_id = get_global_id(0),i;
-	float sum_re = 0.0f,sum_im = 0.0f;
-
-	// Note: this averages across the end of a line to the next one. or even out of bounds.
-	// consider min(num_avg, nlinesamples - (global_id % linesamples)
-	//for(i=0;i<(min(numb_avg,nlinesamples-(global_id%nlinesamples));i++){ // number to average over. 40=8/35*175
-	for(i=0;i<numb_avg;i++){ //number to average over. 40=8/35*175
-		sum_re += global_temp_re[global_id*avg_offset+i];
-		sum_im += global_temp_im[global_id*avg_offset+i];
+  	size_t global_id = get_global_id(0), local_id = get_local_id(0);
+	size_t base = (global_id - local_id)*avg_offset;
+	int n = tile_length(base, numb_avg, avg_offset, N);
+	for(int i = local_id; i < n; i += get_local_size(0)){
+		prefix[i] = suffix[i] = (float4)(global_temp_re[base+i], global_temp_im[base+i], 0.0f, 0.0f);
 	}
-	sum_re /= numb_avg;
-	sum_im /= numb_avg;
-	global_result[global_id]=-scale*atan2(sum_im,sum_re);
+	block_sums_local(prefix, suffix, base, n, numb_avg, nlinesamples);
+	if (global_id >= N) return;
+
+	float4 avg = window_average(prefix, suffix, base, global_id*avg_offset, numb_avg, nlinesamples, N);
+	global_result[global_id]=-scale*atan2(avg.y,avg.x);
 }
 
 /**	to_velocity_est kernel for velocity estimation
@@ -290,8 +448,8 @@ __kernel void arctan(__global float* global_temp_re,
  *	@param Nsamples Number of samples in 2D, meaning data(:,:,i)
  *	@param global_sum12_re_im OUTPUT OpenCL buffer containing data from autocorrelations
  */
-__kernel void to_velocity_est(__global float2* dataL,
-							  __global float2* dataR,
+__kernel void to_velocity_est(__global sample_t* dataL,
+							  __global sample_t* dataR,
 							    const  int     lag_TO,
 							    const  int     emissions,
 							    const  int     Nsamples,
@@ -308,8 +466,8 @@ __kernel void to_velocity_est(__global float2* dataL,
 
 	// find the sum and average for each datapoint through emissions
 	for(i=0;i<emissions;i++){
-		float2 tmpL = dataL[global_id+Nsamples*i];
-		float2 tmpR = dataR[global_id+Nsamples*i];
+		float2 tmpL = convert_float2(dataL[global_id+Nsamples*i]);
+		float2 tmpR = convert_float2(dataR[global_id+Nsamples*i]);
 		avgL += tmpL;
 		avgR += tmpR;
 	}
@@ -319,8 +477,8 @@ __kernel void to_velocity_est(__global float2* dataL,
 	// Subtract the mean (through the emission dimension) from the data
 	// and form the in-phase sampled and hilbert quadrature samples from the left and right beams
 	for(i=0;i<emissions-lag_TO;i++){
-		float2 tmpL = dataL[global_id+Nsamples*i];
-		float2 tmpR = dataR[global_id+Nsamples*i];
+		float2 tmpL = convert_float2(dataL[global_id+Nsamples*i]);
+		float2 tmpR = convert_float2(dataR[global_id+Nsamples*i]);
 
 		// OMIT ECHO CANCELING?
 		r_sq.x  = tmpL.x - avgL.x;
@@ -342,8 +500,8 @@ __kernel void to_velocity_est(__global float2* dataL,
 		r2.y = r_sq.y - r_sqh.x;
 		
 		//reuse these local vars for storage of 'i+lag_TO' sample
-		tmpL = dataL[global_id+Nsamples*(i+lag_TO)];
-		tmpR = dataR[global_id+Nsamples*(i+lag_TO)];
+		tmpL = convert_float2(dataL[global_id+Nsamples*(i+lag_TO)]);
+		tmpR = convert_float2(dataR[global_id+Nsamples*(i+lag_TO)]);
 		
 		// OMIT ECHO CANCELING?
 		r_sq.x  = tmpL.x - avgL.x;
@@ -374,15 +532,121 @@ __kernel void to_velocity_est(__global float2* dataL,
 	global_sum12_re_im[global_id] = sum12_re_im;
 }
 
+/**	Fused split and autocorrelation kernel
+ *	Does the work of split, velocity_est and to_velocity_est in one launch.
+ *	Each work item reads its Z, L and R samples straight from the packed
+ *	input, so the intermediate buffers are never written or read back.
+ *	The results are the same as from velocity_est and to_velocity_est.
+ *	@param inbuf INPUT OpenCL buffer containing packed data, see split
+ *	@param nlinesamples Number of samples in each line
+ *	@param nlines Number of lines
+ *	@param interleave Number of interleaved Z/Z2/L/R blocks (4 * positions)
+ *	@param emissions Number of emissions in same direction
+ *	@param lag_TO Transverse lag
+ *	@param Z OUTPUT First emission of the axial data, used by std_dev kernel
+ *	@param global_temp_re OUTPUT Real part of the axial autocorrelation, as from velocity_est
+ *	@param global_temp_im OUTPUT Imaginary part of the axial autocorrelation, as from velocity_est
+ *	@param global_sum12_re_im OUTPUT Transverse autocorrelation sums, as from to_velocity_est
+ */
+__kernel void split_velocity_est(__global short2* inbuf,
+								   const  int     nlinesamples,
+								   const  int     nlines,
+								   const  int     interleave,
+								   const  int     emissions,
+								   const  int     lag_TO,
+								 __global sample_t* Z,
+								 __global float*  global_temp_re,
+								 __global float*  global_temp_im,
+								 __global float4* global_sum12_re_im){
+	size_t global_id = get_global_id(0);
+	int Nsamples = nlines*nlinesamples;
+	if (global_id >= Nsamples) return;
+
+	// global_id is [line sample, line], where line = latgroup*positions + position.
+	// Within a latgroup and emission the input holds Z/Z2/L/R of each position in turn.
+	int positions = interleave/4;
+	int line      = global_id / nlinesamples;
+	int sample    = global_id % nlinesamples;
+	size_t stride = interleave*nlinesamples; // from one emission to the next
+	size_t offZ   = ((line/positions)*emissions*interleave + (line%positions)*4)*nlinesamples + sample;
+	size_t offL   = offZ + 2*nlinesamples;
+	size_t offR   = offZ + 3*nlinesamples;
+	size_t i;
+
+	// std_dev only looks at the first emission
+	Z[global_id] = STORE_SAMPLE(inbuf[offZ]);
+
+	// find the average for each datapoint through emissions
+	float2 avgZ = 0, avgL = 0, avgR = 0;
+	for(i=0;i<emissions;i++){
+		avgZ += convert_float2(inbuf[offZ + stride*i]);
+		avgL += convert_float2(inbuf[offL + stride*i]);
+		avgR += convert_float2(inbuf[offR + stride*i]);
+	}
+	avgZ /= emissions;
+	avgL /= emissions;
+	avgR /= emissions;
+
+	// Subtract the mean and sum the axial (lag 1) and transverse (lag_TO) autocorrelations
+	float sum_re = 0.0f, sum_im = 0.0f;
+	float4 sum12_re_im = 0;
+	float2 z0, z1;
+	float2 r_sq, r_sqh;
+	float2 r1, r2, r1_TO, r2_TO;
+	for(i=0;i<emissions-1;i++){
+		z0 = convert_float2(inbuf[offZ + stride*i])     - avgZ;
+		z1 = convert_float2(inbuf[offZ + stride*(i+1)]) - avgZ;
+		sum_re += z0.x * z1.x - (-z0.y) * z1.y;
+		sum_im += z0.x * z1.y + (-z0.y) * z1.x;
+
+		if (i+lag_TO < emissions){
+			// r1 = r_sq + j*r_sqh, r2 = r_sq - j*r_sqh, see to_velocity_est
+			float2 tmpL = convert_float2(inbuf[offL + stride*i]);
+			float2 tmpR = convert_float2(inbuf[offR + stride*i]);
+			r_sq.x  = tmpL.x - avgL.x;
+			r_sqh.x = tmpL.y - avgL.y;
+			r_sq.y  = tmpR.x - avgR.x;
+			r_sqh.y = tmpR.y - avgR.y;
+			r1.x = r_sq.x - r_sqh.y;
+			r1.y = r_sq.y + r_sqh.x;
+			r2.x = r_sq.x + r_sqh.y;
+			r2.y = r_sq.y - r_sqh.x;
+
+			tmpL = convert_float2(inbuf[offL + stride*(i+lag_TO)]);
+			tmpR = convert_float2(inbuf[offR + stride*(i+lag_TO)]);
+			r_sq.x  = tmpL.x - avgL.x;
+			r_sqh.x = tmpL.y - avgL.y;
+			r_sq.y  = tmpR.x - avgR.x;
+			r_sqh.y = tmpR.y - avgR.y;
+			r1_TO.x = r_sq.x - r_sqh.y;
+			r1_TO.y = r_sq.y + r_sqh.x;
+			r2_TO.x = r_sq.x + r_sqh.y;
+			r2_TO.y = r_sq.y - r_sqh.x;
+
+			sum12_re_im.x += r1.x * r1_TO.x - (-r1.y) * r1_TO.y; // sum1_re
+			sum12_re_im.y += r1.x * r1_TO.y + (-r1.y) * r1_TO.x; // sum1_im
+			sum12_re_im.z += r2.x * r2_TO.x - (-r2.y) * r2_TO.y; // sum2_re
+			sum12_re_im.w += r2.x * r2_TO.y + (-r2.y) * r2_TO.x; // sum2_im
+		}
+	}
+	global_temp_re[global_id] = sum_re;
+	global_temp_im[global_id] = sum_im;
+	global_sum12_re_im[global_id] = sum12_re_im;
+}
+
 /**	to_arctanX kernel for calculating average and arctan2 of input arrays
  *	Handles the output from velocity_est kernel and
  *	returns the final velocity estimates
+ *	The average is over numb_avg depths, fewer at the end of a line, see window_average.
  *	@param global_sum12_re_imX INPUT OpenCL buffer containing sums from autocorrelations
  *	@param k_axial Scaling factor for after arctan2
  *	@param k_trans Scaling factor for after arctan2
  *	@param numb_avg Number of depths to average over
  *	@param avg_offset Step between each average
  *	@param nlinesamples number of axial samples per line
+ *	@param N Number of samples in global_sum12_re_im
+ *	@param prefix local memory, (local size-1)*avg_offset + numb_avg float4
+ *	@param suffix local memory, as prefix
  *	@param global_axial_result      OUTPUT OpenCL buffer containing final velocity estimates
  *	@param global_transverse_result OUTPUT OpenCL buffer containing final velocity estimates
  */
@@ -392,22 +656,23 @@ __kernel void to_arctan(__global float4* global_sum12_re_im,
 						  const  int     numb_avg,
 						  const  int     avg_offset,
 						  const  int     nlinesamples,
+						  const  int     N,
+						__local  float4* prefix,
+						__local  float4* suffix,
 						__global float*  global_axial_result,
 						__global float*  global_transverse_result){
-	size_t global_id = get_global_id(0),i;
-	float2 R1 = 0.0f, R2 = 0.0f;
-
-	// Note: this averages across the end of a line to the next one. or even out of bounds.
-	//for(i=0;i<(min(numb_avg,nlinesamples-(global_id % nlinesamples));i++){ // number to average over. 40=8/35*175
-	for(i=0;i<numb_avg;i++){ // number to average over. 40=8/35*175
-		float4 tmp = global_sum12_re_im[global_id*avg_offset+i];
-		R1.x += tmp.x; // sum1_re
-		R1.y += tmp.y; // sum1_im
-		R2.x += tmp.z; // sum2_re
-		R2.y += tmp.w; // sum2_im
+	size_t global_id = get_global_id(0), local_id = get_local_id(0);
+	size_t base = (global_id - local_id)*avg_offset;
+	int n = tile_length(base, numb_avg, avg_offset, N);
+	for(int i = local_id; i < n; i += get_local_size(0)){
+		prefix[i] = suffix[i] = global_sum12_re_im[base+i];
 	}
-	R1 /= numb_avg;
-	R2 /= numb_avg;
+	block_sums_local(prefix, suffix, base, n, numb_avg, nlinesamples);
+	if (global_id >= N) return;
+
+	float4 avg = window_average(prefix, suffix, base, global_id*avg_offset, numb_avg, nlinesamples, N);
+	float2 R1 = avg.xy; // sum1_re, sum1_im
+	float2 R2 = avg.zw; // sum2_re, sum2_im
 
 	// Don't care about this
 	//global_axial_result[global_id]=k_axial*atan2(R1_im*R2_re-R2_im*R1_re,R1_re*R2_re+R1_im*R2_im);
@@ -419,20 +684,36 @@ __kernel void to_arctan(__global float4* global_sum12_re_im,
 }
 
 /**	
- * This kernel finds the largest absolute value in a buffer
- * This is the first stage, the parallel reduction
+ * This kernel finds the largest absolute value in each of N buffers in one launch.
+ * The buffers are packed in one memory object, buffer n starts at n*stride.
+ * Dimension 1 of the NDRange selects the buffer, dimension 0 strides over it.
+ * Each group reduces its share in local memory and merges it into partial[n]
+ * with an atomic max. Absolute values are never negative, so comparing their
+ * bit patterns as ints gives the same order as comparing them as floats.
+ * The last group to finish a buffer writes maximum[n] and resets partial[n] and
+ * counter[n] for the next launch, so both must be zero before the first launch.
+ *	@param buffers INPUT N buffers of length floats, stride floats apart
+ *	@param scratch local memory, one float per work item
+ *	@param length
+ *	@param stride
+ *	@param partial N ints, running maximum of the groups finished so far
+ *	@param counter N ints, number of groups finished so far
+ *	@param maximum OUTPUT N floats, largest absolute value of each buffer
  */
-__kernel void maxabsval(__global float* buffer,
+__kernel void maxabsval(__global float* buffers,
 						__local float* scratch,
 						__const int length,
-						__global float* result) {
+						__const int stride,
+						__global int* partial,
+						__global int* counter,
+						__global float* maximum) {
+  int buffer_index = get_global_id(1); // Which buffer am I reducing?
   int global_index = get_global_id(0); // What number of job am I? 66
   int global_size = get_global_size(0); //roundup(1136*75,64)
-  int local_size = get_local_size(0); // How big is this group? 64
   int local_index = get_local_id(0); // Where am I in this group of 64?
-  int group_id = get_group_id(0); // Which group of 64 am I in?
+  __global float* buffer = buffers + buffer_index*stride;
 
-  float maxAbsVal = -INFINITY;
+  float maxAbsVal = 0.0f;
   // Loop sequentially over chunks of input vector, skip by 64s
   while (global_index < length) {
     float element = fabs(buffer[global_index]);
@@ -440,46 +721,24 @@ __kernel void maxabsval(__global float* buffer,
     global_index += global_size;
   }
 
-  // Check in our initial max, and wait for the other local threads to sync
+  // Check in our initial max, and perform parallel reduction
   scratch[local_index] = maxAbsVal;
-  barrier(CLK_LOCAL_MEM_FENCE);
-  // Perform parallel reduction
-  for(int offset = local_size / 2;
-      offset > 0;
-      offset /= 2) {
-    if (local_index < offset) {
-      float other = scratch[local_index + offset];
-      float mine = scratch[local_index];
-      scratch[local_index] = (mine > other) ? mine : other;
-    }
-    barrier(CLK_LOCAL_MEM_FENCE);
-  }
+  reduce_max_local(scratch);
   if (local_index == 0) {
-    result[group_id] = scratch[0];
+    atomic_max(&partial[buffer_index], as_int(scratch[0]));
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    // The last group to arrive sees every other group's contribution
+    if (atomic_inc(&counter[buffer_index]) == (int)get_num_groups(0) - 1) {
+      maximum[buffer_index] = as_float(atomic_xchg(&partial[buffer_index], 0));
+      atomic_xchg(&counter[buffer_index], 0);
+    }
   }
 }
 
-/**	
- * This kernel finds the largest value in a 2 buffers
- * This is the second stage, loop across first stage results
- */
-// ASK LEE IF THERE IS A MORE EFFICIENT SECOND STAGE HERE
-__kernel void maxabsval2(__global float* result1,
-						 __global float* result2,
-						 __const  int    N,
-						 __global float* maximum) {
-	maximum[0]= -INFINITY;
-	int i;
-	for(i=0;i<N;i++) {
-		maximum[0]= (result1[i] > maximum[0]) ? result1[i] : maximum[0];
-		maximum[0]= (result2[i] > maximum[0]) ? result2[i] : maximum[0];
-	}
-}
-
 /**	
  *	@param floatbufZ INPUT OpenCL buffer containing final velocity estimates for Z
  *	@param floatbufX INPUT OpenCL buffer containing final velocity estimates for X
- *	@param maximum
+ *	@param maximum largest absolute value of floatbufZ and floatbufX, unused
  *	@param scale 
  *	@param Nsamples
  *	@param outbufZ OUTPUT OpenCL buffer containing velocity estimates
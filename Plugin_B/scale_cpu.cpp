@@ -0,0 +1,381 @@
+#include "scale_cpu.h"
+
+#include <math.h>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCALE_CPU_SSE2
+#endif
+
+// Four consecutive samples of a line, one per SIMD lane.
+// All operations are lane by lane, so each sample sees the same arithmetic as in scale.cl
+#ifdef SCALE_CPU_SSE2
+typedef __m128 vec4;
+static inline vec4 vset(float a)        { return _mm_set1_ps(a); }
+static inline vec4 vadd(vec4 a, vec4 b) { return _mm_add_ps(a, b); }
+static inline vec4 vsub(vec4 a, vec4 b) { return _mm_sub_ps(a, b); }
+static inline vec4 vmul(vec4 a, vec4 b) { return _mm_mul_ps(a, b); }
+static inline vec4 vdiv(vec4 a, vec4 b) { return _mm_div_ps(a, b); }
+static inline void vstore(float* p, vec4 a) { _mm_storeu_ps(p, a); }
+
+// Splits four short2 samples into real and imaginary lanes
+static inline void vload_short2(const short* p, vec4& re, vec4& im)
+{
+	__m128i x = _mm_loadu_si128((const __m128i*)p);
+	re = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(x, 16), 16));
+	im = _mm_cvtepi32_ps(_mm_srai_epi32(x, 16));
+}
+#else
+struct vec4 { float s[4]; };
+static inline vec4 vset(float a)        { vec4 r; for (int k = 0; k < 4; k++) r.s[k] = a; return r; }
+static inline vec4 vadd(vec4 a, vec4 b) { vec4 r; for (int k = 0; k < 4; k++) r.s[k] = a.s[k] + b.s[k]; return r; }
+static inline vec4 vsub(vec4 a, vec4 b) { vec4 r; for (int k = 0; k < 4; k++) r.s[k] = a.s[k] - b.s[k]; return r; }
+static inline vec4 vmul(vec4 a, vec4 b) { vec4 r; for (int k = 0; k < 4; k++) r.s[k] = a.s[k] * b.s[k]; return r; }
+static inline vec4 vdiv(vec4 a, vec4 b) { vec4 r; for (int k = 0; k < 4; k++) r.s[k] = a.s[k] / b.s[k]; return r; }
+static inline void vstore(float* p, vec4 a) { for (int k = 0; k < 4; k++) p[k] = a.s[k]; }
+
+static inline void vload_short2(const short* p, vec4& re, vec4& im)
+{
+	for (int k = 0; k < 4; k++) { re.s[k] = p[2*k]; im.s[k] = p[2*k+1]; }
+}
+#endif
+
+/// <summary> Loads n (at most 4) short2 samples, the missing lanes are zero </summary>
+static inline void LoadSamples(const short* p, int n, vec4& re, vec4& im)
+{
+	if (n == 4) {
+		vload_short2(p, re, im);
+	} else {
+		short tmp[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+		for (int k = 0; k < 2*n; k++) tmp[k] = p[k];
+		vload_short2(tmp, re, im);
+	}
+}
+
+/// <summary> Stores the first n (at most 4) lanes </summary>
+static inline void StoreSamples(float* p, int n, vec4 a)
+{
+	if (n == 4) {
+		vstore(p, a);
+	} else {
+		float tmp[4];
+		vstore(tmp, a);
+		for (int k = 0; k < n; k++) p[k] = tmp[k];
+	}
+}
+
+/// <summary> Forms r1 = r_sq + j*r_sqh and r2 = r_sq - j*r_sqh from the left and right beams, see to_velocity_est </summary>
+static inline void Beams(const short* pL, const short* pR, int n, const vec4 avg[4], vec4 r[4])
+{
+	vec4 Lre, Lim, Rre, Rim;
+	LoadSamples(pL, n, Lre, Lim);
+	LoadSamples(pR, n, Rre, Rim);
+	vec4 r_sq_x  = vsub(Lre, avg[0]);
+	vec4 r_sqh_x = vsub(Lim, avg[1]);
+	vec4 r_sq_y  = vsub(Rre, avg[2]);
+	vec4 r_sqh_y = vsub(Rim, avg[3]);
+	r[0] = vsub(r_sq_x, r_sqh_y); // r1.x
+	r[1] = vadd(r_sq_y, r_sqh_x); // r1.y
+	r[2] = vadd(r_sq_x, r_sqh_y); // r2.x
+	r[3] = vsub(r_sq_y, r_sqh_x); // r2.y
+}
+
+/// <summary> Axial and transverse autocorrelation of n (at most 4) samples of one line.
+/// Same as split_velocity_est, with x - (-a)*b written as x + a*b, which rounds the same.
+/// @param Z Z channel of the first emission, L and R follow 1 and 2 blocks of nlinesamples later
+/// @param stride shorts from one emission to the next
+/// @param cpu State set up by PrepareCPU
+/// @param g index of the first sample in the frame
+/// </summary>
+static void AutocorrSamples(ScaleCPU& cpu, const short* Z, size_t stride, int n, size_t g)
+{
+	const int emissions = cpu.params.emissions;
+	const int lag_TO    = cpu.params.lag_TO;
+	const short* L = Z + 2*2*cpu.params.nlinesamples;
+	const short* R = Z + 3*2*cpu.params.nlinesamples;
+	int i;
+
+	// find the average for each datapoint through emissions
+	vec4 avgZre = vset(0.0f), avgZim = vset(0.0f);
+	vec4 avgLR[4] = { vset(0.0f), vset(0.0f), vset(0.0f), vset(0.0f) };
+	vec4 re, im;
+	for (i = 0; i < emissions; i++) {
+		LoadSamples(Z + stride*i, n, re, im);
+		avgZre = vadd(avgZre, re);
+		avgZim = vadd(avgZim, im);
+		LoadSamples(L + stride*i, n, re, im);
+		avgLR[0] = vadd(avgLR[0], re);
+		avgLR[1] = vadd(avgLR[1], im);
+		LoadSamples(R + stride*i, n, re, im);
+		avgLR[2] = vadd(avgLR[2], re);
+		avgLR[3] = vadd(avgLR[3], im);
+	}
+	const vec4 fEmissions = vset((float)emissions);
+	avgZre = vdiv(avgZre, fEmissions);
+	avgZim = vdiv(avgZim, fEmissions);
+	for (i = 0; i < 4; i++) avgLR[i] = vdiv(avgLR[i], fEmissions);
+
+	// axial autocorrelation, lag 1
+	vec4 sum_re = vset(0.0f), sum_im = vset(0.0f);
+	vec4 z0re, z0im, z1re, z1im;
+	LoadSamples(Z, n, re, im);
+	z0re = vsub(re, avgZre);
+	z0im = vsub(im, avgZim);
+	for (i = 0; i < emissions-1; i++) {
+		LoadSamples(Z + stride*(i+1), n, re, im);
+		z1re = vsub(re, avgZre);
+		z1im = vsub(im, avgZim);
+		sum_re = vadd(sum_re, vadd(vmul(z0re, z1re), vmul(z0im, z1im)));
+		sum_im = vadd(sum_im, vsub(vmul(z0re, z1im), vmul(z0im, z1re)));
+		z0re = z1re;
+		z0im = z1im;
+	}
+	StoreSamples(&cpu.temp_re[g], n, sum_re);
+	StoreSamples(&cpu.temp_im[g], n, sum_im);
+
+	// transverse oscillation autocorrelation, lag_TO
+	vec4 sum12[4] = { vset(0.0f), vset(0.0f), vset(0.0f), vset(0.0f) };
+	vec4 r[4], r_TO[4];
+	for (i = 0; i < emissions-lag_TO; i++) {
+		Beams(L + stride*i,          R + stride*i,          n, avgLR, r);
+		Beams(L + stride*(i+lag_TO), R + stride*(i+lag_TO), n, avgLR, r_TO);
+		sum12[0] = vadd(sum12[0], vadd(vmul(r[0], r_TO[0]), vmul(r[1], r_TO[1]))); // sum1_re
+		sum12[1] = vadd(sum12[1], vsub(vmul(r[0], r_TO[1]), vmul(r[1], r_TO[0]))); // sum1_im
+		sum12[2] = vadd(sum12[2], vadd(vmul(r[2], r_TO[2]), vmul(r[3], r_TO[3]))); // sum2_re
+		sum12[3] = vadd(sum12[3], vsub(vmul(r[2], r_TO[3]), vmul(r[3], r_TO[2]))); // sum2_im
+	}
+	StoreSamples(&cpu.sum1_re[g], n, sum12[0]);
+	StoreSamples(&cpu.sum1_im[g], n, sum12[1]);
+	StoreSamples(&cpu.sum2_re[g], n, sum12[2]);
+	StoreSamples(&cpu.sum2_im[g], n, sum12[3]);
+}
+
+/// <summary> convert_uchar_sat_rte </summary>
+static inline unsigned char SaturateRTE(float x)
+{
+	if (!(x > 0.0f)) return 0; // also NaN
+	if (x >= 255.0f) return 255;
+	return (unsigned char)std::nearbyint(x);
+}
+
+/// <summary> arctan, to_arctan and combine for every sample of one line.
+/// Like the kernels, a window of numb_avg values stops at the end of the line it starts in.
+/// The window sums are kept as running sums in double, so each sample costs O(1).
+/// </summary>
+static void VelocityLine(const ScaleCPU& cpu, int line, unsigned char* outZ, unsigned char* outX)
+{
+	const int nlinesamples = cpu.params.nlinesamples;
+	const int numb_avg     = cpu.params.numb_avg;
+	const int avg_offset   = cpu.params.avg_offset;
+	const size_t Nsamples  = (size_t)cpu.params.nlines*nlinesamples;
+	const float a = 1./(2.0*3.1415927*cpu.scale); // as in combine
+
+	// Running sums over the values [lo, hi)
+	double run[6] = {0, 0, 0, 0, 0, 0};
+	size_t lo = 0, hi = 0;
+	const std::vector<float>* values[6] = { &cpu.temp_re, &cpu.temp_im, &cpu.sum1_re, &cpu.sum1_im, &cpu.sum2_re, &cpu.sum2_im };
+
+	for (int s = 0; s < nlinesamples; s++) {
+		size_t g = (size_t)line*nlinesamples + s;
+		size_t first = g*avg_offset;
+		size_t last = (first/nlinesamples + 1)*nlinesamples; // one past the window
+		if (last > first + numb_avg) last = first + numb_avg;
+		if (last > Nsamples) last = Nsamples;
+		if (last < first) last = first;
+
+		int k;
+		if (first >= hi) { // no overlap with the last window
+			for (k = 0; k < 6; k++) run[k] = 0;
+			lo = hi = first;
+		}
+		for (; hi < last; hi++) {
+			for (k = 0; k < 6; k++) run[k] += (*values[k])[hi];
+		}
+		for (; lo < first; lo++) {
+			for (k = 0; k < 6; k++) run[k] -= (*values[k])[lo];
+		}
+
+		float count = (last > first) ? (float)(last - first) : 1.0f;
+		float sum_re = (float)run[0] / count, sum_im = (float)run[1] / count;
+		float R1x = (float)run[2] / count, R1y = (float)run[3] / count;
+		float R2x = (float)run[4] / count, R2y = (float)run[5] / count;
+
+		float velZ = -cpu.scale*atan2f(sum_im, sum_re);
+		float velX = cpu.k_trans*(float)s*atan2f(R1y*R2x+R2y*R1x, R1x*R2x-R1y*R2y);
+
+		float temp = (-1*a*velZ+1.0)/2.0*255.0;
+		outZ[g] = SaturateRTE(temp);
+		temp = (a*velX+1.0)/2.0*255.0;
+		outX[g] = SaturateRTE(temp);
+	}
+}
+
+/// <summary> Lines [first, last) of part t when nlines are shared between nparts </summary>
+static inline void PartLines(int nlines, int nparts, int t, int& first, int& last)
+{
+	first = (int)((long long)t*nlines/nparts);
+	last  = (int)((long long)(t+1)*nlines/nparts);
+}
+
+/// <summary> Body of worker t of the pool, runs each job once until stop is set </summary>
+static void WorkerMain(ScaleCPU* cpu, int t)
+{
+	unsigned seen = 0;
+	for (;;) {
+		std::function<void(int, int)> job;
+		int nlines, nparts;
+		{
+			std::unique_lock<std::mutex> lock(cpu->mutex);
+			cpu->wake.wait(lock, [&]() { return cpu->stop || cpu->generation != seen; });
+			if (cpu->stop) return;
+			seen = cpu->generation;
+			job = cpu->job;
+			nlines = cpu->job_lines;
+			nparts = (int)cpu->workers.size() + 1;
+		}
+		int first, last;
+		PartLines(nlines, nparts, t, first, last);
+		if (first < last) job(first, last);
+		{
+			std::lock_guard<std::mutex> lock(cpu->mutex);
+			if (--cpu->pending == 0) cpu->finished.notify_one();
+		}
+	}
+}
+
+/// <summary> Starts nthreads-1 workers, unless they are running already </summary>
+static void StartWorkers(ScaleCPU& cpu)
+{
+	if (!cpu.workers.empty()) return;
+	cpu.stop = false;
+	cpu.generation = 0;
+	cpu.pending = 0;
+	try {
+		cpu.workers.reserve(cpu.nthreads - 1);
+		for (int t = 1; t < cpu.nthreads; t++) cpu.workers.push_back(std::thread(WorkerMain, &cpu, t));
+	} catch (...) {
+		// Fewer threads than asked for; ForEachLines shares the lines between those that did start
+	}
+}
+
+/// <summary> Stops and joins the workers </summary>
+static void StopWorkers(ScaleCPU& cpu)
+{
+	{
+		std::lock_guard<std::mutex> lock(cpu.mutex);
+		cpu.stop = true;
+	}
+	cpu.wake.notify_all();
+	for (size_t t = 0; t < cpu.workers.size(); t++) cpu.workers[t].join();
+	cpu.workers.clear();
+	cpu.job = std::function<void(int, int)>();
+}
+
+/// <summary> Calls func(first, last) on ranges of lines from the worker pool and waits for all of them.
+/// The caller's thread does the first range while the workers do the others.
+/// </summary>
+template <typename Func>
+static void ForEachLines(ScaleCPU& cpu, int nlines, Func func)
+{
+	const int nparts = (int)cpu.workers.size() + 1;
+	if (nparts > 1) {
+		std::lock_guard<std::mutex> lock(cpu.mutex);
+		cpu.job = func;
+		cpu.job_lines = nlines;
+		cpu.pending = nparts - 1;
+		cpu.generation++;
+	}
+	if (nparts > 1) cpu.wake.notify_all();
+
+	int first, last;
+	PartLines(nlines, nparts, 0, first, last);
+	if (first < last) func(first, last);
+
+	if (nparts > 1) {
+		std::unique_lock<std::mutex> lock(cpu.mutex);
+		cpu.finished.wait(lock, [&]() { return cpu.pending == 0; });
+	}
+}
+
+int PrepareCPU(ScaleCPU& cpu, const ParamStruct* params, float scale, float k_trans)
+{
+	cpu.params  = *params;
+	cpu.scale   = scale;
+	cpu.k_trans = k_trans;
+	cpu.nthreads = (int)std::thread::hardware_concurrency();
+	if (cpu.nthreads < 1) cpu.nthreads = 1;
+	if (cpu.nthreads > params->nlines) cpu.nthreads = (params->nlines > 0) ? params->nlines : 1;
+	if ((int)cpu.workers.size() + 1 != cpu.nthreads) StopWorkers(cpu);
+
+	size_t Nsamples = (size_t)params->nlines*params->nlinesamples;
+	if (Nsamples == 0 || params->emissions < 1 || params->numb_avg < 1 || params->interleave < 4) return -1;
+	size_t len = Nsamples; // the averaging windows end at the end of the frame
+	try {
+		cpu.temp_re.assign(len, 0.0f);
+		cpu.temp_im.assign(len, 0.0f);
+		cpu.sum1_re.assign(len, 0.0f);
+		cpu.sum1_im.assign(len, 0.0f);
+		cpu.sum2_re.assign(len, 0.0f);
+		cpu.sum2_im.assign(len, 0.0f);
+	} catch (...) {
+		CleanupCPU(cpu);
+		return -1;
+	}
+	StartWorkers(cpu);
+	return 0;
+}
+
+int ProcessCPU(ScaleCPU& cpu, const void* inbuf, unsigned char* outZ, unsigned char* outX)
+{
+	const short* in        = (const short*)inbuf;
+	const int nlinesamples = cpu.params.nlinesamples;
+	const int emissions    = cpu.params.emissions;
+	const int interleave   = cpu.params.interleave;
+	const int positions    = interleave/4;
+	const int nlines       = cpu.params.nlines;
+	const size_t stride    = (size_t)2*interleave*nlinesamples; // shorts from one emission to the next
+
+	if (cpu.temp_re.empty()) return -1; // PrepareCPU has not been called
+
+	// With avg_offset 1 the averages of a line only use the line itself, so each line is done in one go
+	const bool per_line = (cpu.params.avg_offset == 1);
+
+	// split, velocity_est and to_velocity_est, reading Z/L/R straight from the input
+	ForEachLines(cpu, nlines, [&](int first, int last) {
+		for (int line = first; line < last; line++) {
+			const short* Z = in + 2*((size_t)((line/positions)*emissions*interleave + (line%positions)*4)*nlinesamples);
+			for (int s = 0; s < nlinesamples; s += 4) {
+				int n = (nlinesamples - s < 4) ? nlinesamples - s : 4;
+				AutocorrSamples(cpu, Z + 2*s, stride, n, (size_t)line*nlinesamples + s);
+			}
+			if (per_line) VelocityLine(cpu, line, outZ, outX);
+		}
+	});
+
+	// arctan, to_arctan and combine. Otherwise the averages reach into other lines, so this waits for all of the above
+	if (!per_line) {
+		ForEachLines(cpu, nlines, [&](int first, int last) {
+			for (int line = first; line < last; line++) VelocityLine(cpu, line, outZ, outX);
+		});
+	}
+	return 0;
+}
+
+void CleanupCPU(ScaleCPU& cpu)
+{
+	StopWorkers(cpu);
+	std::vector<float>().swap(cpu.temp_re);
+	std::vector<float>().swap(cpu.temp_im);
+	std::vector<float>().swap(cpu.sum1_re);
+	std::vector<float>().swap(cpu.sum1_im);
+	std::vector<float>().swap(cpu.sum2_re);
+	std::vector<float>().swap(cpu.sum2_im);
+}
+
+ScaleCPU::~ScaleCPU()
+{
+	// The host should have called Cleanup, which joins the workers already
+	StopWorkers(*this);
+}
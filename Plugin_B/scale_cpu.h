@@ -0,0 +1,70 @@
+#pragma once
+/**\file scale_cpu.h
+ * Native C++ implementation of the scale.cl pipeline, used by ProcessMemIO
+ * when the host has no OpenCL device.
+ *
+ * The stages are the same as in the OpenCL path: split, axial and transverse
+ * oscillation autocorrelation, arctan averaging and the uint8 combine. Lines are
+ * shared between a pool of worker threads, started by PrepareCPU and kept until
+ * CleanupCPU, and the autocorrelation runs four samples at a time in SIMD registers.
+ *
+ * The autocorrelation uses the same float operations in the same order as the
+ * kernels. The arctan averages are running sums in double and atan2f is the host
+ * library's, so the output is not bit-identical to the OpenCL path; plugin_bench
+ * verify checks both against the same double precision reference.
+ */
+
+#include "Parameters.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary> State of the CPU pipeline, set by PrepareCPU. One per plug-in instance. </summary>
+struct ScaleCPU {
+	ParamStruct params;
+	float scale;
+	float k_trans;
+	int nthreads;
+
+	// Axial and transverse autocorrelation sums, one per sample as in temp_re, temp_im
+	// and to_vel_est_sum12_re_im. Zero padded after Nsamples for the arctan averages.
+	std::vector<float> temp_re, temp_im;
+	std::vector<float> sum1_re, sum1_im, sum2_re, sum2_im;
+
+	// Worker pool for the line ranges, see ForEachLines in scale_cpu.cpp.
+	// The caller's thread takes the first range, each worker one of the others.
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;     // a new job, or stop
+	std::condition_variable finished; // pending reached 0
+	std::function<void(int, int)> job;
+	int job_lines;
+	unsigned generation; // counts the jobs, so a worker runs each one once
+	int pending;         // workers still running the current job
+	bool stop;
+
+	ScaleCPU() : params(), scale(0), k_trans(0), nthreads(0), job_lines(0), generation(0), pending(0), stop(false) {}
+	~ScaleCPU();
+};
+
+/// <summary> Allocates the intermediate buffers for the CPU pipeline.
+/// Must be called again whenever the parameters change.
+/// Returns -1 if memory could not be allocated, else 0.
+/// @param cpu State to set up
+/// @param params Scanner parameters, see SetParams
+/// @param scale Scaling factor for the axial arctan, as in Prepare
+/// @param k_trans Scaling factor for the transverse arctan, as in Prepare
+/// </summary>
+int PrepareCPU(ScaleCPU& cpu, const ParamStruct* params, float scale, float k_trans);
+
+/// <summary> Runs the whole pipeline on one frame.
+/// @param inbuf INPUT packed short2 frame, see split in scale.cl
+/// @param outZ OUTPUT nlinesamples*nlines axial velocities
+/// @param outX OUTPUT nlinesamples*nlines transverse velocities
+/// </summary>
+int ProcessCPU(ScaleCPU& cpu, const void* inbuf, unsigned char* outZ, unsigned char* outX);
+
+/// <summary> Stops the worker threads and frees the buffers allocated by PrepareCPU </summary>
+void CleanupCPU(ScaleCPU& cpu);
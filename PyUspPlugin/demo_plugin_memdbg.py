@@ -37,7 +37,7 @@ outbuf = cl.Buffer(ctx, mf.WRITE_ONLY, outsize.depthLen)
 
 commands = cl.CommandQueue(ctx)
 event = cl.UserEvent(ctx)
-outEvent = cl.UserEvent(ctx)
+outEvent = []    # set to [the event of the frame] by ProcessCLIO
 
 mmin = np.zeros(512, dtype=np.float32)
 #mmin[0] = Lena_32f.min()
@@ -46,7 +46,7 @@ inbuf = cl.Buffer(ctx, mf.READ_ONLY | mf.COPY_HOST_PTR, hostbuf=a)
 outbuf = cl.Buffer(ctx, mf.WRITE_ONLY, 4096)
 commands = cl.CommandQueue(ctx)
 event = cl.UserEvent(ctx)
-outEvent = cl.UserEvent(ctx)
+outEvent = []    # set to [the event of the frame] by ProcessCLIO
 
 plugin.ProcessCLIO([inbuf], [outbuf], commands, event, outEvent)
 
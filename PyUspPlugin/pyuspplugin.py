@@ -17,6 +17,14 @@ The API functions are:
        GetOutBufSize
        ProcessCLIO
        ProcessMemIO
+       ProcessCLIOBatch (optional, see HasProcessCLIOBatch)
+       ProcessMemIOStack
+       GetKernelTimings (optional, needs a queue with profiling enabled)
+
+If the compiled module _pyuspplugin (pyuspplugin_ext.cpp) is found next to this
+file, SetInBufSize, Prepare and the Process functions go through it instead of
+ctypes: buffers are passed without copying, checked against their BuffSize,
+and the GIL is released while the DLL processes.
 
 To get more information type:
     >>> import pyuspplugin
@@ -34,6 +42,11 @@ import ctypes as ct
 import pyopencl as cl
 import numpy as np
 
+try:
+    import _pyuspplugin
+except ImportError:
+    _pyuspplugin = None
+
 
 #-----------------------------------------------------------------------------
 class SampleFormat:
@@ -154,6 +167,16 @@ def BuffSizeCreate(sampleType, width, height, depth):
     return bufSize
     
 
+def _SetEvent(evout, handle):
+    """ Sets the list evout to [the event the DLL returned], a pyopencl.Event
+    that owns the handle, or to [] if the DLL returned none.
+    """
+    if handle:
+        evout[:] = [cl.Event.from_int_ptr(handle, retain=False)]
+    else:
+        evout[:] = []
+
+
 #------------------------------------------------------------------------------
 
 class DbgOclMem(ct.Structure):
@@ -173,6 +196,72 @@ DbgMem._fields_=\
      ('bufSize', BuffSize), ]     # Size of the buffer being debugged
 
 
+class KernelTiming(ct.Structure):
+    pass
+
+KernelTiming._fields_=\
+    [('name', ct.c_char_p),       # Name of the kernel
+     ('count', ct.c_uint32),      # Number of runs the statistics are over
+     ('total', ct.c_uint32),      # Number of runs since the DLL was loaded
+     ('last_us', ct.c_double),    # Duration of the last run [us]
+     ('min_us', ct.c_double),
+     ('mean_us', ct.c_double),
+     ('p99_us', ct.c_double), ]   # 99th percentile [us]
+
+
+#------------------------------------------------------------------------------
+# Output stream written by TheApplication, see UspOutputStream.h
+OutputBufferDesc = np.dtype([('sampleType', '<u4'), ('reserved', '<u4'),
+                             ('width', '<u8'), ('height', '<u8'), ('depth', '<u8'),
+                             ('widthLen', '<u8'), ('heightLen', '<u8'), ('depthLen', '<u8'),
+                             ('offset', '<u8')])
+
+OutputStreamHeader = np.dtype([('magic', 'S8'), ('version', '<u4'), ('numBuffers', '<u4'),
+                               ('numFrames', '<u8'), ('recordLen', '<u8'),
+                               ('dataOffset', '<u8'), ('indexOffset', '<u8'),
+                               ('buffers', OutputBufferDesc, (8,))])
+
+
+def ReadOutputStream(filename):
+    """ Maps an output stream file without reading it.
+
+    OUTPUTS
+    -------
+        frames - Frame number of every record
+        buffers - List with one array per output buffer, indexed [record, depth, height, width].
+                  The arrays are views of the mapped file.
+
+    A file that was not closed (numFrames is 0) is read up to its last complete record.
+    """
+    header = np.fromfile(filename, dtype=OutputStreamHeader, count=1)[0]
+    if header['magic'] != b'SPADESOS' or header['version'] != 1:
+        raise ValueError('%s is not an output stream' % filename)
+
+    recordLen = int(header['recordLen'])
+    dataOffset = int(header['dataOffset'])
+    numFrames = int(header['numFrames'])
+    if numFrames == 0:
+        import os
+        numFrames = (os.path.getsize(filename) - dataOffset) // recordLen
+
+    # One field per buffer at its offset in the record, so the file maps without changing item sizes
+    names, formats, offsets = ['frame', 'time_us'], ['<u8', '<u8'], [0, 8]
+    for n, desc in enumerate(header['buffers'][:header['numBuffers']]):
+        fmt = [f for f in SampleFormatTbl if f[1].value == desc['sampleType']][0]
+        shape = (int(desc['depth']), int(desc['height']), int(desc['width']))
+        if fmt[4] == 2:
+            shape += (2,)
+        names.append('buf%d' % n)
+        formats.append((fmt[2], shape))
+        offsets.append(int(desc['offset']))
+    record = np.dtype({'names': names, 'formats': formats, 'offsets': offsets,
+                       'itemsize': recordLen})
+
+    records = np.memmap(filename, dtype=record, mode='r', offset=dataOffset, shape=(numFrames,))
+    buffers = [records['buf%d' % n] for n in range(len(names) - 2)]
+    return records['frame'], buffers
+
+
 #-----------------------------------------------------------------------------
 class UspPlugin():
     """Class that handles plug-in modules.
@@ -247,8 +336,10 @@ class UspPlugin():
 
         ProcessCLIOProto = ct.CFUNCTYPE(ct.c_int, ct.c_void_p, ct.c_size_t, ct.c_void_p, ct.c_size_t, ct.c_void_p, ct.c_void_p, ct.c_void_p)
         ProcessMemIOProto = ct.CFUNCTYPE(ct.c_int, ct.c_void_p, ct.c_size_t, ct.c_void_p, ct.c_size_t)
+        ProcessCLIOBatchProto = ct.CFUNCTYPE(ct.c_int, ct.c_void_p, ct.c_size_t, ct.c_void_p, ct.c_size_t, ct.c_size_t, ct.c_void_p, ct.c_void_p, ct.c_void_p)
         GetDbgOclMemProto = ct.CFUNCTYPE(ct.POINTER(DbgOclMem), ct.POINTER(ct.c_uint32))
         GetDbgMemProto = ct.CFUNCTYPE(ct.POINTER(DbgMem), ct.POINTER(ct.c_uint32))
+        GetKernelTimingsProto = ct.CFUNCTYPE(ct.POINTER(KernelTiming), ct.POINTER(ct.c_uint32))
         
                 
         #DbgOclMem* __cdecl GetDbgOclMem(uint32_t* arrayLen)
@@ -262,10 +353,25 @@ class UspPlugin():
         self._GetOutBufSize = GetOutBufSizeProto(("GetOutBufSize", self.hDLL))
         self._ProcessCLIO = ProcessCLIOProto(("ProcessCLIO", self.hDLL))
         self._ProcessMemIO = ProcessMemIOProto(("ProcessMemIO", self.hDLL))
+
+        # Optional functions, None if the DLL does not export them
+        try:
+            self._ProcessCLIOBatch = ProcessCLIOBatchProto(("ProcessCLIOBatch", self.hDLL))
+        except AttributeError:
+            self._ProcessCLIOBatch = None
         
         # Debug interface
         self._GetDbgOclMem = GetDbgOclMemProto(("GetDbgOclMem", self.hDLL))
         self._GetDbgMem = GetDbgMemProto(("GetDbgMem", self.hDLL))
+
+        # Timing interface, optional
+        try:
+            self._GetKernelTimings = GetKernelTimingsProto(("GetKernelTimings", self.hDLL))
+        except AttributeError:
+            self._GetKernelTimings = None
+
+        # Compiled fast path, shares the state of the DLL loaded above
+        self._ext = _pyuspplugin.Plugin(dllname) if _pyuspplugin is not None else None
         
         
     def GetPluginInfo(self):
@@ -335,6 +441,8 @@ class UspPlugin():
         ------
             0 if no errors
         """
+        if self._ext is not None:
+            return self._ext.SetInBufSize(bufSize, bufnum)
         res = self._SetInBufSize(ct.byref(bufSize), bufnum)
         return res
 
@@ -351,6 +459,8 @@ class UspPlugin():
         ------
             0 if no errors
         """
+        if self._ext is not None:
+            return self._ext.Prepare()
         res = self._Prepare()
         return res
 
@@ -388,7 +498,9 @@ class UspPlugin():
             outbufs: list of pyopencl.Buffer() objects
             cmdqueue : pyopencl command queue
             evin : pyopencl user event - input
-            evout : pyopencl user event - Filled in by the DLL
+            evout : list - set to [pyopencl.Event] that completes with the frame,
+                    or [] if the DLL returns no event. Anything else, e.g. None,
+                    asks the DLL for no event
 
         REMARK
         ------
@@ -399,6 +511,13 @@ class UspPlugin():
             0 if no errors
 
         """
+        want = isinstance(evout, list)
+        if self._ext is not None:
+            handles = [] if want else None
+            res = self._ext.ProcessCLIO(inbufs, outbufs, cmdqueue, evin, handles)
+            if want:
+                _SetEvent(evout, handles[0] if handles else None)
+            return res
 
         inbuf_array = (ct.c_void_p * len(inbufs))()  # Instantiate array of pointers
         for n in range(0, len(inbufs)):
@@ -408,13 +527,69 @@ class UspPlugin():
         for n in range(0, len(outbufs)):
             outbuf_array[n] = outbufs[n].obj_ptr
 
-        INTP = ct.POINTER(ct.c_int)
-        ptr = INTP(ct.c_long(evout.obj_ptr))
+        ev = ct.c_void_p(0)
         res = self._ProcessCLIO(inbuf_array, len(inbufs),
                                 outbuf_array, len(outbufs),
                                 cmdqueue.obj_ptr,
                                 evin.obj_ptr,
-                                ct.byref(ptr))
+                                ct.byref(ev) if want else None)
+        if want:
+            _SetEvent(evout, ev.value)
+        return res
+
+    def HasProcessCLIOBatch(self):
+        """ True if the DLL exports the optional ProcessCLIOBatch """
+        return self._ProcessCLIOBatch is not None
+
+    def ProcessCLIOBatch(self, inbufs, outbufs, nframes, cmdqueue, evin, evout):
+        """ Process nframes frames packed one after the other in each buffer
+
+        USAGE
+        -----
+            res = obj.ProcessCLIOBatch(inbufs, outbufs, nframes, cmdqueue, evin, evout)
+
+        INPUTS
+        ------
+            inbufs: list of pyopencl.Buffer() objects, each holding nframes input frames
+            outbufs: list of pyopencl.Buffer() objects, each holding nframes output frames
+            nframes: number of frames in each buffer
+            cmdqueue : pyopencl command queue
+            evin : pyopencl user event - input
+            evout : list - set to [pyopencl.Event] that completes with the last
+                    frame, as in ProcessCLIO
+
+        OUTPUT
+        ------
+            0 if no errors
+
+        """
+        if self._ProcessCLIOBatch is None:
+            raise NotImplementedError('DLL does not export ProcessCLIOBatch')
+        want = isinstance(evout, list)
+        if self._ext is not None:
+            handles = [] if want else None
+            res = self._ext.ProcessCLIOBatch(inbufs, outbufs, nframes, cmdqueue, evin, handles)
+            if want:
+                _SetEvent(evout, handles[0] if handles else None)
+            return res
+
+        inbuf_array = (ct.c_void_p * len(inbufs))()  # Instantiate array of pointers
+        for n in range(0, len(inbufs)):
+            inbuf_array[n] = inbufs[n].obj_ptr
+
+        outbuf_array = (ct.c_void_p * len(outbufs))()  # Instantiate array of pointers
+        for n in range(0, len(outbufs)):
+            outbuf_array[n] = outbufs[n].obj_ptr
+
+        ev = ct.c_void_p(0)
+        res = self._ProcessCLIOBatch(inbuf_array, len(inbufs),
+                                     outbuf_array, len(outbufs),
+                                     nframes,
+                                     cmdqueue.obj_ptr,
+                                     evin.obj_ptr,
+                                     ct.byref(ev) if want else None)
+        if want:
+            _SetEvent(evout, ev.value)
         return res
 
     def ProcessMemIO(self, inbufs, outbufs):
@@ -437,6 +612,9 @@ class UspPlugin():
         ------
             0 if no errors
         """
+        if self._ext is not None:
+            return self._ext.ProcessMemIO(inbufs, outbufs)
+
         inbuf_array = (ct.c_void_p * len(inbufs))()
         outbuf_array = (ct.c_void_p * len(outbufs))()
 
@@ -449,6 +627,31 @@ class UspPlugin():
         res = self._ProcessMemIO(inbuf_array, len(inbufs), outbuf_array, len(outbufs))
 
         return res
+
+    def ProcessMemIOStack(self, inbufs, outbufs):
+        """Process every frame of stacked buffers with ProcessMemIO
+
+        USAGE
+        -----
+            res = obj.ProcessMemIOStack([frames], [outZ, outX])
+
+        INPUTS
+        ------
+            inbufs: list of C-contiguous numpy arrays of shape (frames, ...)
+            outbufs: list of C-contiguous numpy arrays of shape (frames, ...)
+
+        OUTPUT
+        ------
+            0 if no errors, else the error of the first frame that failed
+        """
+        if self._ext is not None:
+            return self._ext.ProcessMemIOStack(inbufs, outbufs)
+
+        for f in range(0, len(inbufs[0])):
+            res = self.ProcessMemIO([b[f] for b in inbufs], [b[f] for b in outbufs])
+            if res != 0:
+                return res
+        return 0
         
     def DbgGetOclMem(self):
         """ Return a list of DbgOclMem structures and a list of OpenCL Buffers
@@ -462,12 +665,18 @@ class UspPlugin():
             
         """
         
-        numBufs = ct.c_uint()
-        dbgOclMemPtr = self._GetDbgOclMem(ct.byref(numBufs))
-        
         memDefs = []
         clBuffs = []
-        
+
+        if self._ext is not None:
+            for name, mem, size in self._ext.GetDbgOclMem():
+                memDefs.append(DbgOclMem(name, mem, BuffSize(*size)))
+                clBuffs.append(cl.Buffer.from_cl_mem_as_int(mem))
+            return (memDefs, clBuffs)
+
+        numBufs = ct.c_uint()
+        dbgOclMemPtr = self._GetDbgOclMem(ct.byref(numBufs))
+
         for n in range(0, numBufs.value):
             B= DbgOclMem()
             B = dbgOclMemPtr[n]
@@ -475,6 +684,34 @@ class UspPlugin():
             clBuffs.append(cl.Buffer.from_cl_mem_as_int(B.mem))
             
         return (memDefs, clBuffs)
+
+    def GetKernelTimings(self):
+        """ Return a list of KernelTiming structures, one per kernel
+
+        The timings are only collected if the command queue passed to
+        ProcessCLIO was created with profiling enabled:
+
+            cmd = cl.CommandQueue(ctx, properties=cl.command_queue_properties.PROFILING_ENABLE)
+
+        KernelTiming structure consists of:
+            name - Name of the kernel
+            count - Number of runs the statistics are over (the last ones)
+            total - Number of runs since the DLL was loaded
+            last_us, min_us, mean_us, p99_us - Durations in microseconds
+
+        """
+        if self._GetKernelTimings is None:
+            raise NotImplementedError('DLL does not export GetKernelTimings')
+
+        num = ct.c_uint32()
+        timingPtr = self._GetKernelTimings(ct.byref(num))
+        return [timingPtr[n] for n in range(0, num.value)]
+
+    def PrintKernelTimings(self):
+        """ Print a table of the kernel timings, see GetKernelTimings """
+        print('{0:20s} {1:>6s} {2:>10s} {3:>10s} {4:>10s}'.format('kernel [us]', 'runs', 'min', 'mean', 'p99'))
+        for t in self.GetKernelTimings():
+            print('{0:20s} {1:6d} {2:10.1f} {3:10.1f} {4:10.1f}'.format(t.name.decode(), t.count, t.min_us, t.mean_us, t.p99_us))
         
         
         
@@ -515,7 +752,7 @@ def main():
     outbuf = cl.Buffer(ctx, mf.WRITE_ONLY, 4096)
     commands = cl.CommandQueue(ctx)
     event = cl.UserEvent(ctx)
-    outEvent = cl.UserEvent(ctx)
+    outEvent = []    # set to [the event of the frame] by ProcessCLIO
 
     plugin.ProcessCLIO([inbuf], [outbuf], commands, event, outEvent)
 
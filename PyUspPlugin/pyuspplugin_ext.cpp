@@ -0,0 +1,527 @@
+/**\file pyuspplugin_ext.cpp
+ * Compiled companion of pyuspplugin.py, imported as _pyuspplugin.
+ *
+ * The ctypes wrapper builds arrays of pointers on every call, which costs
+ * more than the plug-in itself when a script feeds it many small frames.
+ * This module calls the plain API of the DLL directly:
+ *
+ *  - Buffers are taken through the buffer protocol (NumPy arrays, memoryview,
+ *    bytearray, ...) without a copy. They must be C-contiguous, the outputs
+ *    writable.
+ *  - Their lengths are checked against the BuffSize of each buffer, which
+ *    the module keeps from SetInBufSize and Prepare.
+ *  - The GIL is released while the DLL processes.
+ *  - ProcessMemIOStack runs a whole (frames, ...) stack in one call, with
+ *    the buffers checked once for the stack.
+ *
+ * The DLL is loaded a second time by the module. Both handles refer to the
+ * same library, so the state set through ctypes (InitializeCL, SetParams,
+ * ...) is the state the module processes with.
+ *
+ * Example (as done by pyuspplugin.UspPlugin when the module is found):
+ *
+ *  import _pyuspplugin
+ *  ext = _pyuspplugin.Plugin('plugins/plugin_b.dll')
+ *  ext.SetInBufSize(insize, 0)          # a pyuspplugin.BuffSize
+ *  ext.Prepare()
+ *  frames = np.empty((100,) + frame_shape, np.int16)
+ *  outZ = np.empty((100, nlines, nlinesamples), np.uint8)
+ *  outX = np.empty_like(outZ)
+ *  ext.ProcessMemIOStack([frames], [outZ, outX])
+ */
+
+#include <Python.h>
+
+#include "UspPlugin.h"
+#include "UspDll.h"
+#include "UspDebug.h"
+
+#include <cstring>
+
+#define EXT_MAX_BUFFERS 8   ///< Most input or output buffers of a DLL
+
+#if PY_MAJOR_VERSION >= 3
+#define PyInt_AsSsize_t PyLong_AsSsize_t
+#define NAME_FORMAT "y"     // Names are bytes, as the c_char_p fields of pyuspplugin
+#else
+#define NAME_FORMAT "s"
+#endif
+
+typedef DbgOclMem* (*GetDbgOclMemPtr)(uint32_t* arrayLen);
+
+
+/** One loaded DLL */
+typedef struct PluginObject {
+    PyObject_HEAD
+    UspDllHandle lib;
+    PluginApi api;
+    GetDbgOclMemPtr GetDbgOclMem;       ///< Optional, NULL if not exported
+    PluginInfo info;
+    BuffSize inSize[EXT_MAX_BUFFERS];   ///< From SetInBufSize
+    BuffSize outSize[EXT_MAX_BUFFERS];  ///< From GetOutBufSize after Prepare
+    int inSet;                          ///< Bit n is set once input n has a size
+    int prepared;                       ///< outSize is valid
+    int busy;                           ///< A call is in the DLL with the GIL released
+} PluginObject;
+
+
+/** The buffers of one call, held until Release */
+typedef struct BufferSet {
+    Py_buffer views[2*EXT_MAX_BUFFERS];
+    int numViews;
+} BufferSet;
+
+
+static void ReleaseBuffers(BufferSet* set)
+{
+    for (int n = 0; n < set->numViews; n++) PyBuffer_Release(&set->views[n]);
+    set->numViews = 0;
+}
+
+/// <summary> Gets the buffers of a list, checking that each is C-contiguous and frames*depthLen bytes long.
+/// frames 0 takes the number of frames from the first buffer. Raises an exception and returns -1 on error.
+/// @param seq A list or tuple of objects with the buffer protocol
+/// @param sizes The size of one frame of each buffer
+/// @param writable Non-zero for output buffers
+/// @param ptrs OUTPUT the start of each buffer
+/// @param frames IN/OUTPUT the number of frames in every buffer
+/// </summary>
+static int GetBuffers(PyObject* seq, const BuffSize* sizes, int count, int writable, const char* what,
+                      BufferSet* set, void** ptrs, Py_ssize_t* frames)
+{
+    PyObject* fast = PySequence_Fast(seq, "buffers must be a list or tuple");
+    if (fast == NULL) return -1;
+    if (PySequence_Fast_GET_SIZE(fast) != count) {
+        PyErr_Format(PyExc_ValueError, "expected %d %s buffers, got %d", count, what, (int)PySequence_Fast_GET_SIZE(fast));
+        Py_DECREF(fast);
+        return -1;
+    }
+    int flags = PyBUF_C_CONTIGUOUS | (writable ? PyBUF_WRITABLE : 0);
+    for (int n = 0; n < count; n++) {
+        Py_buffer* view = &set->views[set->numViews];
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(fast, n), view, flags) != 0) {
+            Py_DECREF(fast);
+            return -1;
+        }
+        set->numViews++;
+
+        Py_ssize_t frameLen = (Py_ssize_t)sizes[n].depthLen;
+        if (*frames == 0 && frameLen > 0 && view->len % frameLen == 0) *frames = view->len / frameLen;
+        if (frameLen == 0 || view->len != *frames * frameLen) {
+            PyErr_Format(PyExc_ValueError, "%s buffer %d has %zd bytes, expected %zd frame(s) of %zd",
+                         what, n, view->len, *frames, frameLen);
+            Py_DECREF(fast);
+            return -1;
+        }
+        ptrs[n] = view->buf;
+    }
+    Py_DECREF(fast);
+    return 0;
+}
+
+/// <summary> Gets the OpenCL handles of a list: ints, or pyopencl objects (int_ptr, or obj_ptr in older versions).
+/// Raises an exception and returns -1 on error.
+/// </summary>
+static int GetHandle(PyObject* obj, void** handle)
+{
+    PyObject* num = NULL;
+    if (obj == Py_None) {
+        *handle = NULL;
+        return 0;
+    }
+    if (PyObject_HasAttrString(obj, "int_ptr")) num = PyObject_GetAttrString(obj, "int_ptr");
+    else if (PyObject_HasAttrString(obj, "obj_ptr")) num = PyObject_GetAttrString(obj, "obj_ptr");
+    else { num = obj; Py_INCREF(num); }
+    if (num == NULL) return -1;
+    *handle = PyLong_AsVoidPtr(num);
+    Py_DECREF(num);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static int GetHandles(PyObject* seq, int count, const char* what, void** handles)
+{
+    PyObject* fast = PySequence_Fast(seq, "buffers must be a list or tuple");
+    if (fast == NULL) return -1;
+    if (PySequence_Fast_GET_SIZE(fast) != count) {
+        PyErr_Format(PyExc_ValueError, "expected %d %s buffers, got %d", count, what, (int)PySequence_Fast_GET_SIZE(fast));
+        Py_DECREF(fast);
+        return -1;
+    }
+    int err = 0;
+    for (int n = 0; n < count && err == 0; n++) err = GetHandle(PySequence_Fast_GET_ITEM(fast, n), &handles[n]);
+    Py_DECREF(fast);
+    return err;
+}
+
+/// <summary> Reads a BuffSize from an object with its fields as attributes, e.g. pyuspplugin.BuffSize </summary>
+static int GetBuffSize(PyObject* obj, BuffSize* size)
+{
+    static const char* fields[] = { "width", "height", "depth", "widthLen", "heightLen", "depthLen" };
+    size_t* values[] = { &size->width, &size->height, &size->depth, &size->widthLen, &size->heightLen, &size->depthLen };
+
+    PyObject* attr = PyObject_GetAttrString(obj, "sampleType");
+    if (attr == NULL) return -1;
+    size->sampleType = (SampleType)PyInt_AsSsize_t(attr);
+    Py_DECREF(attr);
+    for (int n = 0; n < 6 && !PyErr_Occurred(); n++) {
+        attr = PyObject_GetAttrString(obj, fields[n]);
+        if (attr == NULL) return -1;
+        *values[n] = (size_t)PyInt_AsSsize_t(attr);
+        Py_DECREF(attr);
+    }
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/// <summary> Claims the DLL for a call that releases the GIL. Raises an exception and returns -1 if it is in use </summary>
+static int Claim(PluginObject* self)
+{
+    if (self->lib == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "the plug-in is not loaded");
+        return -1;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "the plug-in is in use by another thread");
+        return -1;
+    }
+    self->busy = 1;
+    return 0;
+}
+
+
+static int Plugin_init(PluginObject* self, PyObject* args, PyObject* /*kwds*/)
+{
+    const char* path;
+    if (!PyArg_ParseTuple(args, "s", &path)) return -1;
+    if (self->lib != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "the plug-in is already loaded");
+        return -1;
+    }
+
+    UspDllHandle lib = UspDllOpen(path);
+    if (lib == NULL) {
+        PyErr_Format(PyExc_OSError, "could not load %s: %s", path, UspDllError());
+        return -1;
+    }
+    memset(&self->api, 0, sizeof(self->api));
+    self->api.GetPluginInfo    = (GetPluginInfoPtr) UspDllSymbol(lib, "GetPluginInfo");
+    self->api.SetInBufSize     = (SetInBufSizePtr) UspDllSymbol(lib, "SetInBufSize");
+    self->api.Prepare          = (PreparePtr) UspDllSymbol(lib, "Prepare");
+    self->api.GetOutBufSize    = (GetOutBufSizePtr) UspDllSymbol(lib, "GetOutBufSize");
+    self->api.ProcessCLIO      = (ProcessCLIOPtr) UspDllSymbol(lib, "ProcessCLIO");
+    self->api.ProcessMemIO     = (ProcessMemIOPtr) UspDllSymbol(lib, "ProcessMemIO");
+    self->api.ProcessCLIOBatch = (ProcessCLIOBatchPtr) UspDllSymbol(lib, "ProcessCLIOBatch");   // optional
+    self->GetDbgOclMem         = (GetDbgOclMemPtr) UspDllSymbol(lib, "GetDbgOclMem");           // optional
+    if (   self->api.GetPluginInfo == NULL
+        || self->api.SetInBufSize == NULL
+        || self->api.Prepare == NULL
+        || self->api.GetOutBufSize == NULL
+        || self->api.ProcessCLIO == NULL
+        || self->api.ProcessMemIO == NULL )
+    {
+        UspDllClose(lib);
+        PyErr_Format(PyExc_OSError, "one or more functions from the API were not found in %s", path);
+        return -1;
+    }
+
+    self->api.GetPluginInfo(&self->info);
+    if (self->info.NumInBuffers < 0 || self->info.NumInBuffers > EXT_MAX_BUFFERS
+        || self->info.NumOutBuffers < 0 || self->info.NumOutBuffers > EXT_MAX_BUFFERS) {
+        UspDllClose(lib);
+        PyErr_Format(PyExc_ValueError, "%s has more than %d input or output buffers", path, EXT_MAX_BUFFERS);
+        return -1;
+    }
+    self->lib = lib;
+    self->inSet = 0;
+    self->prepared = 0;
+    self->busy = 0;
+    return 0;
+}
+
+static void Plugin_dealloc(PluginObject* self)
+{
+    PyTypeObject* type = Py_TYPE(self);
+    if (self->lib != NULL) UspDllClose(self->lib);
+    type->tp_free((PyObject*)self);
+#if PY_MAJOR_VERSION >= 3
+    Py_DECREF(type);   // a heap type, see PyInit__pyuspplugin
+#endif
+}
+
+
+static PyObject* Plugin_SetInBufSize(PluginObject* self, PyObject* args)
+{
+    PyObject* obj;
+    int bufnum = 0;
+    BuffSize size;
+    if (!PyArg_ParseTuple(args, "O|i", &obj, &bufnum)) return NULL;
+    if (bufnum < 0 || bufnum >= self->info.NumInBuffers) {
+        PyErr_Format(PyExc_IndexError, "input buffer %d out of range", bufnum);
+        return NULL;
+    }
+    if (GetBuffSize(obj, &size) != 0 || Claim(self) != 0) return NULL;
+
+    int res = self->api.SetInBufSize(&size, bufnum);
+    self->busy = 0;
+    if (res == 0) {
+        self->inSize[bufnum] = size;
+        self->inSet |= 1 << bufnum;
+    }
+    self->prepared = 0;
+    return PyLong_FromLong(res);
+}
+
+static PyObject* Plugin_Prepare(PluginObject* self, PyObject* /*args*/)
+{
+    if (Claim(self) != 0) return NULL;
+    int res;
+    Py_BEGIN_ALLOW_THREADS
+    res = self->api.Prepare();
+    for (int n = 0; n < self->info.NumOutBuffers && res == 0; n++) res = self->api.GetOutBufSize(&self->outSize[n], n);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    self->prepared = (res == 0);
+    return PyLong_FromLong(res);
+}
+
+/// <summary> Checks that the sizes of all buffers are known. Raises an exception and returns -1 if not </summary>
+static int CheckSizes(PluginObject* self)
+{
+    if (self->inSet != (1 << self->info.NumInBuffers) - 1 || !self->prepared) {
+        PyErr_SetString(PyExc_RuntimeError, "SetInBufSize and Prepare must be called through this module first");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject* ProcessFrames(PluginObject* self, PyObject* args, int stack)
+{
+    PyObject *inseq, *outseq;
+    if (!PyArg_ParseTuple(args, "OO", &inseq, &outseq)) return NULL;
+    if (CheckSizes(self) != 0) return NULL;
+
+    BufferSet set;
+    set.numViews = 0;
+    void* inbuf[EXT_MAX_BUFFERS];
+    void* outbuf[EXT_MAX_BUFFERS];
+    size_t numin = (size_t)self->info.NumInBuffers, numout = (size_t)self->info.NumOutBuffers;
+    Py_ssize_t frames = stack ? 0 : 1;
+    if (   GetBuffers(inseq,  self->inSize,  (int)numin,  0, "input",  &set, inbuf,  &frames) != 0
+        || GetBuffers(outseq, self->outSize, (int)numout, 1, "output", &set, outbuf, &frames) != 0
+        || Claim(self) != 0)
+    {
+        ReleaseBuffers(&set);
+        return NULL;
+    }
+
+    // One frame after the other, stopping at the first that fails
+    int res = 0;
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t f = 0; f < frames && res == 0; f++) {
+        void* in[EXT_MAX_BUFFERS];
+        void* out[EXT_MAX_BUFFERS];
+        for (size_t n = 0; n < numin;  n++) in[n]  = (char*)inbuf[n]  + f*self->inSize[n].depthLen;
+        for (size_t n = 0; n < numout; n++) out[n] = (char*)outbuf[n] + f*self->outSize[n].depthLen;
+        res = self->api.ProcessMemIO(in, numin, out, numout);
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    ReleaseBuffers(&set);
+    return PyLong_FromLong(res);
+}
+
+static PyObject* Plugin_ProcessMemIO(PluginObject* self, PyObject* args)
+{
+    return ProcessFrames(self, args, 0);
+}
+
+static PyObject* Plugin_ProcessMemIOStack(PluginObject* self, PyObject* args)
+{
+    return ProcessFrames(self, args, 1);
+}
+
+/// <summary> ProcessCLIO or ProcessCLIOBatch. If evout is a list, it is set to [the event of the DLL as an int],
+/// or [] if the DLL gives none. The caller then owns the event, pyuspplugin wraps it in a pyopencl.Event.
+/// With evout None the DLL is not asked for an event.
+/// </summary>
+static PyObject* EnqueueFrames(PluginObject* self, PyObject* args, int batch)
+{
+    PyObject *inseq, *outseq, *queueObj, *evObj = Py_None, *evoutObj = Py_None;
+    Py_ssize_t nframes = 1;
+    if (batch) {
+        if (!PyArg_ParseTuple(args, "OOnO|OO", &inseq, &outseq, &nframes, &queueObj, &evObj, &evoutObj)) return NULL;
+        if (self->api.ProcessCLIOBatch == NULL) {
+            PyErr_SetString(PyExc_NotImplementedError, "DLL does not export ProcessCLIOBatch");
+            return NULL;
+        }
+        if (nframes < 1) {
+            PyErr_SetString(PyExc_ValueError, "nframes must be at least 1");
+            return NULL;
+        }
+    } else if (!PyArg_ParseTuple(args, "OOO|OO", &inseq, &outseq, &queueObj, &evObj, &evoutObj)) {
+        return NULL;
+    }
+    if (evoutObj != Py_None && !PyList_Check(evoutObj)) {
+        PyErr_SetString(PyExc_TypeError, "evout must be a list or None");
+        return NULL;
+    }
+
+    void* inmem[EXT_MAX_BUFFERS];
+    void* outmem[EXT_MAX_BUFFERS];
+    void *queue, *inEv;
+    size_t numin = (size_t)self->info.NumInBuffers, numout = (size_t)self->info.NumOutBuffers;
+    if (   GetHandles(inseq,  (int)numin,  "input",  inmem) != 0
+        || GetHandles(outseq, (int)numout, "output", outmem) != 0
+        || GetHandle(queueObj, &queue) != 0 || GetHandle(evObj, &inEv) != 0
+        || Claim(self) != 0)
+    {
+        return NULL;
+    }
+
+    int res;
+    cl_event outEv = NULL;
+    cl_event* outEvPtr = (evoutObj != Py_None) ? &outEv : NULL;
+    Py_BEGIN_ALLOW_THREADS
+    if (batch) {
+        res = self->api.ProcessCLIOBatch((cl_mem*)inmem, numin, (cl_mem*)outmem, numout, (size_t)nframes,
+                                         (cl_command_queue)queue, (cl_event)inEv, outEvPtr);
+    } else {
+        res = self->api.ProcessCLIO((cl_mem*)inmem, numin, (cl_mem*)outmem, numout,
+                                    (cl_command_queue)queue, (cl_event)inEv, outEvPtr);
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if (outEvPtr != NULL) {
+        PyObject* events = (outEv != NULL) ? Py_BuildValue("[N]", PyLong_FromVoidPtr(outEv)) : PyList_New(0);
+        if (events == NULL) return NULL;
+        int err = PyList_SetSlice(evoutObj, 0, PyList_GET_SIZE(evoutObj), events);
+        Py_DECREF(events);
+        if (err != 0) return NULL;
+    }
+    return PyLong_FromLong(res);
+}
+
+static PyObject* Plugin_ProcessCLIO(PluginObject* self, PyObject* args)
+{
+    return EnqueueFrames(self, args, 0);
+}
+
+static PyObject* Plugin_ProcessCLIOBatch(PluginObject* self, PyObject* args)
+{
+    return EnqueueFrames(self, args, 1);
+}
+
+static PyObject* Plugin_GetDbgOclMem(PluginObject* self, PyObject* /*args*/)
+{
+    if (self->GetDbgOclMem == NULL) {
+        PyErr_SetString(PyExc_NotImplementedError, "DLL does not export GetDbgOclMem");
+        return NULL;
+    }
+    uint32_t num = 0;
+    DbgOclMem* mems = self->GetDbgOclMem(&num);
+    PyObject* list = PyList_New(num);
+    for (uint32_t n = 0; list != NULL && n < num; n++) {
+        const BuffSize& s = mems[n].bufSize;
+        PyObject* item = Py_BuildValue("(" NAME_FORMAT "N(innnnnn))", mems[n].name, PyLong_FromVoidPtr(mems[n].mem),
+                                       (int)s.sampleType, (Py_ssize_t)s.width, (Py_ssize_t)s.height, (Py_ssize_t)s.depth,
+                                       (Py_ssize_t)s.widthLen, (Py_ssize_t)s.heightLen, (Py_ssize_t)s.depthLen);
+        if (item == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, n, item);
+    }
+    return list;
+}
+
+static PyObject* Plugin_HasProcessCLIOBatch(PluginObject* self, PyObject* /*args*/)
+{
+    return PyBool_FromLong(self->api.ProcessCLIOBatch != NULL);
+}
+
+
+static PyMethodDef Plugin_methods[] = {
+    {"SetInBufSize", (PyCFunction)Plugin_SetInBufSize, METH_VARARGS,
+     "SetInBufSize(size, bufnum=0) - Calls SetInBufSize of the DLL and keeps size to check the input buffers against"},
+    {"Prepare", (PyCFunction)Plugin_Prepare, METH_NOARGS,
+     "Prepare() - Calls Prepare of the DLL and keeps the sizes of the output buffers"},
+    {"ProcessMemIO", (PyCFunction)Plugin_ProcessMemIO, METH_VARARGS,
+     "ProcessMemIO(inbufs, outbufs) - Processes one frame in buffers with the buffer protocol, without copying them"},
+    {"ProcessMemIOStack", (PyCFunction)Plugin_ProcessMemIOStack, METH_VARARGS,
+     "ProcessMemIOStack(inbufs, outbufs) - Processes every frame of stacked buffers, e.g. arrays of shape (frames, ...).\n"
+     "Stops at the first frame that fails and returns its error"},
+    {"ProcessCLIO", (PyCFunction)Plugin_ProcessCLIO, METH_VARARGS,
+     "ProcessCLIO(inmems, outmems, queue, evin=None, evout=None) - Takes pyopencl objects or int handles.\n"
+     "A list given as evout is set to [the int handle of the event that completes with the frame], which the caller then owns"},
+    {"ProcessCLIOBatch", (PyCFunction)Plugin_ProcessCLIOBatch, METH_VARARGS,
+     "ProcessCLIOBatch(inmems, outmems, nframes, queue, evin=None, evout=None) - As ProcessCLIO, for nframes packed frames"},
+    {"HasProcessCLIOBatch", (PyCFunction)Plugin_HasProcessCLIOBatch, METH_NOARGS,
+     "HasProcessCLIOBatch() - True if the DLL exports ProcessCLIOBatch"},
+    {"GetDbgOclMem", (PyCFunction)Plugin_GetDbgOclMem, METH_NOARGS,
+     "GetDbgOclMem() - List of (name, cl_mem as int, (sampleType, width, height, depth, widthLen, heightLen, depthLen))"},
+    {NULL, NULL, 0, NULL}
+};
+
+static const char Plugin_doc[] = "Plugin(path) - A UspPlugin DLL, called without ctypes";
+
+#if PY_MAJOR_VERSION >= 3
+static PyType_Slot Plugin_slots[] = {
+    {Py_tp_dealloc, (void*)Plugin_dealloc},
+    {Py_tp_doc,     (void*)Plugin_doc},
+    {Py_tp_methods, (void*)Plugin_methods},
+    {Py_tp_init,    (void*)Plugin_init},
+    {Py_tp_new,     (void*)PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec Plugin_spec = {
+    "_pyuspplugin.Plugin", (int)sizeof(PluginObject), 0, Py_TPFLAGS_DEFAULT, Plugin_slots
+};
+#else
+static PyTypeObject PluginType;   // Set up field by field in init_pyuspplugin
+#endif
+
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT, "_pyuspplugin", "Compiled companion of pyuspplugin", -1, NULL, NULL, NULL, NULL, NULL
+};
+#define MODULE_INIT_ERROR NULL
+#else
+#define MODULE_INIT_ERROR
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+PyMODINIT_FUNC PyInit__pyuspplugin(void)
+#else
+PyMODINIT_FUNC init_pyuspplugin(void)
+#endif
+{
+#if PY_MAJOR_VERSION >= 3
+    PyObject* module = PyModule_Create(&module_def);
+    if (module == NULL) return MODULE_INIT_ERROR;
+    PyObject* type = PyType_FromSpec(&Plugin_spec);
+    if (type == NULL || PyModule_AddObject(module, "Plugin", type) != 0) {
+        Py_XDECREF(type);
+        Py_DECREF(module);
+        return MODULE_INIT_ERROR;
+    }
+    return module;
+#else
+    Py_REFCNT(&PluginType)  = 1;
+    PluginType.tp_name      = "_pyuspplugin.Plugin";
+    PluginType.tp_basicsize = sizeof(PluginObject);
+    PluginType.tp_dealloc   = (destructor)Plugin_dealloc;
+    PluginType.tp_flags     = Py_TPFLAGS_DEFAULT;
+    PluginType.tp_doc       = Plugin_doc;
+    PluginType.tp_methods   = Plugin_methods;
+    PluginType.tp_init      = (initproc)Plugin_init;
+    PluginType.tp_new       = PyType_GenericNew;
+    if (PyType_Ready(&PluginType) < 0) return MODULE_INIT_ERROR;
+
+    PyObject* module = Py_InitModule3("_pyuspplugin", NULL, "Compiled companion of pyuspplugin");
+    if (module == NULL) return MODULE_INIT_ERROR;
+    Py_INCREF(&PluginType);
+    PyModule_AddObject(module, "Plugin", (PyObject*)&PluginType);
+#endif
+}
@@ -5,8 +5,6 @@
 //#include <windows.h>
 //#include <winsock2.h>
 #include <ws2tcpip.h>
-#else
-#include <dlfcn.h>
 #endif
 
 //#include "common_cl_srv.h"
@@ -16,99 +14,120 @@
 #include <cmath>
 #include <stdexcept>
 #include <time.h>
+#include <chrono>
 #include "UspPlugin.h"
+#include "UspDll.h"
+#include "UspTiming.h"
+#include "UspRecording.h"
+#include "UspOutputStream.h"
 #include "Parameters.h"
 
-//CREATE MEMORY SPACE
-short  data[8*DATA_SIZE_IN]; //16-bit integer
-unsigned char resultsZ[DATA_SIZE_OUT]; //8-bit integer
-unsigned char resultsX[DATA_SIZE_OUT]; //8-bit integer
-
-PluginApi api;
+// Command line: TheApplication [frames_in_flight] [profile] [numa] [zerocopy] [recording.rec] [record recording.rec]
+//  frames_in_flight  Frames in flight in the streaming loop (default 3)
+//  profile           Enables profiling on the processing queue and prints the kernel timings
+//  numa              Runs on the CPU, split into one sub-device per NUMA node. The context holds
+//                    all of them and the plug-in splits each frame across them
+//  recording.rec     Replays the frames and parameters of a recording (see UspRecording.h)
+//                    instead of the FromLive_%02d.bin files
+//  zerocopy          With a recording, wraps the mapped frames in CL_MEM_USE_HOST_PTR buffers
+//                    instead of writing them to the device
+//  record            Writes the FromLive_%02d.bin files and the parameters below to a recording and exits
+// The results of all frames are written to RESULTS_FILE (see UspOutputStream.h).
+#define MAX_FRAMES_IN_FLIGHT 8
+#define RESULTS_FILE "results.out"
+#define RESULTS_QUEUE_LEN 16   // Frames that can wait for the disk before the streaming loop does
+#define NUM_LIVE_FILES 13
+#define MAX_SUB_DEVICES 16     // Most NUMA nodes the CPU is split into
+#define MAX_PLATFORMS 8        // Most OpenCL platforms looked at for the device
+
+PluginBinding plugin; // API of the loaded DLL, and the instance used if it has the handle-based variant
 //char dllpath[4096];
 PluginInfo pluginInfo;
 
-#if defined ( WIN32 )
-HMODULE hLib;
-const char* dllname = "plugins/plugin_b.dll";
-#elif defined (__APPLE__)
-const char* dllname = "plugins/libplugin_a.dylib";
-void * hLib;
+#if defined (__APPLE__)
+const char* dllname = "plugins/" USP_DLL_NAME("plugin_a");
+#else
+const char* dllname = "plugins/" USP_DLL_NAME("plugin_b");
 #endif
+UspDllHandle hLib;
+
+void* FindSymbol(const char *name)
+{
+    return UspDllSymbol(hLib, name);
+}
 
-#ifdef WIN32
 int LoadDLL(const char *name)
 {
-    hLib = LoadLibrary(name);
+    hLib = UspDllOpen(name);
     if (hLib == NULL) {
-        printf("Could not load library \n");
+        fprintf(stderr, "Could not load library %s: %s\n", name, UspDllError());
         return -1;
     }
-    api.GetPluginInfo = (GetPluginInfoPtr) GetProcAddress( hLib, "GetPluginInfo");
-    api.Initialize = (InitializePtr) GetProcAddress(hLib, "Initialize");
-    api.InitializeCL = (InitializeCLPtr) GetProcAddress(hLib,"InitializeCL");
-    api.SetParams = (SetParamsPtr) GetProcAddress(hLib, "SetParams");
-    api.SetInBufSize = (SetInBufSizePtr) GetProcAddress(hLib, "SetInBufSize");
-    api.Prepare = (PreparePtr) GetProcAddress(hLib, "Prepare");
-    api.GetOutBufSize = (GetOutBufSizePtr) GetProcAddress(hLib, "GetOutBufSize");
-    api.ProcessCLIO = (ProcessCLIOPtr) GetProcAddress(hLib, "ProcessCLIO");
-    api.ProcessMemIO = (ProcessMemIOPtr) GetProcAddress(hLib, "ProcessMemIO");
-    api.Cleanup = (CleanupPtr) GetProcAddress(hLib, "Cleanup");
-
-    if (   api.GetPluginInfo == NULL 
-        || api.Initialize == NULL
-        || api.InitializeCL == NULL
-        || api.SetParams == NULL
-        || api.SetInBufSize == NULL
-        || api.Prepare == NULL
-        || api.GetOutBufSize == NULL
-        || api.ProcessCLIO == NULL
-        || api.ProcessMemIO == NULL
-        || api.Cleanup == NULL )
+
+    plugin.api.GetPluginInfo = (GetPluginInfoPtr) FindSymbol("GetPluginInfo");
+    plugin.api.Initialize = (InitializePtr) FindSymbol("Initialize");
+    plugin.api.InitializeCL = (InitializeCLPtr) FindSymbol("InitializeCL");
+    plugin.api.SetParams = (SetParamsPtr) FindSymbol("SetParams");
+    plugin.api.SetInBufSize = (SetInBufSizePtr) FindSymbol("SetInBufSize");
+    plugin.api.Prepare = (PreparePtr) FindSymbol("Prepare");
+    plugin.api.GetOutBufSize = (GetOutBufSizePtr) FindSymbol("GetOutBufSize");
+    plugin.api.ProcessCLIO = (ProcessCLIOPtr) FindSymbol("ProcessCLIO");
+    plugin.api.ProcessMemIO = (ProcessMemIOPtr) FindSymbol("ProcessMemIO");
+    plugin.api.Cleanup = (CleanupPtr) FindSymbol("Cleanup");
+
+    if (   plugin.api.GetPluginInfo == NULL
+        || plugin.api.Initialize == NULL
+        || plugin.api.InitializeCL == NULL
+        || plugin.api.SetParams == NULL
+        || plugin.api.SetInBufSize == NULL
+        || plugin.api.Prepare == NULL
+        || plugin.api.GetOutBufSize == NULL
+        || plugin.api.ProcessCLIO == NULL
+        || plugin.api.ProcessMemIO == NULL
+        || plugin.api.Cleanup == NULL )
     { // If a pointer is equal to NULL
         printf(" One or more functions from the API were not found \n");
         return -1;
     }
     return 0;
 }
-#else
-int LoadDLL(const char *name)
-{
-    hLib = dlopen(name, RTLD_LAZY);
-    if (!hLib){
-        fprintf(stderr, "%s\n", dlerror());
-        return -1;
-    }
 
-    dlerror();    /* Clear any existing error */
-    api.GetPluginInfo = (GetPluginInfoPtr) dlsym(hLib, "GetPluginInfo");
-    api.Initialize = (InitializePtr) dlsym(hLib, "Initialize");
-    api.InitializeCL = (InitializeCLPtr) dlsym(hLib,"InitializeCL");
-    api.SetParams = (SetParamsPtr) dlsym(hLib, "SetParams");
-    api.SetInBufSize = (SetInBufSizePtr) dlsym(hLib, "SetInBufSize");
-    api.Prepare = (PreparePtr) dlsym(hLib, "Prepare");
-    api.GetOutBufSize = (GetOutBufSizePtr) dlsym(hLib, "GetOutBufSize");
-    api.ProcessCLIO = (ProcessCLIOPtr) dlsym(hLib, "ProcessCLIO");
-    api.ProcessMemIO = (ProcessMemIOPtr) dlsym(hLib, "ProcessMemIO");
-    api.Cleanup = (CleanupPtr) dlsym(hLib, "Cleanup");
-
-    if (   api.GetPluginInfo == NULL
-        || api.Initialize == NULL
-        || api.InitializeCL == NULL
-        || api.SetParams == NULL
-        || api.SetInBufSize == NULL
-        || api.Prepare == NULL
-        || api.GetOutBufSize == NULL
-        || api.ProcessCLIO == NULL
-        || api.ProcessMemIO == NULL
-        || api.Cleanup == NULL )
-    { // If a pointer is equal to NULL
-        printf(" One or more functions from the API were not found \n");
-        return -1;
+/// <summary> Find the optional handle-based API in the loaded DLL.
+/// Leaves all pointers as NULL if any of the required ones is missing.
+/// </summary>
+void LoadInstApi()
+{
+    PluginInstApi& inst = plugin.inst;
+    inst.CreateInstance = (CreateInstancePtr) FindSymbol("CreateInstance");
+    inst.DestroyInstance = (DestroyInstancePtr) FindSymbol("DestroyInstance");
+    inst.InitializeCL = (InitializeCLInstPtr) FindSymbol("InitializeCLInst");
+    inst.Initialize = (InitializeInstPtr) FindSymbol("InitializeInst");
+    inst.Cleanup = (CleanupInstPtr) FindSymbol("CleanupInst");
+    inst.SetParams = (SetParamsInstPtr) FindSymbol("SetParamsInst");
+    inst.SetInBufSize = (SetInBufSizeInstPtr) FindSymbol("SetInBufSizeInst");
+    inst.Prepare = (PrepareInstPtr) FindSymbol("PrepareInst");
+    inst.GetOutBufSize = (GetOutBufSizeInstPtr) FindSymbol("GetOutBufSizeInst");
+    inst.ProcessCLIO = (ProcessCLIOInstPtr) FindSymbol("ProcessCLIOInst");
+    inst.ProcessMemIO = (ProcessMemIOInstPtr) FindSymbol("ProcessMemIOInst");
+    inst.ProcessCLIOBatch = (ProcessCLIOBatchInstPtr) FindSymbol("ProcessCLIOBatchInst");
+    inst.GetScratchRequirements = (GetScratchRequirementsInstPtr) FindSymbol("GetScratchRequirementsInst");
+    inst.SetScratchBuffer = (SetScratchBufferInstPtr) FindSymbol("SetScratchBufferInst");
+
+    if (   inst.CreateInstance == NULL
+        || inst.DestroyInstance == NULL
+        || inst.InitializeCL == NULL
+        || inst.Initialize == NULL
+        || inst.Cleanup == NULL
+        || inst.SetParams == NULL
+        || inst.SetInBufSize == NULL
+        || inst.Prepare == NULL
+        || inst.GetOutBufSize == NULL
+        || inst.ProcessCLIO == NULL
+        || inst.ProcessMemIO == NULL )
+    {
+        plugin.inst = PluginInstApi();
     }
-    return 0;
 }
-#endif
 
 /// <summary> Check for Error and print out error code detail </summary>
 void checkError(int err, char *detail){
@@ -118,8 +137,8 @@ void checkError(int err, char *detail){
 	}
 }
 
-/// <summary> New Load Data file, single file to single memory block </summary>
-int load_data_file(short* data, const char *filename){
+/// <summary> New Load Data file, single file to single memory block of datalen bytes </summary>
+int load_data_file(short* data, size_t datalen, const char *filename){
 	// Load simulated data from file
 	size_t datasize;
 	FILE *ptr_myfile=fopen(filename,"rb");
@@ -127,6 +146,11 @@ int load_data_file(short* data, const char *filename){
 	fseek(ptr_myfile, 0, SEEK_END);
 	datasize = ftell(ptr_myfile)/sizeof(short);
 	rewind(ptr_myfile);
+	if(datasize*sizeof(short) != datalen){
+		fclose(ptr_myfile);
+		printf("File is not one frame!");
+		return -2;
+	}
 	size_t count1 = fread(data,sizeof(short),datasize,ptr_myfile);
 	fclose(ptr_myfile);
 	if(count1 != datasize){
@@ -137,16 +161,56 @@ int load_data_file(short* data, const char *filename){
 	return 0;
 }
 
-/// <summary> New Save OpenCL result to one file</summary>
-int save_data_file(unsigned char* outZ, unsigned char* outX, size_t estimates, const char *filename){
-	size_t count1;
-	FILE *ptr_myfile=fopen(filename,"wb");
-	if (!ptr_myfile){ printf("Unable to open file!"); return -1; }
-	count1 = fwrite(outZ, sizeof(unsigned char), estimates, ptr_myfile);
-	count1 = fwrite(outX, sizeof(unsigned char), estimates, ptr_myfile);
-	fclose(ptr_myfile);
-	if(count1 != estimates){printf("Size mismatch!"); printf("count1 = %d, estimates = %d\n",count1,estimates); return -2; }
-	return 0;
+/// <summary> One frame in flight, with its own host memory, device buffers and events </summary>
+typedef struct FrameSlot{
+	int frame;                // Number of the frame in the slot, 0 if empty
+	short* data;              // Input, must not change until evWrite is complete
+	int zerocopy;             // inbuf[0] wraps the frame in the mapped recording, and is released with the frame
+	unsigned char* resultsZ;
+	unsigned char* resultsX;
+	cl_mem inbuf[1];
+	cl_mem outbuf[2];
+	cl_event evWrite;         // Input written to the device, passed to the DLL
+	cl_event evDLL;           // Returned by the DLL, and is used as a "done" flag
+	cl_event evRead[2];       // Results copied back to the host
+} FrameSlot;
+
+/// <summary> Waits for the frame in a slot, queues its results in the output stream and empties the slot </summary>
+int finish_frame(FrameSlot* slot, OutputStream* stream){
+	cl_event events[3] = { slot->evRead[0], slot->evRead[1], slot->evWrite };
+	int err = clWaitForEvents(slot->evWrite ? 3 : 2, events);
+	checkError(err,"Failed to wait for frame");
+	if (slot->evWrite) clReleaseEvent(slot->evWrite);
+	clReleaseEvent(slot->evDLL);
+	clReleaseEvent(slot->evRead[0]);
+	clReleaseEvent(slot->evRead[1]);
+	slot->evWrite = NULL;
+	if (slot->zerocopy) {
+		err = clReleaseMemObject(slot->inbuf[0]); checkError(err,"Failed release of mapped frame");
+		slot->inbuf[0] = NULL;
+	}
+
+	// Save the data to the stream, in the order of the outputs of the DLL
+	const void* results[2] = { slot->resultsX, slot->resultsZ };
+	err = WriteOutputFrame(stream, slot->frame, results);
+	slot->frame = 0;
+	return err;
+}
+
+/// <summary> Prints the kernel timings of the DLL, if it exports GetKernelTimings </summary>
+void print_kernel_timings()
+{
+	GetKernelTimingsPtr GetKernelTimings = (GetKernelTimingsPtr) FindSymbol("GetKernelTimings");
+	if (GetKernelTimings == NULL) {
+		printf("The DLL does not export GetKernelTimings\n");
+		return;
+	}
+	uint32_t num = 0;
+	KernelTiming* t = GetKernelTimings(&num);
+	printf("%-20s %6s %10s %10s %10s\n", "kernel [us]", "runs", "min", "mean", "p99");
+	for (uint32_t n = 0; n < num; n++) {
+		printf("%-20s %6u %10.1f %10.1f %10.1f\n", t[n].name, t[n].count, t[n].min_us, t[n].mean_us, t[n].p99_us);
+	}
 }
 
 /// <summary> Main function of The Application
@@ -161,48 +225,67 @@ int main(int argc, char *argv[])
 	const int numout = 2;
 	BuffSize outsize[numout];
 
-	// OpenCL memory needed
-	// PCL_MEM buffer input and output arrays
-	cl_mem inbuf[numin];
-	cl_mem outbuf[numout];
+	int inflight = 3;                 // Number of frames in flight, 1 processes one frame at a time
+	int profile = 0;
+	int numa = 0;
+	int zerocopy = 0;
+	const char* replayfile = NULL;    // Recording to replay
+	const char* recordfile = NULL;    // Recording to write
+	for (int a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "profile") == 0) profile = 1;
+		else if (strcmp(argv[a], "numa") == 0) numa = 1;
+		else if (strcmp(argv[a], "zerocopy") == 0) zerocopy = 1;
+		else if (strcmp(argv[a], "record") == 0 && a + 1 < argc) recordfile = argv[++a];
+		else if (argv[a][0] >= '0' && argv[a][0] <= '9') inflight = atoi(argv[a]);
+		else replayfile = argv[a];
+	}
+	if (inflight < 1 || inflight > MAX_FRAMES_IN_FLIGHT) {
+		printf("Frames in flight must be 1 to %d\n", MAX_FRAMES_IN_FLIGHT);
+		return EXIT_FAILURE;
+	}
+	if (zerocopy && replayfile == NULL) {
+		printf("zerocopy needs a recording\n");
+		return EXIT_FAILURE;
+	}
 	
     cl_device_id device_id = NULL;    // compute device id 
     cl_context context = NULL;        // compute context
     cl_command_queue commands = NULL; // compute command queue
 	
 	// Parameters for SetParams
-	float floatParams[25];
+	float floatParams[RECORDING_MAX_PARAMS];
 	uint32_t numFloatParams; 
-	int intParams[25]; 
+	int intParams[RECORDING_MAX_PARAMS]; 
 	uint32_t numIntParams; 
 	
 #ifndef __APPLE__
-    cl_platform_id platforms[2];
+    cl_platform_id platforms[MAX_PLATFORMS];
     cl_uint num_platforms;
 #endif
 	
-#ifdef WIN32
-    UNREFERENCED_PARAMETER(argc);
-#endif
-
     if (LoadDLL(dllname) != 0) {
         printf("Something is wrong with DLL. Exitting \n");
         return EXIT_FAILURE;
     }
 
-    int gpu = 1;
+    int gpu = !numa;
 	
-#if defined ( WIN32 )
-	num_platforms = 2;
+#if !defined( __APPLE__ )
+	num_platforms = 0;
 
 	// Step 01: Get platform information
-    err = clGetPlatformIDs( 2, platforms, &num_platforms);
+    err = clGetPlatformIDs( MAX_PLATFORMS, platforms, &num_platforms);
 	checkError(err,"Failed to Get Platform IDs!");
+	if (num_platforms > MAX_PLATFORMS) num_platforms = MAX_PLATFORMS;
 
-	// Step 02: Get information about the device
-    err = clGetDeviceIDs(platforms[0], gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, 1, &device_id, NULL);
+	// Step 02: Get information about the device, on the first platform that has one of the type.
+	// Linux nodes often have several, e.g. a CPU runtime next to the GPU driver
+	err = CL_DEVICE_NOT_FOUND;
+	for (cl_uint p = 0; p < num_platforms && err != CL_SUCCESS; p++) {
+		err = clGetDeviceIDs(platforms[p], gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, 1, &device_id, NULL);
+	}
 	checkError(err,"Failed to Get Device IDs!");
-#elif defined( __APPLE__ )
+#else
 
 	// Step 01/02: Get platform/device information
     err = clGetDeviceIDs(NULL, gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, 1, &device_id, NULL);
@@ -240,7 +323,10 @@ int main(int argc, char *argv[])
 	intParams[ind_lag_TO]        = 2;
 	intParams[ind_lag_acq]       = 1;
 	intParams[ind_interleave]    = 16; // 4ZZLR * (4)transmits
-	numIntParams                 = 9; //IntParamCount;
+	intParams[ind_fused]         = 1;  // single pass split + autocorrelation
+	intParams[ind_replay]        = !profile; // no events between the kernels, unless they are profiled
+	intParams[ind_storage]       = storage_short2; // intermediate buffers keep the 16-bit samples
+	numIntParams                 = 12; //IntParamCount;
 	
 	floatParams[ind_fs]	      = 7500000;
 	floatParams[ind_f0]       = 5000000;
@@ -272,47 +358,120 @@ int main(int argc, char *argv[])
 	numFloatParams            = 6; //FloatParamCount;
 	*/
 
+	// Size of input Buffer
+	insize[0].sampleType = SAMPLE_FORMAT_INT16X2;
+	insize[0].width      = intParams[ind_nlinesamples]*4*intParams[ind_nlines]*intParams[ind_emissions]; // 4 = 4CCLR
+	insize[0].height     = 1;
+	insize[0].depth      = 1;
+
+	insize[0].widthLen  = insize[0].width  * sizeof(short)*2;
+	insize[0].heightLen = insize[0].height * insize[0].widthLen;
+	insize[0].depthLen  = insize[0].depth  * insize[0].heightLen;
+
+	if (recordfile != NULL) {
+		// Pack the frames and the parameters above into one recording
+		char names[NUM_LIVE_FILES][32];
+		const char* files[NUM_LIVE_FILES];
+		for(int f=0;f<NUM_LIVE_FILES;f++){
+			sprintf(names[f],"FromLive_%02d.bin",f+1);
+			files[f] = names[f];
+		}
+		err = WriteRecording(recordfile, &insize[0], floatParams, numFloatParams, intParams, numIntParams, files, NUM_LIVE_FILES);
+		checkError(err,"Failed to write the recording");
+		printf("%d frames written to %s\n", NUM_LIVE_FILES, recordfile);
+		return 0;
+	}
+
+	// The frames and the parameters of a recording replace the ones above
+	Recording rec;
+	int nframes = NUM_LIVE_FILES;
+	if (replayfile != NULL) {
+		err = OpenRecording(replayfile, &rec);
+		checkError(err,"Failed to open the recording");
+		numIntParams   = rec.header->numIntParams;
+		numFloatParams = rec.header->numFloatParams;
+		for(uint32_t n=0;n<numIntParams;n++) intParams[n] = rec.header->intParams[n];
+		memcpy(floatParams, rec.header->floatParams, numFloatParams*sizeof(float));
+		RecordingFrameSize(&rec, &insize[0]);
+		nframes = (int)rec.header->numFrames;
+	}
+
+	// Step 02b: With numa, one sub-device per NUMA node of the CPU, each with its memory close by.
+	// The whole CPU is used if it cannot be partitioned
+	cl_device_id devices[MAX_SUB_DEVICES];
+	cl_uint num_devices = 1;
+	cl_uint num_sub_devices = 0;
+	devices[0] = device_id;
+	if (numa) {
+#ifdef CL_VERSION_1_2
+		const cl_device_partition_property numa_props[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+		if (clCreateSubDevices(device_id, numa_props, MAX_SUB_DEVICES, devices, &num_sub_devices) == CL_SUCCESS && num_sub_devices > 0) {
+			num_devices = num_sub_devices;
+			device_id = devices[0];
+		} else {
+			num_sub_devices = 0;
+			devices[0] = device_id;
+		}
+#endif
+		printf("Running on %u NUMA sub-devices\n", num_devices);
+	}
+
 	// Step 03: Create OpenCL Context
-    context = clCreateContext(NULL, 1, &device_id, NULL, NULL, &err);
+    context = clCreateContext(NULL, num_devices, devices, NULL, NULL, &err);
 	checkError(err,"Failed to create a compute context!");
 	
     // Step 04: Create Command Queue
-    commands = clCreateCommandQueue(context, device_id, 0, &err);
+    commands = clCreateCommandQueue(context, device_id, profile ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
 	checkError(err,"Failed to create a command queue!");
 
 	// Step 06: Read kernel file
 	// PluginInfo tells us also if DLL uses OpenCL. We assume it does
-    api.GetPluginInfo( &pluginInfo );   
+    plugin.api.GetPluginInfo( &pluginInfo );   
+	// Use an instance of its own if the DLL has the handle-based API
+	LoadInstApi();
+	plugin.handle = (plugin.inst.CreateInstance != NULL) ? plugin.inst.CreateInstance() : NULL;
+	if (plugin.inst.CreateInstance != NULL && plugin.handle == NULL) checkError(-1,"Failed to create plugin instance");
 	// Define path to kernel source code file
+#ifdef WIN32
 	char clKernelFilePath[] = ".\\plugins";
+#else
+	char clKernelFilePath[] = "./plugins";
+#endif
 	
 	// Step 07: Create Kernel program from the source
-	err = api.InitializeCL(context, device_id, clKernelFilePath);
+	err = PluginInitializeCL(&plugin, context, device_id, clKernelFilePath);
 	checkError(err,"Failed initialization of CL");
 
     // Set the parameter arrays and numbers
-	err |= api.SetParams(floatParams, numFloatParams, intParams, numIntParams);
+	err |= PluginSetParams(&plugin, floatParams, numFloatParams, intParams, numIntParams);
 
 	int i;
 	for(i=0;i<numin;i++){
-		// Size of input Buffer
-		insize[i].sampleType = SAMPLE_FORMAT_INT16X2;
-		insize[i].width      = intParams[ind_nlinesamples]*4*intParams[ind_nlines]*intParams[ind_emissions]; // 4 = 4CCLR
-		insize[i].height     = 1;
-		insize[i].depth      = 1;
-
-		insize[i].widthLen  = insize[i].width  * sizeof(short)*2;
-		insize[i].heightLen = insize[i].height * insize[i].widthLen;
-		insize[i].depthLen  = insize[i].depth  * insize[i].heightLen;
-		err |= api.SetInBufSize(&insize[i], i);
+		err |= PluginSetInBufSize(&plugin, &insize[i], i);
 		checkError(err,"Failed to Set Input Buffer Size");
 	}
 
-	err |= api.Prepare();
+	// Intermediate buffers of the DLL in an arena of ours, if it can use one
+	plugin.api.GetScratchRequirements = (GetScratchRequirementsPtr) FindSymbol("GetScratchRequirements");
+	plugin.api.SetScratchBuffer = (SetScratchBufferPtr) FindSymbol("SetScratchBuffer");
+	cl_mem scratch = NULL;
+	if (PluginHasScratch(&plugin)) {
+		ScratchRequirements req;
+		err = PluginGetScratchRequirements(&plugin, &req);
+		checkError(err,"Failed to get the scratch requirements");
+		if (req.size > 0) {
+			scratch = clCreateBuffer(context, CL_MEM_READ_WRITE, req.size, NULL, &err);
+			checkError(err,"Failed to allocate the scratch buffer");
+			err = PluginSetScratchBuffer(&plugin, scratch, 0, req.size);
+			checkError(err,"Failed to set the scratch buffer");
+		}
+	}
+
+	err |= PluginPrepare(&plugin);
 
 	for(i=0;i<numout;i++){
 		// Size of output Buffer
-		err |= api.GetOutBufSize(&outsize[i], i);
+		err |= PluginGetOutBufSize(&plugin, &outsize[i], i);
 		// allocate buffer in host
 	}
 	checkError(err,"Failed CL preparation");
@@ -320,62 +479,117 @@ int main(int argc, char *argv[])
 	if (outsize[0].depthLen != insize[0].depthLen/intParams[ind_emissions]/8/sizeof(short)*sizeof(signed char)) { 
 		printf("Output size is not what is expected !!!! \n"); exit(1); 
 	}
+	const size_t inlen  = insize[0].depthLen;
+	const size_t outlen = outsize[0].depthLen;
  	
-	// Step 05: Create memory buffer objects
-    // Create the input and output arrays in device memory for our calculation
-	inbuf[0]  = clCreateBuffer(context, CL_MEM_READ_ONLY, 8*DATA_SIZE_IN *sizeof(short),       NULL, &err); checkError(err,"Create buffer failed1");
-	outbuf[0] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,  DATA_SIZE_OUT*sizeof(unsigned char), NULL, &err); checkError(err,"Create buffer failed3");
-	outbuf[1] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,  DATA_SIZE_OUT*sizeof(unsigned char), NULL, &err); checkError(err,"Create buffer failed4");
-
-	// Step 05: Create user event objects
-	cl_event evHost1 = clCreateUserEvent(context, NULL);    // TheApplication uses these events to enqueue operations
-	cl_event evDLL   = clCreateUserEvent(context, NULL);    // This event is returned by the DLL, and is used as a "done" flag
-	
-	int j;
-	for(j=1;j<=13;j++){
-
-	// Step 05: Load the data from file
-	char  filename[16];
-	sprintf(filename,"FromLive_%02d.bin",j);
-	printf("%s\n",filename);
-
-	err = load_data_file(data,filename);
-	checkError(err,"load data file failed");
-
-	// Step 05: Enqueue writing to the memory buffer
-	err = clEnqueueWriteBuffer(commands, inbuf[0], CL_FALSE, 0, 8*DATA_SIZE_IN*sizeof(short), data, 0, NULL, &evHost1); checkError(err,"Failed to write to source memory 1!");
+	// Ring of frames in flight. Writes, processing and readbacks go to separate in-order
+	// queues, so the transfers of one frame overlap the processing of its neighbours
+	// while the host reads the next file and writes the results of an earlier one.
+	cl_command_queue writeQueue = clCreateCommandQueue(context, device_id, 0, &err); checkError(err,"Failed to create a write queue!");
+	cl_command_queue readQueue  = clCreateCommandQueue(context, device_id, 0, &err); checkError(err,"Failed to create a read queue!");
+
+	FrameSlot slots[MAX_FRAMES_IN_FLIGHT];
+	memset(slots, 0, sizeof(slots));
+	for(i=0;i<inflight;i++){
+		// Step 05: Create memory buffer objects
+		// Create the input and output arrays in device memory for our calculation
+		// A recording is read straight from the mapped file, and with zerocopy the input buffer is made per frame
+		slots[i].zerocopy = zerocopy;
+		slots[i].data     = (replayfile == NULL) ? (short*) malloc(inlen) : NULL;
+		slots[i].resultsZ = (unsigned char*) malloc(outlen*sizeof(unsigned char));
+		slots[i].resultsX = (unsigned char*) malloc(outlen*sizeof(unsigned char));
+		if ((replayfile == NULL && !slots[i].data) || !slots[i].resultsZ || !slots[i].resultsX) checkError(-1,"Failed to allocate host memory");
+		if (!zerocopy) {
+			slots[i].inbuf[0]  = clCreateBuffer(context, CL_MEM_READ_ONLY, inlen, NULL, &err); checkError(err,"Create buffer failed1");
+		}
+		slots[i].outbuf[0] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,  outlen*sizeof(unsigned char), NULL, &err); checkError(err,"Create buffer failed3");
+		slots[i].outbuf[1] = clCreateBuffer(context, CL_MEM_WRITE_ONLY,  outlen*sizeof(unsigned char), NULL, &err); checkError(err,"Create buffer failed4");
+	}
 
-	// Step 10: Set OpenCL kernel argument
-	// Step 11: Execute OpenCL kernel in data parallel
-	err = api.ProcessCLIO(inbuf, numin, outbuf, numout, commands, evHost1, &evDLL);
-	checkError(err,"Failed process CL I/O");
-	
-	// Step 12: Read (Transfer result) from the memory buffer
-	err = clEnqueueReadBuffer(commands, outbuf[0], CL_TRUE, 0, DATA_SIZE_OUT*sizeof(unsigned char), resultsX, 1, &evDLL, NULL); checkError(err,"Failed to read output array x!");
-	err = clEnqueueReadBuffer(commands, outbuf[1], CL_TRUE, 0, DATA_SIZE_OUT*sizeof(unsigned char), resultsZ, 1, &evDLL, NULL); checkError(err,"Failed to read output array z!");
-	
-	//printf("Save the data to files!\n"); // Save the data to files!
-	// Step 05: Load the data from file
-	char  fileresults[16];
-	sprintf(fileresults,"results_%02d.bin",j);
-	printf("%s\n",fileresults);
-	err = save_data_file(resultsZ,resultsX,DATA_SIZE_OUT, fileresults ); checkError(err,"save data file failed");
+	// The results are written on a thread of the output stream, so a slow disk does not hold up the ring
+	OutputStream* stream;
+	err = OpenOutputStream(RESULTS_FILE, outsize, numout, RESULTS_QUEUE_LEN, 1, &stream);
+	checkError(err,"Failed to create the results file");
 
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int j;
+	for(j=1;j<=nframes+inflight;j++){
+		FrameSlot* slot = &slots[j % inflight];
+
+		// Step 12: Wait for the frame that had this slot and save its results
+		if (slot->frame != 0) {
+			err = finish_frame(slot, stream); checkError(err,"save data file failed");
+		}
+		if (j > nframes) continue; // draining the ring
+
+		// Step 05: Load the data from file, or take it from the recording
+		const void* frame = slot->data;
+		if (replayfile != NULL) {
+			frame = RecordingFrame(&rec, j-1);
+		} else {
+			char  filename[32];
+			sprintf(filename,"FromLive_%02d.bin",j);
+			printf("%s\n",filename);
+			err = load_data_file(slot->data,inlen,filename);
+			checkError(err,"load data file failed");
+		}
+		slot->frame = j;
+
+		// Step 05: Enqueue writing to the memory buffer
+		// The mapped pages are read from the file as the write (or with zerocopy, the kernels) touch them
+		if (zerocopy) {
+			slot->inbuf[0] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, inlen, (void*)frame, &err); checkError(err,"Failed to wrap the mapped frame!");
+			slot->evWrite = NULL;
+		} else {
+			err = clEnqueueWriteBuffer(writeQueue, slot->inbuf[0], CL_FALSE, 0, inlen, frame, 0, NULL, &slot->evWrite); checkError(err,"Failed to write to source memory 1!");
+			err = clFlush(writeQueue); checkError(err,"Failed to flush the write queue!");
+		}
+
+		// Step 10: Set OpenCL kernel argument
+		// Step 11: Execute OpenCL kernel in data parallel
+		err = PluginProcessCLIO(&plugin, slot->inbuf, numin, slot->outbuf, numout, commands, slot->evWrite, &slot->evDLL);
+		checkError(err,"Failed process CL I/O");
+		err = clFlush(commands); checkError(err,"Failed to flush the command queue!");
+
+		// Step 12: Enqueue reading (Transfer result) from the memory buffer
+		err = clEnqueueReadBuffer(readQueue, slot->outbuf[0], CL_FALSE, 0, outlen*sizeof(unsigned char), slot->resultsX, 1, &slot->evDLL, &slot->evRead[0]); checkError(err,"Failed to read output array x!");
+		err = clEnqueueReadBuffer(readQueue, slot->outbuf[1], CL_FALSE, 0, outlen*sizeof(unsigned char), slot->resultsZ, 1, &slot->evDLL, &slot->evRead[1]); checkError(err,"Failed to read output array z!");
+		err = clFlush(readQueue); checkError(err,"Failed to flush the read queue!");
 	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%d frames, %d in flight: %.3f s, %.1f frames/s\n", nframes, inflight, seconds, nframes/seconds);
+	err = CloseOutputStream(stream); checkError(err,"Failed to write the results file");
+	printf("%s\n", RESULTS_FILE);
+	if (profile) print_kernel_timings();
 
 	// Step 13: Free objects
-    api.Cleanup();
+    PluginCleanup(&plugin);
+	if (plugin.handle != NULL) plugin.inst.DestroyInstance(plugin.handle);
+	if (scratch != NULL) {
+		err = clReleaseMemObject(scratch); checkError(err,"Failed release of scratch buffer");
+	}
 
 	// Step 13: Free objects
-    err = clReleaseEvent(evHost1);checkError(err,"Failed release of Event1");
-	err = clReleaseEvent(evDLL);checkError(err,"Failed release of Event2");
-	err = clReleaseContext(context);checkError(err,"Failed release of context");
-	err = clReleaseMemObject(inbuf[0]); checkError(err,"Failed release of memory1");
-	err = clReleaseMemObject(outbuf[0]); checkError(err,"Failed release of memory2");
-	err = clReleaseMemObject(outbuf[1]); checkError(err,"Failed release of memory3");
-	err = clReleaseEvent(evHost1); checkError(err,"Failed release of event1");
-	err = clReleaseEvent(evDLL);   checkError(err,"Failed release of eventDLL");
+	for(i=0;i<inflight;i++){
+		if (slots[i].inbuf[0] != NULL) {
+			err = clReleaseMemObject(slots[i].inbuf[0]); checkError(err,"Failed release of memory1");
+		}
+		err = clReleaseMemObject(slots[i].outbuf[0]); checkError(err,"Failed release of memory2");
+		err = clReleaseMemObject(slots[i].outbuf[1]); checkError(err,"Failed release of memory3");
+		free(slots[i].data);
+		free(slots[i].resultsZ);
+		free(slots[i].resultsX);
+	}
+	err = clReleaseCommandQueue(writeQueue);checkError(err,"Failed release of write queue");
+	err = clReleaseCommandQueue(readQueue);checkError(err,"Failed release of read queue");
 	err = clReleaseCommandQueue(commands);checkError(err,"Failed release of command queue");
+	err = clReleaseContext(context);checkError(err,"Failed release of context");
+#ifdef CL_VERSION_1_2
+	for(cl_uint d=0;d<num_sub_devices;d++){
+		err = clReleaseDevice(devices[d]);checkError(err,"Failed release of sub-device");
+	}
+#endif
+	if (replayfile != NULL) CloseRecording(&rec);
 
 	return 0;
 }
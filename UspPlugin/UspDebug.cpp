@@ -40,6 +40,13 @@ void DbgOclMemAppend(DbgOclMem dbgOclMem)
 }
 
 
+void DbgOclMemClear()
+{
+    if ( !g_UspDebugInitialized ) InitializeUspDebug();
+    g_DbgOclMem.clear();
+}
+
+
 void DbgMemAppend(DbgMem dbgMem)
 {
     if ( !g_UspDebugInitialized ) InitializeUspDebug();
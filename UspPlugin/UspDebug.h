@@ -68,6 +68,9 @@ PLUGIN_API DbgMem*  GetDbgMem(uint32_t* arrayLen);
 void DbgOclMemAppend(DbgOclMem dbgOclMem);
 void DbgMemAppend(DbgMem dbgMem);
 
+/** Empties the list of OpenCL buffers, before the buffers in it are released or replaced */
+void DbgOclMemClear();
+
 /** Macro definitions for appending 1, 2 and 3D OpenCL 
  * and Mem buffers to the debug list 
  */
@@ -0,0 +1,130 @@
+#pragma once
+/**\file UspDll.h
+ * Loading of plug-in DLLs, and aligned host memory, for hosts on Windows, Linux and OS X.
+ *
+ * Example:
+ *
+ *  #include "UspDll.h"
+ *
+ *  UspDllHandle lib = UspDllOpen("plugins/" USP_DLL_NAME("plugin_b"));
+ *  if (lib == NULL) {
+ *      printf("%s\n", UspDllError());
+ *  }
+ *  GetPluginInfoPtr getInfo = (GetPluginInfoPtr) UspDllSymbol(lib, "GetPluginInfo");
+ *  ...
+ *  UspDllClose(lib);
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <dlfcn.h>
+#include <limits.h>
+#endif
+
+
+/// <summary> File name of the plug-in library "name" on this platform, e.g. USP_DLL_NAME("plugin_b") </summary>
+#if defined( WIN32 )
+#define USP_DLL_NAME(name) name ".dll"
+#elif defined( __APPLE__ )
+#define USP_DLL_NAME(name) "lib" name ".dylib"
+#else
+#define USP_DLL_NAME(name) "lib" name ".so"
+#endif
+
+
+#ifdef WIN32
+typedef HMODULE UspDllHandle;
+#else
+typedef void* UspDllHandle;
+#endif
+
+
+/// <summary> Loads a DLL. Returns NULL if it cannot be loaded, see UspDllError </summary>
+static inline UspDllHandle UspDllOpen(const char* path)
+{
+#ifdef WIN32
+    return LoadLibraryA(path);
+#else
+    return dlopen(path, RTLD_LAZY);
+#endif
+}
+
+/// <summary> Address of an exported function, NULL if the DLL does not export it </summary>
+static inline void* UspDllSymbol(UspDllHandle lib, const char* name)
+{
+#ifdef WIN32
+    return (void*) GetProcAddress(lib, name);
+#else
+    return dlsym(lib, name);
+#endif
+}
+
+/// <summary> Unloads a DLL. None of its functions may be called afterwards </summary>
+static inline void UspDllClose(UspDllHandle lib)
+{
+#ifdef WIN32
+    FreeLibrary(lib);
+#else
+    dlclose(lib);
+#endif
+}
+
+/// <summary> Why the last UspDllOpen failed </summary>
+static inline const char* UspDllError(void)
+{
+#ifdef WIN32
+    static char msg[64];
+    _snprintf(msg, sizeof(msg), "LoadLibrary failed with error %lu", (unsigned long)GetLastError());
+    msg[sizeof(msg) - 1] = '\0';
+    return msg;
+#else
+    const char* msg = dlerror();
+    return (msg != NULL) ? msg : "unknown error";
+#endif
+}
+
+/// <summary> Makes a path absolute, so the DLL is not looked for on the library search path.
+/// Returns -1 if the file does not exist or full is too short, else 0.
+/// </summary>
+static inline int UspFullPath(const char* path, char* full, size_t len)
+{
+#ifdef WIN32
+    DWORD n = GetFullPathNameA(path, (DWORD)len, full, NULL);
+    return (n == 0 || n >= len) ? -1 : 0;
+#else
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) == NULL || strlen(resolved) >= len) return -1;
+    strcpy(full, resolved);
+    return 0;
+#endif
+}
+
+/// <summary> Allocates size bytes at a multiple of alignment, a power of two.
+/// Returns NULL if out of memory. Free with UspAlignedFree.
+/// </summary>
+static inline void* UspAlignedAlloc(size_t size, size_t alignment)
+{
+#ifdef WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* ptr = NULL;
+    if (alignment < sizeof(void*)) alignment = sizeof(void*);
+    return (posix_memalign(&ptr, alignment, size) == 0) ? ptr : NULL;
+#endif
+}
+
+/// <summary> Frees memory from UspAlignedAlloc </summary>
+static inline void UspAlignedFree(void* ptr)
+{
+#ifdef WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
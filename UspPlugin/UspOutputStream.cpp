@@ -0,0 +1,179 @@
+#include "UspOutputStream.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// First bytes of an output stream
+static const char stream_magic[8] = {'S','P','A','D','E','S','O','S'};
+
+
+struct OutputStream {
+    FILE* file;
+    OutputStreamHeader header;
+    std::chrono::steady_clock::time_point start;
+
+    std::vector<std::vector<char> > records;   // queueLen records of header.recordLen bytes
+    std::deque<size_t> idle;                   // Records that can be filled
+    std::deque<size_t> queued;                 // Records waiting for the writer, in order
+    std::vector<OutputIndexEntry> index;       // Written by the writer thread only
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool closing;
+    int status;                                // 0, or -1 after a failed write
+};
+
+
+static uint64_t AlignUp(uint64_t len)
+{
+    return (len + OUTPUT_ALIGN - 1) / OUTPUT_ALIGN * OUTPUT_ALIGN;
+}
+
+
+/// <summary> Body of the writer thread. Writes the queued records until the stream is closed. </summary>
+static void WriterLoop(OutputStream* s)
+{
+    uint64_t offset = s->header.dataOffset;
+    std::unique_lock<std::mutex> lock(s->mutex);
+    for (;;) {
+        s->cond.wait(lock, [s]{ return !s->queued.empty() || s->closing; });
+        if (s->queued.empty()) break;   // Closing, and everything is written
+        size_t n = s->queued.front();
+        bool ok = (s->status == 0);
+        lock.unlock();
+
+        // The file is only touched by this thread until it stops
+        const std::vector<char>& rec = s->records[n];
+        if (ok) {
+            ok = fwrite(&rec[0], 1, rec.size(), s->file) == rec.size();
+        }
+        if (ok) {
+            OutputIndexEntry e = { ((const OutputRecordHeader*)&rec[0])->frame, offset };
+            s->index.push_back(e);
+            offset += rec.size();
+        }
+
+        lock.lock();
+        s->queued.pop_front();
+        s->idle.push_back(n);
+        if (!ok) s->status = -1;
+        s->cond.notify_all();
+    }
+}
+
+
+int OpenOutputStream(const char* path, const BuffSize* sizes, uint32_t numBuffers, uint32_t queueLen, int withIndex, OutputStream** stream)
+{
+    *stream = NULL;
+    if (numBuffers < 1 || numBuffers > OUTPUT_MAX_BUFFERS || queueLen < 1) return -2;
+
+    OutputStream* s = new OutputStream();
+    memset(&s->header, 0, sizeof(s->header));
+    memcpy(s->header.magic, stream_magic, sizeof(stream_magic));
+    s->header.version = 1;
+    s->header.numBuffers = numBuffers;
+    uint64_t len = sizeof(OutputRecordHeader);
+    for (uint32_t n = 0; n < numBuffers; n++) {
+        OutputBufferDesc& d = s->header.buffers[n];
+        d.sampleType = (uint32_t)sizes[n].sampleType;
+        d.width = sizes[n].width;
+        d.height = sizes[n].height;
+        d.depth = sizes[n].depth;
+        d.widthLen = sizes[n].widthLen;
+        d.heightLen = sizes[n].heightLen;
+        d.depthLen = sizes[n].depthLen;
+        d.offset = AlignUp(len);
+        len = d.offset + d.depthLen;
+    }
+    s->header.recordLen = AlignUp(len);
+    s->header.dataOffset = AlignUp(sizeof(OutputStreamHeader));
+    s->header.indexOffset = withIndex ? 1 : 0;   // Replaced by the offset when the stream is closed
+
+    s->file = fopen(path, "wb");
+    if (!s->file) {
+        delete s;
+        return -1;
+    }
+    // The header is written again by CloseOutputStream, with the frame count
+    std::vector<char> head((size_t)s->header.dataOffset, 0);
+    OutputStreamHeader h = s->header;
+    h.indexOffset = 0;
+    memcpy(&head[0], &h, sizeof(h));
+    if (fwrite(&head[0], 1, head.size(), s->file) != head.size()) {
+        fclose(s->file);
+        remove(path);
+        delete s;
+        return -1;
+    }
+
+    s->records.resize(queueLen, std::vector<char>((size_t)s->header.recordLen, 0));
+    for (size_t n = 0; n < queueLen; n++) s->idle.push_back(n);
+    s->start = std::chrono::steady_clock::now();
+    s->closing = false;
+    s->status = 0;
+    s->writer = std::thread(WriterLoop, s);
+    *stream = s;
+    return 0;
+}
+
+
+int WriteOutputFrame(OutputStream* s, uint64_t frame, const void* const* bufs)
+{
+    size_t n;
+    {
+        std::unique_lock<std::mutex> lock(s->mutex);
+        s->cond.wait(lock, [s]{ return !s->idle.empty() || s->status != 0; });
+        if (s->status != 0) return -1;
+        n = s->idle.front();
+        s->idle.pop_front();
+    }
+
+    // The record is owned by this thread until it is queued
+    std::vector<char>& rec = s->records[n];
+    OutputRecordHeader* rh = (OutputRecordHeader*)&rec[0];
+    rh->frame = frame;
+    rh->time_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - s->start).count();
+    for (uint32_t b = 0; b < s->header.numBuffers; b++) {
+        const OutputBufferDesc& d = s->header.buffers[b];
+        memcpy(&rec[(size_t)d.offset], bufs[b], (size_t)d.depthLen);
+    }
+
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->queued.push_back(n);
+    s->cond.notify_all();
+    return 0;
+}
+
+
+int CloseOutputStream(OutputStream* s)
+{
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->closing = true;
+        s->cond.notify_all();
+    }
+    s->writer.join();
+
+    int err = s->status;
+    if (err == 0) {
+        s->header.numFrames = s->index.size();
+        if (s->header.indexOffset != 0) {
+            s->header.indexOffset = s->header.dataOffset + s->header.numFrames * s->header.recordLen;
+            size_t len = s->index.size() * sizeof(OutputIndexEntry);
+            if (len > 0 && fwrite(&s->index[0], 1, len, s->file) != len) err = -1;
+        }
+    }
+    if (err == 0 && (fseek(s->file, 0, SEEK_SET) != 0 || fwrite(&s->header, sizeof(s->header), 1, s->file) != 1)) {
+        err = -1;
+    }
+    if (fclose(s->file) != 0) err = -1;
+    delete s;
+    return err;
+}
@@ -0,0 +1,102 @@
+#pragma once
+/**\file UspOutputStream.h
+ * Append-only file of the output frames of a run, written on a thread of its own.
+ *
+ * The file starts with an OutputStreamHeader describing every output buffer
+ * as returned by GetOutBufSize. Then come the records, one per frame, all
+ * recordLen bytes long: an OutputRecordHeader followed by the output buffers
+ * at the offsets given in the header. With fixed-size records a reader can
+ * mmap the file and find frame n at dataOffset + n*recordLen.
+ *
+ * numFrames and indexOffset are filled in by CloseOutputStream. If the run
+ * stops without closing the stream they stay 0, and the number of complete
+ * records is (file length - dataOffset) / recordLen. If the stream is opened
+ * with an index, CloseOutputStream appends an OutputIndexEntry per record,
+ * so a frame can be found by its number without scanning the records.
+ *
+ * WriteOutputFrame copies the buffers into one of queueLen records and
+ * returns; the thread of the stream writes them to the file. The host only
+ * waits when all queueLen records are still waiting to be written, which
+ * bounds the memory used when the storage cannot keep up.
+ *
+ * Example (for the host application):
+ *
+ *  BuffSize sizes[2];
+ *  GetOutBufSize(&sizes[0], 0); GetOutBufSize(&sizes[1], 1);
+ *  OutputStream* stream;
+ *  if (OpenOutputStream("results.out", sizes, 2, 8, 1, &stream) != 0) -> error
+ *  for (each frame) {
+ *      const void* bufs[2] = { outX, outZ };
+ *      WriteOutputFrame(stream, frame, bufs);
+ *  }
+ *  CloseOutputStream(stream);
+ */
+
+#include "UspPlugin.h"
+
+#define OUTPUT_MAX_BUFFERS  8    ///< Most output buffers in one stream
+#define OUTPUT_ALIGN        16   ///< Alignment of the records and of the buffers in a record
+
+/** Size and place in the record of one output buffer */
+typedef struct OutputBufferDesc {
+    uint32_t sampleType;   ///< SampleType
+    uint32_t reserved;
+    uint64_t width;        ///< As in BuffSize
+    uint64_t height;
+    uint64_t depth;
+    uint64_t widthLen;
+    uint64_t heightLen;
+    uint64_t depthLen;     ///< Length of the buffer in bytes
+    uint64_t offset;       ///< Offset of the buffer from the start of the record
+} OutputBufferDesc;
+
+/** Start of an output stream file. Fixed-size fields, so the file is the same on every platform */
+typedef struct OutputStreamHeader {
+    char magic[8];         ///< "SPADESOS"
+    uint32_t version;      ///< 1
+    uint32_t numBuffers;
+    uint64_t numFrames;    ///< Number of records, 0 until the stream is closed
+    uint64_t recordLen;    ///< Length of a record, a multiple of OUTPUT_ALIGN
+    uint64_t dataOffset;   ///< Offset of the first record
+    uint64_t indexOffset;  ///< Offset of the OutputIndexEntry array, 0 if there is none
+    OutputBufferDesc buffers[OUTPUT_MAX_BUFFERS];
+} OutputStreamHeader;
+
+/** Start of every record */
+typedef struct OutputRecordHeader {
+    uint64_t frame;        ///< Number of the frame, as given to WriteOutputFrame
+    uint64_t time_us;      ///< Time of WriteOutputFrame, from OpenOutputStream
+} OutputRecordHeader;
+
+/** One entry of the index at the end of the file */
+typedef struct OutputIndexEntry {
+    uint64_t frame;
+    uint64_t offset;       ///< Offset of the record in the file
+} OutputIndexEntry;
+
+typedef struct OutputStream OutputStream;
+
+
+/// <summary> Creates the file, writes its header and starts the writer thread.
+/// Returns 0, -1 if the file cannot be created, -2 if numBuffers or queueLen is out of range.
+/// @param path File name, an existing file is replaced
+/// @param sizes Size of each output buffer, from GetOutBufSize
+/// @param numBuffers Number of output buffers, 1 to OUTPUT_MAX_BUFFERS
+/// @param queueLen Number of frames that can wait to be written, at least 1
+/// @param withIndex Non-zero to append an index when the stream is closed
+/// @param stream OUTPUT the stream, to be closed with CloseOutputStream
+/// </summary>
+int OpenOutputStream(const char* path, const BuffSize* sizes, uint32_t numBuffers, uint32_t queueLen, int withIndex, OutputStream** stream);
+
+/// <summary> Queues one frame to be written. The buffers are copied, and can be reused when the call returns.
+/// Waits only if queueLen frames are already waiting.
+/// Returns 0, or -1 if writing an earlier frame has failed; the frame is then dropped.
+/// @param frame Number of the frame, stored in the record
+/// @param bufs One pointer per output buffer, each with the depthLen bytes given to OpenOutputStream
+/// </summary>
+int WriteOutputFrame(OutputStream* stream, uint64_t frame, const void* const* bufs);
+
+/// <summary> Writes the frames still in the queue, the index and the frame count, and frees the stream.
+/// Returns 0, or -1 if any write has failed.
+/// </summary>
+int CloseOutputStream(OutputStream* stream);
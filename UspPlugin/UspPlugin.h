@@ -53,6 +53,47 @@
  *   Cleanup()
  *
  *   - Unload DLL from memory
+ *
+ *  A DLL may also export ProcessCLIOBatch, which processes K frames packed
+ *  one after the other in each buffer. It is optional, hosts must check that
+ *  the symbol exists and fall back to ProcessCLIO for every frame. A DLL may
+ *  set its buffers up for one batch size at a time, so a host should not
+ *  alternate between ProcessCLIO and ProcessCLIOBatch (or batch sizes) on the
+ *  same instance.
+ *
+ *  An OpenCL DLL may also export GetScratchRequirements and SetScratchBuffer
+ *  (both or neither). After SetParams and SetInBufSize the host asks how much
+ *  device memory the intermediate buffers need, and hands the DLL a region of
+ *  a buffer it owns before calling Prepare:
+ *
+ *    ScratchRequirements req;
+ *    GetScratchRequirements(&req);
+ *    arena = clCreateBuffer(ctx, CL_MEM_READ_WRITE, req.size, ...)  // or keep the last one if large enough
+ *    SetScratchBuffer(arena, 0, req.size);
+ *    Prepare()
+ *
+ *  The DLL creates its intermediate buffers with clCreateSubBuffer in the
+ *  region, so a new Prepare (another imaging mode) allocates nothing as long
+ *  as the region is large enough. The region must not be used by the host or
+ *  given to another DLL while the DLL has it. Without SetScratchBuffer, or if
+ *  the region is too small (e.g. for ProcessCLIOBatch), the DLL allocates an
+ *  arena of its own, which it also keeps from one Prepare to the next.
+ *
+ *  The context given to InitializeCL may hold more devices than id, e.g.
+ *  several GPUs or the NUMA nodes of a CPU made sub-devices with
+ *  clCreateSubDevices. A DLL may then spread the work of a frame across
+ *  them, on queues of its own; the commands of ProcessCLIO still start
+ *  after inEv and outEv still completes with the whole frame, so the host
+ *  does not notice. id is the device of the host's queue.
+ *
+ *  The functions above share one set of state per loaded DLL. A DLL may also
+ *  export a handle-based variant, where CreateInstance returns an opaque
+ *  PluginHandle and every other function takes it as its first argument and
+ *  has the suffix Inst (InitializeCLInst, PrepareInst, ProcessCLIOInst, ...).
+ *  Each instance holds its own parameters, kernels and buffers, so one host
+ *  can run several independent pipelines through the same DLL. The variant is
+ *  optional as a whole: hosts look for CreateInstance and otherwise use the
+ *  plain functions. The Plugin* helpers below pick the right one.
  */
 
 #ifdef __cplusplus
@@ -70,7 +111,7 @@
 #define PLUGIN_API extern "C" __declspec(dllimport)
 #endif
 
-#elif defined( __APPLE__ )
+#else   // OS X and Linux
 
 #ifdef USP_PLUGIN_DLL
 #define PLUGIN_API EXTERNC __attribute__((visibility("default")))
@@ -78,6 +119,11 @@
 #define PLUGIN_API EXTERNC
 #endif
 
+// The calling convention only exists on Windows, everywhere else there is one
+#ifndef __cdecl
+#define __cdecl
+#endif
+
 #endif
 
 
@@ -133,6 +179,17 @@ typedef struct BuffSize{
 } BuffSize;
 
 
+/// <summary> Opaque state of one plug-in instance, see CreateInstance </summary>
+typedef struct PluginInstance* PluginHandle;
+
+
+/// <summary> Device memory needed by the intermediate buffers of a DLL, see GetScratchRequirements </summary>
+typedef struct ScratchRequirements{
+    size_t size;       ///< Bytes needed to process one frame with the current parameters
+    size_t alignment;  ///< The region given to SetScratchBuffer must start at a multiple of this, in bytes
+} ScratchRequirements;
+
+
 #ifdef USP_PLUGIN_DLL
 /* Forward declaration of functions that must be exported by the DLL */
 
@@ -147,6 +204,28 @@ PLUGIN_API int __cdecl GetOutBufSize(BuffSize* buf, int bufnum);
 PLUGIN_API int __cdecl ProcessCLIO(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
 PLUGIN_API int __cdecl ProcessMemIO(void* inbuf[], size_t numin, void* outbuf[], size_t numout);
 
+/* Optional exports */
+PLUGIN_API int __cdecl ProcessCLIOBatch(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
+PLUGIN_API int __cdecl GetScratchRequirements(ScratchRequirements* req);
+PLUGIN_API int __cdecl SetScratchBuffer(cl_mem arena, size_t offset, size_t size);
+
+/* Optional handle-based variant, either all or none of these are exported
+   (ProcessCLIOBatchInst, GetScratchRequirementsInst and SetScratchBufferInst only if the plain functions are) */
+PLUGIN_API PluginHandle __cdecl CreateInstance(void);
+PLUGIN_API void __cdecl DestroyInstance(PluginHandle inst);
+PLUGIN_API int __cdecl InitializeCLInst(PluginHandle inst, cl_context ctx, cl_device_id id, char* path_to_dll );
+PLUGIN_API int __cdecl InitializeInst(PluginHandle inst, char* path_to_dll );
+PLUGIN_API int __cdecl CleanupInst(PluginHandle inst);
+PLUGIN_API int __cdecl SetParamsInst(PluginHandle inst, float* pfp, size_t nfp, int* pip, size_t nip);
+PLUGIN_API int __cdecl SetInBufSizeInst(PluginHandle inst, BuffSize* buf, int bufnum);
+PLUGIN_API int __cdecl PrepareInst(PluginHandle inst);
+PLUGIN_API int __cdecl GetOutBufSizeInst(PluginHandle inst, BuffSize* buf, int bufnum);
+PLUGIN_API int __cdecl ProcessCLIOInst(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
+PLUGIN_API int __cdecl ProcessMemIOInst(PluginHandle inst, void* inbuf[], size_t numin, void* outbuf[], size_t numout);
+PLUGIN_API int __cdecl ProcessCLIOBatchInst(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
+PLUGIN_API int __cdecl GetScratchRequirementsInst(PluginHandle inst, ScratchRequirements* req);
+PLUGIN_API int __cdecl SetScratchBufferInst(PluginHandle inst, cl_mem arena, size_t offset, size_t size);
+
 #else
 
 typedef  void  (__cdecl *GetPluginInfoPtr)(PluginInfo* info);
@@ -159,6 +238,9 @@ typedef  int  (*PreparePtr)(void);
 typedef  int  (*GetOutBufSizePtr)(BuffSize* buf, int bufnum);
 typedef  int  (*ProcessCLIOPtr)(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
 typedef  int  (*ProcessMemIOPtr)(void* inbuf[], size_t numin, void* outbuf[], size_t numout);
+typedef  int  (*ProcessCLIOBatchPtr)(cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
+typedef  int  (*GetScratchRequirementsPtr)(ScratchRequirements* req);
+typedef  int  (*SetScratchBufferPtr)(cl_mem arena, size_t offset, size_t size);
 
 /// <summary>  Structure that encapsulates the API. </summary>
 typedef struct PluginApi
@@ -173,6 +255,134 @@ typedef struct PluginApi
     GetOutBufSizePtr GetOutBufSize;  ///< Get output buffer size 
     ProcessCLIOPtr ProcessCLIO;      ///< Do processing on OpenCL inputs/outputs
     ProcessMemIOPtr ProcessMemIO;    ///< Do processing on pure memory objects
+    ProcessCLIOBatchPtr ProcessCLIOBatch; ///< Optional, NULL if not exported. Process nframes packed frames
+    GetScratchRequirementsPtr GetScratchRequirements; ///< Optional, NULL if not exported. Size of the scratch arena
+    SetScratchBufferPtr SetScratchBuffer;             ///< Optional, NULL if not exported. Region the DLL keeps its intermediate buffers in
 } PluginApi;
 
+
+typedef  PluginHandle  (*CreateInstancePtr)(void);
+typedef  void  (*DestroyInstancePtr)(PluginHandle inst);
+typedef  int  (*InitializeCLInstPtr)(PluginHandle inst, cl_context ctx, cl_device_id id, const char* path_to_dll );
+typedef  int  (*InitializeInstPtr)(PluginHandle inst, const char* path_to_dll );
+typedef  int  (*CleanupInstPtr)(PluginHandle inst);
+typedef  int  (*SetParamsInstPtr)(PluginHandle inst, float* pfp, size_t nfp, int* pip, size_t nip);
+typedef  int  (*SetInBufSizeInstPtr)(PluginHandle inst, BuffSize* buf, int bufnum);
+typedef  int  (*PrepareInstPtr)(PluginHandle inst);
+typedef  int  (*GetOutBufSizeInstPtr)(PluginHandle inst, BuffSize* buf, int bufnum);
+typedef  int  (*ProcessCLIOInstPtr)(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
+typedef  int  (*ProcessMemIOInstPtr)(PluginHandle inst, void* inbuf[], size_t numin, void* outbuf[], size_t numout);
+typedef  int  (*ProcessCLIOBatchInstPtr)(PluginHandle inst, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv);
+typedef  int  (*GetScratchRequirementsInstPtr)(PluginHandle inst, ScratchRequirements* req);
+typedef  int  (*SetScratchBufferInstPtr)(PluginHandle inst, cl_mem arena, size_t offset, size_t size);
+
+/// <summary>  Structure that encapsulates the handle-based API.
+/// All members are NULL if the DLL does not export it.
+/// </summary>
+typedef struct PluginInstApi
+{
+    CreateInstancePtr CreateInstance;     ///< Allocate the state of a new instance
+    DestroyInstancePtr DestroyInstance;   ///< Free an instance, call CleanupInst first
+    InitializeCLInstPtr InitializeCL;
+    InitializeInstPtr Initialize;
+    CleanupInstPtr Cleanup;
+    SetParamsInstPtr SetParams;
+    SetInBufSizeInstPtr SetInBufSize;
+    PrepareInstPtr Prepare;
+    GetOutBufSizeInstPtr GetOutBufSize;
+    ProcessCLIOInstPtr ProcessCLIO;
+    ProcessMemIOInstPtr ProcessMemIO;
+    ProcessCLIOBatchInstPtr ProcessCLIOBatch; ///< Optional, NULL if not exported
+    GetScratchRequirementsInstPtr GetScratchRequirements; ///< Optional, NULL if not exported
+    SetScratchBufferInstPtr SetScratchBuffer;             ///< Optional, NULL if not exported
+} PluginInstApi;
+
+
+/// <summary> A loaded plug-in as seen by the host.
+/// handle is the instance created with inst.CreateInstance, or NULL if the DLL
+/// has only the plain API. The Plugin* functions call the handle-based function
+/// when there is an instance and the plain one otherwise.
+/// </summary>
+typedef struct PluginBinding
+{
+    PluginApi api;
+    PluginInstApi inst;
+    PluginHandle handle;
+} PluginBinding;
+
+static inline int PluginInitializeCL(PluginBinding* p, cl_context ctx, cl_device_id id, const char* path_to_dll)
+{
+    return p->handle ? p->inst.InitializeCL(p->handle, ctx, id, path_to_dll) : p->api.InitializeCL(ctx, id, path_to_dll);
+}
+
+static inline int PluginInitialize(PluginBinding* p, const char* path_to_dll)
+{
+    return p->handle ? p->inst.Initialize(p->handle, path_to_dll) : p->api.Initialize(path_to_dll);
+}
+
+static inline int PluginCleanup(PluginBinding* p)
+{
+    return p->handle ? p->inst.Cleanup(p->handle) : p->api.Cleanup();
+}
+
+static inline int PluginSetParams(PluginBinding* p, float* pfp, size_t nfp, int* pip, size_t nip)
+{
+    return p->handle ? p->inst.SetParams(p->handle, pfp, nfp, pip, nip) : p->api.SetParams(pfp, nfp, pip, nip);
+}
+
+static inline int PluginSetInBufSize(PluginBinding* p, BuffSize* buf, int bufnum)
+{
+    return p->handle ? p->inst.SetInBufSize(p->handle, buf, bufnum) : p->api.SetInBufSize(buf, bufnum);
+}
+
+static inline int PluginPrepare(PluginBinding* p)
+{
+    return p->handle ? p->inst.Prepare(p->handle) : p->api.Prepare();
+}
+
+static inline int PluginGetOutBufSize(PluginBinding* p, BuffSize* buf, int bufnum)
+{
+    return p->handle ? p->inst.GetOutBufSize(p->handle, buf, bufnum) : p->api.GetOutBufSize(buf, bufnum);
+}
+
+static inline int PluginProcessCLIO(PluginBinding* p, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+    return p->handle ? p->inst.ProcessCLIO(p->handle, inbuf, numin, outbuf, numout, clqueue, inEv, outEv)
+                     : p->api.ProcessCLIO(inbuf, numin, outbuf, numout, clqueue, inEv, outEv);
+}
+
+static inline int PluginProcessMemIO(PluginBinding* p, void* inbuf[], size_t numin, void* outbuf[], size_t numout)
+{
+    return p->handle ? p->inst.ProcessMemIO(p->handle, inbuf, numin, outbuf, numout) : p->api.ProcessMemIO(inbuf, numin, outbuf, numout);
+}
+
+/// <summary> True if PluginProcessCLIOBatch can be called </summary>
+static inline int PluginHasProcessCLIOBatch(const PluginBinding* p)
+{
+    return p->handle ? (p->inst.ProcessCLIOBatch != NULL) : (p->api.ProcessCLIOBatch != NULL);
+}
+
+static inline int PluginProcessCLIOBatch(PluginBinding* p, cl_mem* inbuf, size_t numin, cl_mem* outbuf, size_t numout, size_t nframes, cl_command_queue  clqueue, cl_event inEv, cl_event* outEv)
+{
+    return p->handle ? p->inst.ProcessCLIOBatch(p->handle, inbuf, numin, outbuf, numout, nframes, clqueue, inEv, outEv)
+                     : p->api.ProcessCLIOBatch(inbuf, numin, outbuf, numout, nframes, clqueue, inEv, outEv);
+}
+
+/// <summary> True if PluginGetScratchRequirements and PluginSetScratchBuffer can be called </summary>
+static inline int PluginHasScratch(const PluginBinding* p)
+{
+    return p->handle ? (p->inst.GetScratchRequirements != NULL && p->inst.SetScratchBuffer != NULL)
+                     : (p->api.GetScratchRequirements != NULL && p->api.SetScratchBuffer != NULL);
+}
+
+static inline int PluginGetScratchRequirements(PluginBinding* p, ScratchRequirements* req)
+{
+    return p->handle ? p->inst.GetScratchRequirements(p->handle, req) : p->api.GetScratchRequirements(req);
+}
+
+static inline int PluginSetScratchBuffer(PluginBinding* p, cl_mem arena, size_t offset, size_t size)
+{
+    return p->handle ? p->inst.SetScratchBuffer(p->handle, arena, offset, size) : p->api.SetScratchBuffer(arena, offset, size);
+}
+
 #endif
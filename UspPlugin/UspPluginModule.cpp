@@ -24,15 +24,76 @@ using namespace EngineUtils::StringUtils;
 
 using namespace USP;
 
+
+/// <summary> True if the two lists of buffer sizes are equal, field by field </summary>
+static bool SameBuffSizes(const std::vector<BuffSize>& a, const std::vector<BuffSize>& b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t n = 0; n < a.size(); n++) {
+        if (   a[n].sampleType != b[n].sampleType
+            || a[n].width != b[n].width || a[n].height != b[n].height || a[n].depth != b[n].depth
+            || a[n].widthLen != b[n].widthLen || a[n].heightLen != b[n].heightLen || a[n].depthLen != b[n].depthLen) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// <summary> Cleans up and destroys the instance of a plug-in, then frees its DLL </summary>
+static void FreeDll(UspDllHandle& hDLL, PluginBinding& plugin, cl_mem& scratch, size_t& scratchSize)
+{
+    if (plugin.api.Cleanup != nullptr) {
+        PluginCleanup(&plugin);
+    }
+    if (plugin.handle != nullptr) {
+        plugin.inst.DestroyInstance(plugin.handle);
+        plugin.handle = nullptr;
+    }
+    if (scratch != NULL) {   // Released by the DLL in Cleanup, now only ours
+        clReleaseMemObject(scratch);
+        scratch = NULL;
+        scratchSize = 0;
+    }
+    if (hDLL != NULL) {
+        UspDllClose(hDLL);
+    }
+    hDLL = NULL;
+}
+
+/// <summary> True if the two paths name the same file. The OS would then return the DLL
+/// already loaded instead of loading it a second time.
+/// </summary>
+static bool SameDllFile(const std::string& a, const std::string& b)
+{
+    char fullA[512];
+    char fullB[512];
+    if (UspFullPath(a.c_str(), fullA, sizeof(fullA)) != 0 || UspFullPath(b.c_str(), fullB, sizeof(fullB)) != 0) {
+        return false;
+    }
+    return std::string(fullA) == std::string(fullB);
+}
+
 UspPluginModule::UspPluginModule(Controller* controller)
     : Module(controller, IMPLEMENTATION_TYPE_COMPUTE_GPU, 1)
 {
     this->hDLL = 0L;
+    ClearApi(this->plugin);
     this->dllName = "";
-    this->inBufs = nullptr;
+    this->nextSlot = 0;
+    this->readQueue = NULL;
     this->inClMemPtr = nullptr;
-    this->outBufs = nullptr;
     this->outClMemPtr = nullptr;
+    this->scratch = NULL;
+    this->scratchSize = 0;
+    this->prepared = false;
+    this->stopWorker = false;
+
+    this->pending.hDLL = NULL;
+    ClearApi(this->pending.plugin);
+    this->pending.scratch = NULL;
+    this->pending.scratchSize = 0;
+    this->pending.prepared = false;
+    this->loaderDone = true;
 
     this->computeEvent = GetCompute()->CreateComputeEvent();
 }
@@ -41,49 +102,170 @@ UspPluginModule::UspPluginModule(Controller* controller)
 UspPluginModule::~UspPluginModule()
 {
     
-    if (this->hDLL != NULL) {
-		api.Cleanup();
-        FreeLibrary(this->hDLL);
-    }
+    this->JoinLoader();
+    this->DiscardPending();
+    this->WaitForFrames();
+    this->StopWorker();
+    this->UnloadDll();
     this->FreeBuffs();
 }
 
 
+void UspPluginModule::UnloadDll()
+{
+    if (this->hDLL == NULL) return;
+
+    this->WaitForFrames();  // The worker may still be in ProcessMemIO
+    this->prepared = false;
+    FreeDll(this->hDLL, this->plugin, this->scratch, this->scratchSize);
+}
+
+
+
+void UspPluginModule::AllocHostBuffer(HostBuffer& buf, size_t size)
+{
+    ComputeOpenCL *ocl = static_cast<ComputeOpenCL*> (GetCompute());
+    cl_int err = CL_SUCCESS;
+
+    buf.size = size;
+    buf.ptr = nullptr;
+    buf.mem = clCreateBuffer(ocl->GetOpenCLContext(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+    if (err == CL_SUCCESS) {
+        buf.ptr = clEnqueueMapBuffer(ocl->GetOpenCLQueue(), buf.mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err);
+    }
+    if (err != CL_SUCCESS || buf.ptr == nullptr) {
+        // No pinned memory, use pageable memory as before
+        if (buf.mem != NULL) clReleaseMemObject(buf.mem);
+        buf.mem = NULL;
+        buf.ptr = UspAlignedAlloc(size, 16);
+    }
+    if (buf.ptr == nullptr) {
+        assert(false);
+        throw EngineUtils::Exception("Could not allocate memory buffer");
+    }
+}
+
+
+
+void UspPluginModule::FreeHostBuffer(HostBuffer& buf)
+{
+    if (buf.mem != NULL) {
+        ComputeOpenCL *ocl = static_cast<ComputeOpenCL*> (GetCompute());
+        clEnqueueUnmapMemObject(ocl->GetOpenCLQueue(), buf.mem, buf.ptr, 0, NULL, NULL);
+        clReleaseMemObject(buf.mem);  // Released once the unmap has finished
+        buf.mem = NULL;
+    } else {
+        UspAlignedFree(buf.ptr);
+    }
+    buf.ptr = nullptr;
+    buf.size = 0;
+}
+
+
+
+void UspPluginModule::SetScratch(PluginBinding& plugin, cl_mem& scratch, size_t& scratchSize)
+{
+    ComputeOpenCL *ocl = static_cast<ComputeOpenCL*> (GetCompute());
+    ScratchRequirements req;
+    cl_int err = PluginGetScratchRequirements(&plugin, &req);
+    if (err) {
+        assert(false);
+        throw EngineUtils::Exception("DLL GetScratchRequirements() returned an error !");
+    }
+    if (req.size == 0) return;
+
+    // The arena only grows, so switching between imaging modes allocates nothing once the largest has run
+    // No frame is in flight through plugin: InternalCalc waits for them, and a pending DLL has none
+    if (req.size > scratchSize) {
+        if (scratch != NULL) clReleaseMemObject(scratch);  // The DLL keeps its own reference until it lets go
+        scratchSize = 0;
+        scratch = clCreateBuffer(ocl->GetOpenCLContext(), CL_MEM_READ_WRITE, req.size, NULL, &err);
+        if (err != CL_SUCCESS) {
+            scratch = NULL;
+            assert(false);
+            throw EngineUtils::Exception("Could not allocate the scratch buffer of the DLL");
+        }
+        scratchSize = req.size;
+    }
+
+    err = PluginSetScratchBuffer(&plugin, scratch, 0, scratchSize);
+    if (err) {
+        assert(false);
+        throw EngineUtils::Exception("DLL SetScratchBuffer() returned an error !");
+    }
+}
+
+
 
 void UspPluginModule::AllocBuffs()
 {
+    if (this->hDLL == NULL) {   // Nothing to allocate
+        FreeBuffs();
+        return;
+    }
+
+    // Keep the buffers of the last call if they still fit. Sizes only change when the scan setup does
+    bool reuse = (this->info.InCLMem) ? (this->inClMemPtr != nullptr && this->outClMemPtr != nullptr)
+                                      : (this->slots.size() == kMemSlots
+                                         && this->slots[0].inHost.size() == (size_t)this->info.NumInBuffers
+                                         && this->slots[0].outHost.size() == (size_t)this->info.NumOutBuffers);
+    for (size_t k = 0; reuse && k < this->slots.size(); k++) {
+        for (size_t n = 0; reuse && n < this->slots[k].inHost.size(); n++) {
+            reuse = (this->slots[k].inHost[n].size == this->inBufSize[n].depthLen);
+        }
+        for (size_t n = 0; reuse && n < this->slots[k].outHost.size(); n++) {
+            reuse = (this->slots[k].outHost[n].size == this->outBufSize[n].depthLen);
+        }
+    }
+    if (reuse) return;
+
     FreeBuffs();
     
-    if (this->hDLL == NULL) return;  // Nothing to allocate
-    
     if (this->info.InCLMem){
         this->inClMemPtr = new cl_mem [this->info.NumInBuffers];
         /* The values of cl_mem will be*/
     }else{
-       this->inBufs = new void* [this->info.NumInBuffers];
-       for (int n=0; n < this->info.NumInBuffers; n++)
-       {
-           this->inBufs[n] = _aligned_malloc(this->inBufSize[n].depthLen, 16);
-           if (this->inBufs[n] == nullptr) {
-               assert(false);
-               throw EngineUtils::Exception("Could not allocate memory buffer");
-           }
-       }
+        this->slots.resize(kMemSlots);
+        for (size_t k = 0; k < this->slots.size(); k++) {
+            FrameSlot& slot = this->slots[k];
+            slot.done = NULL;
+            slot.written = NULL;
+            slot.status = 0;
+            slot.inHost.resize(this->info.NumInBuffers);
+            slot.inBufs.resize(this->info.NumInBuffers);
+            for (int n=0; n < this->info.NumInBuffers; n++)
+            {
+                this->AllocHostBuffer(slot.inHost[n], this->inBufSize[n].depthLen);
+                slot.inBufs[n] = slot.inHost[n].ptr;
+            }
+        }
     }
 
     if (this->info.OutCLMem){
         this->outClMemPtr = new cl_mem [this->info.NumOutBuffers];
         /* The values of cl_mem will be*/
     }else{
-        this->outBufs = new void* [this->info.NumOutBuffers];
-        for (int n=0; n < this->info.NumOutBuffers; n++)
-        {
-            this->outBufs[n] = _aligned_malloc(this->outBufSize[n].depthLen, 16);
-            if (this->outBufs[n] == nullptr) {
-                assert(false);
-                throw EngineUtils::Exception("Could not allocate memory buffer");
+        for (size_t k = 0; k < this->slots.size(); k++) {
+            FrameSlot& slot = this->slots[k];
+            slot.outHost.resize(this->info.NumOutBuffers);
+            slot.outBufs.resize(this->info.NumOutBuffers);
+            for (int n=0; n < this->info.NumOutBuffers; n++)
+            {
+                this->AllocHostBuffer(slot.outHost[n], this->outBufSize[n].depthLen);
+                slot.outBufs[n] = slot.outHost[n].ptr;
             }
         }
+
+        ComputeOpenCL *ocl = static_cast<ComputeOpenCL*> (GetCompute());
+        cl_int err = CL_SUCCESS;
+        this->readQueue = clCreateCommandQueue(ocl->GetOpenCLContext(), ocl->GetDeviceID(), 0, &err);
+        if (err != CL_SUCCESS) {
+            this->readQueue = NULL;
+            assert(false);
+            throw EngineUtils::Exception("Could not create command queue");
+        }
+        this->nextSlot = 0;
+        this->StartWorker();
     }
     
 }
@@ -92,6 +274,8 @@ void UspPluginModule::AllocBuffs()
 
 void UspPluginModule::FreeBuffs()
 {
+    this->WaitForFrames();
+
     if (this->inClMemPtr != nullptr) {
         delete [] this->inClMemPtr;
         this->inClMemPtr = nullptr;
@@ -102,24 +286,111 @@ void UspPluginModule::FreeBuffs()
         this->outClMemPtr = nullptr;
     }
 
-    if (this->inBufs != nullptr) {
-        for (int n = 0; n < this->info.NumInBuffers; n++) {
-            _aligned_free(this->inBufs[n]);
-            this->inBufs[n] = nullptr;
+    for (size_t k = 0; k < this->slots.size(); k++) {
+        FrameSlot& slot = this->slots[k];
+        for (size_t n = 0; n < slot.inHost.size(); n++) {
+            this->FreeHostBuffer(slot.inHost[n]);
+        }
+        for (size_t n = 0; n < slot.outHost.size(); n++) {
+            this->FreeHostBuffer(slot.outHost[n]);
         }
-        delete [] this->inBufs;
-        this->inBufs = nullptr;
     }
+    this->slots.clear();
 
-    if (this->outBufs != nullptr) {
-        for (int n = 0; n < this->info.NumOutBuffers; n++) {
-            _aligned_free(this->outBufs[n]);
-            this->outBufs[n] = nullptr;
-        }
-        delete [] this->outBufs;
-        this->outBufs = 0;
+    if (this->readQueue != NULL) {
+        clReleaseCommandQueue(this->readQueue);
+        this->readQueue = NULL;
+    }
+
+}
+
+
+
+int UspPluginModule::WaitForSlot(FrameSlot& slot)
+{
+    if (slot.written != NULL) {
+        clWaitForEvents(1, &slot.written);
+        clReleaseEvent(slot.written);
+        slot.written = NULL;
+    }
+    for (size_t n = 0; n < slot.readEvents.size(); n++) {   // Left over if enqueueing the frame failed
+        clReleaseEvent(slot.readEvents[n]);
+    }
+    slot.readEvents.clear();
+    if (slot.done != NULL) {
+        clReleaseEvent(slot.done);
+        slot.done = NULL;
+    }
+    std::lock_guard<std::mutex> lock(this->jobMutex);
+    int status = slot.status;
+    slot.status = 0;
+    return status;
+}
+
+
+
+void UspPluginModule::WaitForFrames()
+{
+    for (size_t k = 0; k < this->slots.size(); k++) {
+        this->WaitForSlot(this->slots[k]);
     }
+}
 
+
+
+void UspPluginModule::StartWorker()
+{
+    if (this->worker.joinable()) return;
+    this->stopWorker = false;
+    this->worker = std::thread(&UspPluginModule::WorkerLoop, this);
+}
+
+
+
+void UspPluginModule::StopWorker()
+{
+    if (!this->worker.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(this->jobMutex);
+        this->stopWorker = true;
+    }
+    this->jobCond.notify_all();
+    this->worker.join();
+}
+
+
+
+void UspPluginModule::WorkerLoop()
+{
+    for (;;) {
+        FrameSlot* slot;
+        {
+            std::unique_lock<std::mutex> lock(this->jobMutex);
+            this->jobCond.wait(lock, [this] { return this->stopWorker || !this->jobs.empty(); });
+            if (this->jobs.empty()) return;   // Stopped, and nothing left to do
+            slot = this->jobs.front();
+            this->jobs.pop_front();
+        }
+
+        cl_int err = CL_SUCCESS;
+        if (!slot->readEvents.empty()) {
+            err = clWaitForEvents((cl_uint)slot->readEvents.size(), &slot->readEvents[0]);
+        }
+        for (size_t n = 0; n < slot->readEvents.size(); n++) {
+            clReleaseEvent(slot->readEvents[n]);
+        }
+        slot->readEvents.clear();
+
+        if (err == CL_SUCCESS) {
+            err = PluginProcessMemIO(&this->plugin, &slot->inBufs[0], slot->inBufs.size(), &slot->outBufs[0], slot->outBufs.size());
+        }
+        {
+            std::lock_guard<std::mutex> lock(this->jobMutex);
+            slot->status = err;
+        }
+        // A negative status makes the writes waiting for done fail, instead of writing stale data
+        clSetUserEventStatus(slot->done, (err == CL_SUCCESS) ? CL_COMPLETE : -1);
+    }
 }
 
 
@@ -233,138 +504,335 @@ inline SampleFormatType SampleTypeToSampleFormat(SampleType smpType)
 
 
 
-void UspPluginModule::ClearApi()
+void UspPluginModule::ClearApi(PluginBinding& plugin)
 {
-    api.GetPluginInfo = nullptr;   ///< Get information about the Plugin.
-    api.InitializeCL = nullptr;    ///< Pass OpenCL context, device. Do initialization
-    api.Initialize = nullptr;      ///< Initialization for plug-ins that do not use OpenCL
-    api.Cleanup = nullptr;         ///< Release reseources
-    api.SetParams = nullptr;       ///< Set parameters. An array of floats and ints
-    api.SetInBufSize = nullptr;    ///< Specify the size of the input buffer
-    api.Prepare = nullptr;         ///< Prepare for processing
-    api.GetOutBufSize = nullptr;   ///< Get output buffer size 
-    api.ProcessCLIO = nullptr;     ///< Do processing on OpenCL inputs/outputs
-    api.ProcessMemIO = nullptr;    ///< Do processing on pure memory objects
+    plugin.api.GetPluginInfo = nullptr;   ///< Get information about the Plugin.
+    plugin.api.InitializeCL = nullptr;    ///< Pass OpenCL context, device. Do initialization
+    plugin.api.Initialize = nullptr;      ///< Initialization for plug-ins that do not use OpenCL
+    plugin.api.Cleanup = nullptr;         ///< Release reseources
+    plugin.api.SetParams = nullptr;       ///< Set parameters. An array of floats and ints
+    plugin.api.SetInBufSize = nullptr;    ///< Specify the size of the input buffer
+    plugin.api.Prepare = nullptr;         ///< Prepare for processing
+    plugin.api.GetOutBufSize = nullptr;   ///< Get output buffer size 
+    plugin.api.ProcessCLIO = nullptr;     ///< Do processing on OpenCL inputs/outputs
+    plugin.api.ProcessMemIO = nullptr;    ///< Do processing on pure memory objects
+    plugin.api.ProcessCLIOBatch = nullptr; ///< Optional batched ProcessCLIO
+    plugin.api.GetScratchRequirements = nullptr; ///< Optional scratch arena
+    plugin.api.SetScratchBuffer = nullptr;
+
+    plugin.inst = PluginInstApi();  ///< Handle-based variant, all NULL
+    plugin.handle = nullptr;
 }
 
 
-void UspPluginModule::InitApi()
+void UspPluginModule::InitApi(UspDllHandle hDLL, PluginBinding& plugin)
 {
-    if (this->hDLL == NULL) 
+    if (hDLL == NULL) 
     {
         assert(false);
         throw EngineUtils::Exception("There is no handle to module. Load module first !");
     }
 
-    api.GetPluginInfo = (GetPluginInfoPtr) GetProcAddress( hDLL, "GetPluginInfo");
-    api.Initialize = (InitializePtr) GetProcAddress( hDLL, "Initialize");
-    api.InitializeCL = (InitializeCLPtr) GetProcAddress(hDLL,"InitializeCL");
-    api.SetParams = (SetParamsPtr) GetProcAddress( hDLL, "SetParams");
-    api.SetInBufSize = (SetInBufSizePtr) GetProcAddress(hDLL, "SetInBufSize");
-    api.Prepare = (PreparePtr) GetProcAddress(hDLL, "Prepare");
-    api.GetOutBufSize = (GetOutBufSizePtr) GetProcAddress(hDLL, "GetOutBufSize");
-    api.ProcessCLIO = (ProcessCLIOPtr) GetProcAddress(hDLL, "ProcessCLIO");
-    api.ProcessMemIO = (ProcessMemIOPtr) GetProcAddress(hDLL, "ProcessMemIO");
-    api.Cleanup = (CleanupPtr) GetProcAddress(hDLL, "Cleanup");
-
-
-    if (   api.GetPluginInfo == NULL 
-        || api.Initialize == NULL
-        || api.InitializeCL == NULL
-        || api.SetParams == NULL
-        || api.SetInBufSize == NULL
-        || api.Prepare == NULL
-        || api.GetOutBufSize == NULL
-        || api.ProcessCLIO == NULL
-        || api.ProcessMemIO == NULL
-        || api.Cleanup == NULL )
+    plugin.api.GetPluginInfo = (GetPluginInfoPtr) UspDllSymbol(hDLL, "GetPluginInfo");
+    plugin.api.Initialize = (InitializePtr) UspDllSymbol(hDLL, "Initialize");
+    plugin.api.InitializeCL = (InitializeCLPtr) UspDllSymbol(hDLL, "InitializeCL");
+    plugin.api.SetParams = (SetParamsPtr) UspDllSymbol(hDLL, "SetParams");
+    plugin.api.SetInBufSize = (SetInBufSizePtr) UspDllSymbol(hDLL, "SetInBufSize");
+    plugin.api.Prepare = (PreparePtr) UspDllSymbol(hDLL, "Prepare");
+    plugin.api.GetOutBufSize = (GetOutBufSizePtr) UspDllSymbol(hDLL, "GetOutBufSize");
+    plugin.api.ProcessCLIO = (ProcessCLIOPtr) UspDllSymbol(hDLL, "ProcessCLIO");
+    plugin.api.ProcessMemIO = (ProcessMemIOPtr) UspDllSymbol(hDLL, "ProcessMemIO");
+    plugin.api.Cleanup = (CleanupPtr) UspDllSymbol(hDLL, "Cleanup");
+
+    // Optional functions, left as NULL if the DLL does not export them
+    plugin.api.ProcessCLIOBatch = (ProcessCLIOBatchPtr) UspDllSymbol(hDLL, "ProcessCLIOBatch");
+    plugin.api.GetScratchRequirements = (GetScratchRequirementsPtr) UspDllSymbol(hDLL, "GetScratchRequirements");
+    plugin.api.SetScratchBuffer = (SetScratchBufferPtr) UspDllSymbol(hDLL, "SetScratchBuffer");
+
+    if (   plugin.api.GetPluginInfo == NULL 
+        || plugin.api.Initialize == NULL
+        || plugin.api.InitializeCL == NULL
+        || plugin.api.SetParams == NULL
+        || plugin.api.SetInBufSize == NULL
+        || plugin.api.Prepare == NULL
+        || plugin.api.GetOutBufSize == NULL
+        || plugin.api.ProcessCLIO == NULL
+        || plugin.api.ProcessMemIO == NULL
+        || plugin.api.Cleanup == NULL )
     { // If a pointer is equal to NULL
-        this->ClearApi();   // All pointers to NULL !
+        ClearApi(plugin);   // All pointers to NULL !
         assert(false);
         throw EngineUtils::Exception(" One or more functions from the API were not found \n");
     }
+
+    // The handle-based variant is optional as a whole
+    PluginInstApi& inst = plugin.inst;
+    inst.CreateInstance = (CreateInstancePtr) UspDllSymbol(hDLL, "CreateInstance");
+    inst.DestroyInstance = (DestroyInstancePtr) UspDllSymbol(hDLL, "DestroyInstance");
+    inst.InitializeCL = (InitializeCLInstPtr) UspDllSymbol(hDLL, "InitializeCLInst");
+    inst.Initialize = (InitializeInstPtr) UspDllSymbol(hDLL, "InitializeInst");
+    inst.Cleanup = (CleanupInstPtr) UspDllSymbol(hDLL, "CleanupInst");
+    inst.SetParams = (SetParamsInstPtr) UspDllSymbol(hDLL, "SetParamsInst");
+    inst.SetInBufSize = (SetInBufSizeInstPtr) UspDllSymbol(hDLL, "SetInBufSizeInst");
+    inst.Prepare = (PrepareInstPtr) UspDllSymbol(hDLL, "PrepareInst");
+    inst.GetOutBufSize = (GetOutBufSizeInstPtr) UspDllSymbol(hDLL, "GetOutBufSizeInst");
+    inst.ProcessCLIO = (ProcessCLIOInstPtr) UspDllSymbol(hDLL, "ProcessCLIOInst");
+    inst.ProcessMemIO = (ProcessMemIOInstPtr) UspDllSymbol(hDLL, "ProcessMemIOInst");
+    inst.ProcessCLIOBatch = (ProcessCLIOBatchInstPtr) UspDllSymbol(hDLL, "ProcessCLIOBatchInst");
+    inst.GetScratchRequirements = (GetScratchRequirementsInstPtr) UspDllSymbol(hDLL, "GetScratchRequirementsInst");
+    inst.SetScratchBuffer = (SetScratchBufferInstPtr) UspDllSymbol(hDLL, "SetScratchBufferInst");
+
+    if (   inst.CreateInstance == NULL
+        || inst.DestroyInstance == NULL
+        || inst.InitializeCL == NULL
+        || inst.Initialize == NULL
+        || inst.Cleanup == NULL
+        || inst.SetParams == NULL
+        || inst.SetInBufSize == NULL
+        || inst.Prepare == NULL
+        || inst.GetOutBufSize == NULL
+        || inst.ProcessCLIO == NULL
+        || inst.ProcessMemIO == NULL )
+    {   // Use the plain API
+        plugin.inst = PluginInstApi();
+    }
 }
 
 
 
 
-void UspPluginModule::InternalCalc(IScanMan* scanMan)
+void UspPluginModule::LoadDll(const std::string& name, UspDllHandle& hDLL, PluginBinding& plugin, PluginInfo& info)
 {
-   // Compute *ocl = GetCompute();
     ComputeOpenCL *ocl = static_cast<ComputeOpenCL*> (GetCompute());
+    char  fullPath[512];
 
-    if (scanMan != nullptr) {
-        // In case of unit testing, iParams are filled-in by the testing class
-        CEngDataModel* dataModel = scanMan->GetEngDataModelPtr();
-        this->iParams = dataModel->GetConstUSPParams(GetAlgorithmParamIndex()).extDllPlugin;
+    if (UspFullPath(name.c_str(), fullPath, sizeof(fullPath)) != 0) {
+        throw EngineUtils::Exception("Could not find " + name);
+    }
+
+    hDLL = UspDllOpen(fullPath);
+    if (hDLL == NULL) {
+        throw EngineUtils::Exception("Could not load " + name + ": " + UspDllError());
+    }
+    
+    InitApi(hDLL, plugin);
+    if (plugin.inst.CreateInstance != nullptr) {
+        plugin.handle = plugin.inst.CreateInstance();
+        if (plugin.handle == nullptr) {
+            throw EngineUtils::Exception("Call to CreateInstance() func in DLL returned NULL !");
+        }
+    }
+    plugin.api.GetPluginInfo(&info);
+    int err;
+    if ( info.UseOpenCL ) {
+        err = PluginInitializeCL(&plugin, ocl->GetOpenCLContext(), ocl->GetDeviceID(), PathSplit(name).c_str());
+    } else {
+        err = PluginInitialize(&plugin, PathSplit(name).c_str());
+    }
+    if (err) {
+        assert(false);
+        throw EngineUtils::Exception("Call to Initialize() func in DLL returned an error !");
     }
+}
 
 
-    std::string newDllName = iParams.dllFilePath.path;
+
+void UspPluginModule::PrepareDll(PluginBinding& plugin, const PluginInfo& info, std::vector<BuffSize>& inSize, bool sizesChanged,
+                                 std::vector<float>& floatParams, std::vector<int>& intParams,
+                                 cl_mem& scratch, size_t& scratchSize, std::vector<BuffSize>& outSize)
+{
     int err = 0;
 
-    /*
-     *  If the name of the DLL has changed, then load and initialize the DLL
-     */
-    if (newDllName != this->dllName) {
-        if (this->hDLL != 0L) {
-            if ( this->api.Cleanup != nullptr) {
-                this->api.Cleanup();
+    if (sizesChanged) {
+        for (int n = 0; n < info.NumInBuffers; n++) {
+            err = PluginSetInBufSize(&plugin, &inSize[n], (int)n);
+
+            if (err){
+                assert(false);
+                std::string msg;
+                msg = std::string(__FUNCTION__) + std::string(":\n Error in SetInBufSize() ");
+                msg += std::string(" for buffer number ") + ToString<int>(n);
+                throw EngineUtils::Exception(msg);
             }
-            FreeLibrary(this->hDLL);
-            this->hDLL = 0L;
         }
+    }
 
-        this->ClearApi();
-        this->FreeBuffs();
-        
-        this->dllName = newDllName;
-        char  fullPath[512];
+    // Plug-ins keep their buffers in Prepare when only scalar parameters have changed
+    err = PluginSetParams(&plugin, floatParams.data(), floatParams.size(), 
+                         intParams.data(), intParams.size());
+
+    if (err) {
+        assert(false);
+        throw EngineUtils::Exception("DLL SetParams() returned an error !");
+    }
+
+    if (info.UseOpenCL && PluginHasScratch(&plugin)) {
+        this->SetScratch(plugin, scratch, scratchSize);
+    }
+
+    err = PluginPrepare(&plugin);
+    if (err) {
+        assert(false);
+        throw EngineUtils::Exception("DLL Prepare() returned an error !");
+    }
 
-        GetFullPathName(this->dllName.c_str(), sizeof(fullPath), fullPath, NULL); 
 
-        this->hDLL = LoadLibrary(fullPath);
-        if (this->hDLL == NULL) {
-            throw EngineUtils::Exception("Could not load " + this->dllName);
+    outSize.clear();
+    for (int n = 0; n < info.NumOutBuffers; n++) {
+        BuffSize size;
+        err = PluginGetOutBufSize(&plugin, &size, n);
+        outSize.push_back(size);
+
+        if (err) {
+            assert (false);
+            std::string msg;
+            msg = std::string(__FUNCTION__) + std::string(":\n Error in GetOutBufSize() ");
+            msg += std::string(" for buffer number ") + ToString<size_t>(n);
+            throw EngineUtils::Exception(msg);
         }
-        
-        this->InitApi();
-        api.GetPluginInfo(&this->info);
-        if ( this->info.UseOpenCL ) {
-            err = api.InitializeCL(ocl->GetOpenCLContext(), ocl->GetDeviceID(), PathSplit(this->dllName).c_str());
-        } else {
-            err = api.Initialize(PathSplit(this->dllName).c_str());
+    }
+}
+
+
+
+void UspPluginModule::StartLoader(const std::string& name, const std::vector<BuffSize>& inSize,
+                                  const std::vector<float>& floatParams, const std::vector<int>& intParams)
+{
+    if (this->pending.dllName != name) {
+        this->DiscardPending();
+        this->pending.dllName = name;
+    }
+    this->pending.inBufSize = inSize;
+    this->pending.floatParams = floatParams;
+    this->pending.intParams = intParams;
+    this->pending.prepared = false;
+    this->pending.error = nullptr;
+
+    this->loaderDone = false;
+    this->loader = std::thread(&UspPluginModule::LoaderMain, this);
+}
+
+
+
+void UspPluginModule::LoaderMain()
+{
+    // Same context as the current DLL, which is still processing frames on other threads
+    PendingDll& p = this->pending;
+    try {
+        if (p.hDLL == NULL) {
+            this->LoadDll(p.dllName, p.hDLL, p.plugin, p.info);
         }
-        if (err) {
-            assert(false);
-            throw EngineUtils::Exception("Call to Initialize() func in DLL returned an error !");
+        if (p.info.NumInBuffers != (int)p.inBufSize.size()) {
+            throw EngineUtils::Exception(std::string(__FUNCTION__) + std::string(":\n Number of input data adapters is different than specified" ));
         }
+        this->PrepareDll(p.plugin, p.info, p.inBufSize, true, p.floatParams, p.intParams, p.scratch, p.scratchSize, p.outBufSize);
+        p.prepared = true;
+    } catch (...) {
+        p.error = std::current_exception();
     }
-    
-    if ( this->info.NumInBuffers !=  (int)GetNumInputs() ) {
-        assert(false);
-       throw EngineUtils::Exception(std::string(__FUNCTION__) + std::string(":\n Number of input data adapters is different than specified" ));
+    this->loaderDone = true;
+}
+
+
+
+bool UspPluginModule::PendingReady()
+{
+    if (this->pending.dllName.empty() || !this->loaderDone) return false;
+    this->JoinLoader();   // Returns at once, the thread has finished
+    return true;
+}
+
+
+
+void UspPluginModule::JoinLoader()
+{
+    if (this->loader.joinable()) {
+        this->loader.join();
     }
+}
 
- 
 
-    inBufSize.clear();
-    outBufSize.clear();
 
+bool UspPluginModule::PendingFitsStream()
+{
+    const PluginInfo& a = this->info;
+    const PluginInfo& b = this->pending.info;
+    return this->prepared && this->pending.prepared
+        && a.NumInBuffers == b.NumInBuffers && a.NumOutBuffers == b.NumOutBuffers
+        && a.InCLMem == b.InCLMem && a.OutCLMem == b.OutCLMem
+        && SameBuffSizes(this->inBufSize, this->pending.inBufSize)
+        && this->preparedFloatParams == this->pending.floatParams
+        && this->preparedIntParams == this->pending.intParams
+        && SameBuffSizes(this->outBufSize, this->pending.outBufSize);
+}
 
-    if (err) {
-        assert(false);
-        throw EngineUtils::Exception("DLL Cleanup() returned error .");
+
+
+void UspPluginModule::SwapDll()
+{
+    const PluginInfo& a = this->info;
+    const PluginInfo& b = this->pending.info;
+    bool sameBuffs = a.NumInBuffers == b.NumInBuffers && a.NumOutBuffers == b.NumOutBuffers
+                  && a.InCLMem == b.InCLMem && a.OutCLMem == b.OutCLMem;
+
+    this->WaitForFrames();  // The worker may still be in ProcessMemIO of the old DLL
+    if (!sameBuffs) {
+        this->FreeBuffs();  // AllocBuffs in InternalCalc makes them again
     }
 
+    std::swap(this->dllName, this->pending.dllName);
+    std::swap(this->hDLL, this->pending.hDLL);
+    std::swap(this->plugin, this->pending.plugin);
+    std::swap(this->info, this->pending.info);
+    std::swap(this->scratch, this->pending.scratch);
+    std::swap(this->scratchSize, this->pending.scratchSize);
+    this->inBufSize = this->pending.inBufSize;
+    this->preparedFloatParams = this->pending.floatParams;
+    this->preparedIntParams = this->pending.intParams;
+    this->outBufSize = this->pending.outBufSize;
+    this->prepared = this->pending.prepared;
+
+    this->DiscardPending();  // Now the old DLL
+}
 
-    if ( this->info.InCLMem != this->info.OutCLMem ) {
-        assert( false );
-        throw EngineUtils::Exception("Output buffers must be same type as input buffers - either OpenCL or Memory, but not mixed !");
+
+
+void UspPluginModule::DiscardPending()
+{
+    FreeDll(this->pending.hDLL, this->pending.plugin, this->pending.scratch, this->pending.scratchSize);
+    ClearApi(this->pending.plugin);
+    this->pending.dllName.clear();
+    this->pending.inBufSize.clear();
+    this->pending.floatParams.clear();
+    this->pending.intParams.clear();
+    this->pending.outBufSize.clear();
+    this->pending.prepared = false;
+    this->pending.error = nullptr;
+}
+
+
+
+
+void UspPluginModule::InternalCalc(IScanMan* scanMan)
+{
+   // Compute *ocl = GetCompute();
+    ComputeOpenCL *ocl = static_cast<ComputeOpenCL*> (GetCompute());
+
+    if (scanMan != nullptr) {
+        // In case of unit testing, iParams are filled-in by the testing class
+        CEngDataModel* dataModel = scanMan->GetEngDataModelPtr();
+        this->iParams = dataModel->GetConstUSPParams(GetAlgorithmParamIndex()).extDllPlugin;
     }
 
 
-    for (int n = 0; n < this->info.NumInBuffers; n++) {
+    std::string newDllName = iParams.dllFilePath.path;
+
+    this->WaitForFrames();  // The worker must not be in ProcessMemIO while the plug-in is set up again
+
+    // Sizes and parameters as the DLL sees them. If they are the ones of the last Prepare, e.g. when
+    // another module of the chain has changed, the DLL is left alone and keeps its buffers
+    std::vector<BuffSize> newInSize;
+    for (int n = 0; n < (int)GetNumInputs(); n++) {
         BuffSize size;
         
         size.sampleType = SampleFormatToSampleType(GetInputDataAdapter(n)->GetDataFormat().GetSampleFormat());
@@ -376,46 +844,75 @@ void UspPluginModule::InternalCalc(IScanMan* scanMan)
         size.heightLen = GetInputDataAdapter(n)->GetDataFormat().GetPlaneSizeBytes();
         size.depthLen = GetInputDataAdapter(n)->GetDataFormat().GetFrameSizeBytes();
                 
-        this->inBufSize.push_back(size);
-        err = api.SetInBufSize(&size, (int)n);
+        newInSize.push_back(size);
+    }
+    const float* floatParams = (const float*)&iParams.floatParams[0];
+    const int* intParams = (const int*)&iParams.intParams[0];
+    std::vector<float> newFloatParams(floatParams, floatParams + iParams.numFloatParams);
+    std::vector<int> newIntParams(intParams, intParams + iParams.numIntParams);
 
-        if (err){
-            assert(false);
-            std::string msg;
-            msg = std::string(__FUNCTION__) + std::string(":\n Error in SetInBufSize() ");
-            msg += std::string(" for buffer number ") + ToString<int>(n);
-            throw EngineUtils::Exception(msg);
+    /*
+     *  A DLL loaded in the background takes over here once ready, even if its output buffers differ.
+     *  If another DLL is asked for by now, it is thrown away
+     */
+    if (!this->pending.dllName.empty()) {
+        if (this->pending.dllName != newDllName) {
+            this->JoinLoader();
+            this->DiscardPending();
+        } else if (this->PendingReady()) {
+            if (this->pending.error) {
+                std::exception_ptr error = this->pending.error;
+                this->DiscardPending();
+                std::rethrow_exception(error);
+            }
+            this->SwapDll();
         }
     }
-    
-    err = api.SetParams( (float*)&iParams.floatParams[0], (size_t)iParams.numFloatParams, 
-                         (int*)&iParams.intParams[0], (size_t)iParams.numIntParams);
 
-    if (err) {
+    /*
+     *  If the name of the DLL has changed, then load and initialize the DLL.
+     *  In place if nothing runs yet, else on the loader thread while the frames go on
+     */
+    if (newDllName != this->dllName) {
+        if (this->hDLL == NULL || SameDllFile(newDllName, this->dllName)) {
+            this->UnloadDll();
+
+            ClearApi(this->plugin);
+            this->FreeBuffs();
+            
+            this->dllName = newDllName;
+            this->LoadDll(this->dllName, this->hDLL, this->plugin, this->info);
+        } else if (this->pending.dllName.empty()) {
+            this->StartLoader(newDllName, newInSize, newFloatParams, newIntParams);
+        }
+    }
+    
+    if ( this->info.NumInBuffers !=  (int)GetNumInputs() ) {
         assert(false);
-        throw EngineUtils::Exception("DLL SetParams() returned an error !");
+       throw EngineUtils::Exception(std::string(__FUNCTION__) + std::string(":\n Number of input data adapters is different than specified" ));
     }
 
-	
-	err = api.Prepare();
-    if (err) {
-        assert(false);
-        throw EngineUtils::Exception("DLL Prepare() returned an error !");
+
+    if ( this->info.InCLMem != this->info.OutCLMem ) {
+        assert( false );
+        throw EngineUtils::Exception("Output buffers must be same type as input buffers - either OpenCL or Memory, but not mixed !");
     }
 
 
-    for (int n = 0; n < this->info.NumOutBuffers; n++) {
-        BuffSize size;
-        err = api.GetOutBufSize(&size, n);
-        this->outBufSize.push_back(size);
+    bool sizesChanged = !this->prepared || !SameBuffSizes(newInSize, this->inBufSize);
+    bool paramsChanged = !this->prepared || newFloatParams != this->preparedFloatParams || newIntParams != this->preparedIntParams;
 
-        if (err) {
-            assert (false);
-            std::string msg;
-            msg = std::string(__FUNCTION__) + std::string(":\n Error in GetOutBufSize() ");
-            msg += std::string(" for buffer number ") + ToString<size_t>(n);
-            throw EngineUtils::Exception(msg);
+    if (sizesChanged || paramsChanged) {
+        this->prepared = false;  // Until Prepare has succeeded
+        if (sizesChanged) {
+            this->inBufSize = newInSize;
         }
+        this->PrepareDll(this->plugin, this->info, this->inBufSize, sizesChanged, newFloatParams, newIntParams,
+                         this->scratch, this->scratchSize, this->outBufSize);
+
+        this->preparedFloatParams = newFloatParams;
+        this->preparedIntParams = newIntParams;
+        this->prepared = true;
     }
     
 
@@ -443,6 +940,19 @@ void UspPluginModule::InternalExecute(DataAdapter* inputDataAdapter)
     ComputeOpenCL *ocl = static_cast<ComputeOpenCL *>(GetCompute());
     ComputeEventOpenCL* computeEventOpenCL = static_cast<ComputeEventOpenCL*>(computeEvent.get());
 
+    // Between two frames: a DLL loaded in the background takes over if it fits the stream as it is.
+    // If the parameters have changed while it was loading, it is prepared again first
+    if (this->PendingReady() && !this->pending.error) {
+        if (this->prepared && this->pending.prepared
+            && (!SameBuffSizes(this->inBufSize, this->pending.inBufSize)
+                || this->preparedFloatParams != this->pending.floatParams
+                || this->preparedIntParams != this->pending.intParams)) {
+            this->StartLoader(this->pending.dllName, this->inBufSize, this->preparedFloatParams, this->preparedIntParams);
+        } else if (this->PendingFitsStream()) {
+            this->SwapDll();
+        }
+    }
+
     if (this->info.InCLMem) { 
         // Fill-in array with input buffers
         for ( int n = 0; n < this->info.NumInBuffers; n++ ) {
@@ -456,7 +966,7 @@ void UspPluginModule::InternalExecute(DataAdapter* inputDataAdapter)
             this->outClMemPtr[n] = buf->GetClMemObj();
         }
         cl_event exeEvent;  
-        this->api.ProcessCLIO(this->inClMemPtr, this->info.NumInBuffers, this->outClMemPtr, this->info.NumOutBuffers, ocl->GetOpenCLQueue(),  computeEventOpenCL->GetCLEvent(), &exeEvent);
+        PluginProcessCLIO(&this->plugin, this->inClMemPtr, this->info.NumInBuffers, this->outClMemPtr, this->info.NumOutBuffers, ocl->GetOpenCLQueue(),  computeEventOpenCL->GetCLEvent(), &exeEvent);
 
         // Change computeEvents internal event member to use the result event from the dll
         computeEventOpenCL->ReplaceCLEvent(exeEvent);
@@ -464,21 +974,57 @@ void UspPluginModule::InternalExecute(DataAdapter* inputDataAdapter)
         GetOutputDataAdapter(0)->CompleteComputeBufferWrite(computeEvent);
 		RegisterCompleteEvent(computeEvent);
     }else{
-        // Copy all input streams to arrays in memory
+        // The frame runs on the worker thread, see FrameSlot. This thread only enqueues the transfers.
+        // Wait for the slot's last frame, which also reports an error of its ProcessMemIO
+        FrameSlot& slot = this->slots[this->nextSlot];
+        this->nextSlot = (this->nextSlot + 1) % this->slots.size();
+        if (this->WaitForSlot(slot) != 0) {
+            assert(false);
+            throw EngineUtils::Exception("DLL ProcessMemIO() returned an error !");
+        }
+
+        // Copy all input streams to arrays in memory. The arrays are pinned (see HostBuffer),
+        // so the driver transfers straight into them without a staging copy
+        cl_event inEv = computeEventOpenCL->GetCLEvent();
+        cl_int err = CL_SUCCESS;
         for ( int n = 0; n < this->info.NumInBuffers; n++ ) {
-			 ocl->ReadFromBuffer(GetInputDataAdapter(n)->GetComputeBufferForRead(nullptr), 
-				                 0, 
-								 (uint) this->inBufSize[n].depthLen, 
-                                 this->inBufs[n]);
+            auto in = GetInputDataAdapter(n)->GetComputeBufferForRead(this->computeEvent);
+            cl_mem mem = static_cast<ComputeBufferOpenCL*>(in.get())->GetClMemObj();
+            cl_event readEv = NULL;
+            err = clEnqueueReadBuffer(this->readQueue, mem, CL_FALSE, 0, this->inBufSize[n].depthLen, slot.inBufs[n],
+                                      (inEv != NULL) ? 1 : 0, (inEv != NULL) ? &inEv : NULL, &readEv);
+            if (err != CL_SUCCESS) {
+                throw EngineUtils::Exception("Could not read input buffer " + ToString<int>(n));
+            }
+            slot.readEvents.push_back(readEv);
         }
-        this->api.ProcessMemIO(this->inBufs, this->info.NumInBuffers, this->outBufs, this->info.NumOutBuffers);
+        clFlush(this->readQueue);
 
+        // The outputs are written once the worker completes done
+        slot.done = clCreateUserEvent(ocl->GetOpenCLContext(), &err);
+        if (err != CL_SUCCESS) {
+            throw EngineUtils::Exception("Could not create user event");
+        }
         for ( int n = 0; n < this->info.NumOutBuffers; n++ ) {
-            ocl->WriteToBuffer(GetOutputDataAdapter(n)->GetComputeBufferForWrite(),
-                               0, 
-                               (uint) this->outBufSize[n].depthLen, 
-                               this->outBufs[n]);
+            auto out = GetOutputDataAdapter(n)->GetComputeBufferForWrite();
+            cl_mem mem = static_cast<ComputeBufferOpenCL*>(out.get())->GetClMemObj();
+            err = clEnqueueWriteBuffer(ocl->GetOpenCLQueue(), mem, CL_FALSE, 0, this->outBufSize[n].depthLen, slot.outBufs[n], 1, &slot.done, NULL);
+            if (err != CL_SUCCESS) {
+                clSetUserEventStatus(slot.done, -1);   // Do not leave the writes already enqueued waiting
+                throw EngineUtils::Exception("Could not write output buffer " + ToString<int>(n));
+            }
         }
+        clEnqueueMarker(ocl->GetOpenCLQueue(), &slot.written);
+
+        {
+            std::lock_guard<std::mutex> lock(this->jobMutex);
+            this->jobs.push_back(&slot);
+        }
+        this->jobCond.notify_one();
+
+        // Downstream modules wait for the writes, as for the event from ProcessCLIO
+        clRetainEvent(slot.written);
+        computeEventOpenCL->ReplaceCLEvent(slot.written);
 
         GetOutputDataAdapter(0)->CompleteComputeBufferWrite(computeEvent);
         RegisterCompleteEvent(computeEvent);
@@ -3,8 +3,17 @@
 #include "USP/Modules/Module.h"
 //#include "USP/Compute/OpenCL/ComputeOpenCL.h"
 #include "UspPlugin.h"
+#include "UspDll.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 TEST_CLASS_FORWARD_DECLARE(USPTests, UspPluginModuleTest)
 
@@ -21,6 +30,10 @@ namespace USP {
 ///             <li> Call the processing routine of the DLL </li>
 ///             <li> Call the cleanup() routine of the DLL and unload the DLL upon distruction</li>
 /// 		 </ul>	   
+///          When the path of the DLL changes while a DLL is running, the new one is loaded, initialized
+///          and prepared on a thread of its own, and the frames go through the old one meanwhile.
+///          It takes over between two frames if it has the output buffers of the old one, else at the
+///          next InternalCalc, where the output formats can change.
 /// 		 </summary>
 class UspPluginModule : public Module {
 public:
@@ -35,26 +48,110 @@ public:
 
 
 private:    
-    void ClearApi();    ///< Set all pointers from the api structure to NULL
-    void InitApi();     ///< Find the symbols from a loaded DLL and assign pointers to them
-    void AllocBuffs();  ///< Allocate arrays of pointers to buffers passed to the loaded DLL
+    static void ClearApi(PluginBinding& plugin);                  ///< Set all pointers from the api structure to NULL
+    static void InitApi(UspDllHandle hDLL, PluginBinding& plugin); ///< Find the symbols from a loaded DLL and assign pointers to them
+    void UnloadDll();   ///< Clean up and destroy the instance, then free the DLL
+    void LoadDll(const std::string& name, UspDllHandle& hDLL, PluginBinding& plugin, PluginInfo& info);  ///< Load the DLL, create the instance and initialize it
+    void PrepareDll(PluginBinding& plugin, const PluginInfo& info, std::vector<BuffSize>& inSize, bool sizesChanged,
+                    std::vector<float>& floatParams, std::vector<int>& intParams,
+                    cl_mem& scratch, size_t& scratchSize, std::vector<BuffSize>& outSize);  ///< SetInBufSize, SetParams and Prepare, then get the output sizes
+    void AllocBuffs();  ///< Allocate arrays of pointers to buffers passed to the loaded DLL. Keeps them if the sizes are unchanged
     void FreeBuffs();   ///< Free the allocated buffers
+
+    /// <summary> Host memory of one buffer passed to ProcessMemIO.
+    ///          Allocated as pinned memory (CL_MEM_ALLOC_HOST_PTR, mapped for as long as it lives),
+    ///          so the transfers to and from the device are DMA straight to/from it.
+    ///          Falls back to UspAlignedAlloc if the driver cannot do that.
+    /// </summary>
+    struct HostBuffer {
+        cl_mem mem;   ///< Buffer owning the pinned memory, NULL if ptr is from UspAlignedAlloc
+        void* ptr;    ///< Host address passed to ProcessMemIO
+        size_t size;  ///< Size in bytes
+    };
+    void AllocHostBuffer(HostBuffer& buf, size_t size);  ///< Allocate pinned host memory, or aligned memory if that fails
+    void FreeHostBuffer(HostBuffer& buf);                ///< Unmap and release, or free, the memory
+    void SetScratch(PluginBinding& plugin, cl_mem& scratch, size_t& scratchSize);  ///< Give the DLL a scratch arena large enough for its parameters, growing the one it has if needed
+
+    /// <summary> A DLL loaded and prepared by the loader thread while the frames go through the current one.
+    ///          The loader thread owns it until loaderDone is set, then the thread of InternalCalc and InternalExecute.
+    /// </summary>
+    struct PendingDll {
+        std::string dllName;              ///< Empty if there is none
+        UspDllHandle hDLL;
+        PluginBinding plugin;
+        PluginInfo info;
+        cl_mem scratch;
+        size_t scratchSize;
+        std::vector<BuffSize> inBufSize;  ///< Sizes and parameters it is prepared for
+        std::vector<float> floatParams;
+        std::vector<int> intParams;
+        std::vector<BuffSize> outBufSize; ///< From GetOutBufSize after Prepare
+        bool prepared;
+        std::exception_ptr error;         ///< What loading or preparing threw, if it failed
+    };
+    void StartLoader(const std::string& name, const std::vector<BuffSize>& inSize,
+                     const std::vector<float>& floatParams, const std::vector<int>& intParams);  ///< Load name, or prepare it again if loaded, on the loader thread
+    void LoaderMain();       ///< Body of the loader thread
+    bool PendingReady();     ///< True if there is a pending DLL and the loader thread is done with it
+    void JoinLoader();       ///< Wait for the loader thread, if running
+    bool PendingFitsStream();///< The pending DLL is prepared as the current one and has the same buffers, so it can take over between frames
+    void SwapDll();          ///< Make the pending DLL the current one, and unload the old one
+    void DiscardPending();   ///< Unload the pending DLL
+
+    /// <summary> One frame of the ProcessMemIO path. InternalExecute enqueues the reads of the inputs
+    ///          and the writes of the outputs, and the worker thread runs ProcessMemIO in between.
+    ///          The writes wait for the user event done, which the worker completes.
+    /// </summary>
+    struct FrameSlot {
+        std::vector<HostBuffer> inHost;   ///< Memory of the input buffers, kept from one InternalCalc to the next
+        std::vector<HostBuffer> outHost;  ///< Memory of the output buffers
+        std::vector<void*> inBufs;        ///< inHost[n].ptr, as passed to ProcessMemIO
+        std::vector<void*> outBufs;       ///< outHost[n].ptr
+        std::vector<cl_event> readEvents; ///< Reads of the inputs, waited for by the worker
+        cl_event done;                    ///< User event, completed by the worker once ProcessMemIO returns
+        cl_event written;                 ///< Marker after the writes of the outputs. The slot is free once it completes
+        int status;                       ///< What ProcessMemIO returned
+    };
+    static const int kMemSlots = 2;       ///< Frames in flight: one being processed, one being read
+    int  WaitForSlot(FrameSlot& slot);    ///< Wait until the last frame of slot is written. Returns the ProcessMemIO status
+    void WaitForFrames();                 ///< Wait for all frames in flight
+    void StartWorker();                   ///< Start the worker thread, if not running
+    void StopWorker();                    ///< Let the worker finish its queue and join it
+    void WorkerLoop();                    ///< Body of the worker thread
     std::shared_ptr<ComputeEvent> computeEvent;  ///< Used for synchronization
 
     std::vector<BuffSize> inBufSize;  
     std::vector<BuffSize> outBufSize;
-    PluginApi api;       ///< Structure with pointers to functions implementing API
+    std::vector<float> preparedFloatParams;  ///< Parameters of the last Prepare. InternalCalc skips the DLL calls if nothing has changed
+    std::vector<int> preparedIntParams;
+    bool prepared;                           ///< Prepare has succeeded with inBufSize and the prepared parameters
+    PluginBinding plugin; ///< Pointers to functions implementing API and the instance used, if any
     PluginInfo info;     ///< The loaded DLL fills this structure and tells what it needs - OpenCL/CPU etc
     std::string dllName; ///< Full path to the DLL to be loaded. Not need be in System
-    HMODULE hDLL;         ///< Handle to the DLL to be loaded
+    UspDllHandle hDLL;         ///< Handle to the DLL to be loaded
     
     // The processing modules take arrays of pointer to either memory or cl_mem
-    (void**) inBufs;
-    (void**) outBufs;
+    std::vector<FrameSlot> slots;     ///< Memory buffers, kMemSlots sets for frames in flight
+    size_t nextSlot;                  ///< Slot of the next frame
+    cl_command_queue readQueue;       ///< Reads of the inputs, so they do not wait behind the writes of the last frame
 
     cl_mem *inClMemPtr;
     cl_mem *outClMemPtr;
 
+    cl_mem scratch;                   ///< Arena for the intermediate buffers of the DLL, see SetScratchBuffer. NULL if not used
+    size_t scratchSize;               ///< Size of scratch in bytes
+
+    // Worker thread running ProcessMemIO. Only one frame is processed at a time, as the plug-in instance is not reentrant
+    std::thread worker;
+    std::mutex jobMutex;
+    std::condition_variable jobCond;
+    std::deque<FrameSlot*> jobs;      ///< Frames waiting for the worker
+    bool stopWorker;
+
+    PendingDll pending;               ///< DLL being loaded in the background, see StartLoader
+    std::thread loader;
+    std::atomic<bool> loaderDone;
+
     TEST_CLASS_FRIEND_DECLARE(USPTests, UspPluginModuleTest)
 };
 
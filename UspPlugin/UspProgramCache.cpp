@@ -0,0 +1,160 @@
+#include "UspProgramCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#define PATH_SEP "\\"
+#else
+#define PATH_SEP "/"
+#endif
+
+// First bytes of a cache file, followed by the key length, key, binary length and binary
+static const char cache_magic[8] = {'S','P','C','L','B','I','N','1'};
+
+
+/// <summary> 64-bit FNV-1a hash, continuing from h </summary>
+static uint64_t Fnv1a(const void* data, size_t len, uint64_t h)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+
+/// <summary> Appends a string property of the device to key, followed by a newline </summary>
+static void AppendDeviceInfo(std::string& key, cl_device_id dev, cl_device_info param)
+{
+    size_t len = 0;
+    if (clGetDeviceInfo(dev, param, 0, NULL, &len) == CL_SUCCESS && len > 0) {
+        std::vector<char> buf(len);
+        if (clGetDeviceInfo(dev, param, len, &buf[0], NULL) == CL_SUCCESS) {
+            key.append(&buf[0], strnlen(&buf[0], len));
+        }
+    }
+    key += '\n';
+}
+
+
+/// <summary> Everything the binary depends on. The source is included as a hash. </summary>
+static std::string CacheKey(cl_device_id dev, const char* source, const char* options)
+{
+    std::string key;
+    AppendDeviceInfo(key, dev, CL_DEVICE_NAME);
+    AppendDeviceInfo(key, dev, CL_DEVICE_VENDOR);
+    AppendDeviceInfo(key, dev, CL_DEVICE_VERSION);
+    AppendDeviceInfo(key, dev, CL_DRIVER_VERSION);
+    key += (options != NULL) ? options : "";
+    key += '\n';
+
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)Fnv1a(source, strlen(source), 14695981039346656037ULL));
+    key += hash;
+    return key;
+}
+
+
+/// <summary> Reads the binary saved for key. Returns false if there is none, or it is for another key. </summary>
+static bool ReadCache(const std::string& path, const std::string& key, std::vector<unsigned char>& binary)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    bool ok = false;
+    char magic[sizeof(cache_magic)];
+    uint64_t keylen = 0, binlen = 0;
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, cache_magic, sizeof(magic)) == 0
+        && fread(&keylen, sizeof(keylen), 1, file) == 1 && keylen == key.size()) {
+        std::vector<char> filekey(key.size() + 1);
+        if (fread(&filekey[0], 1, key.size(), file) == key.size() && key.compare(0, key.size(), &filekey[0], key.size()) == 0
+            && fread(&binlen, sizeof(binlen), 1, file) == 1 && binlen > 0 && binlen < (1ULL << 31)) {
+            binary.resize((size_t)binlen);
+            ok = (fread(&binary[0], 1, binary.size(), file) == binary.size());
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+
+/// <summary> Saves the binary of a built program. Errors are ignored, the next load builds from source again. </summary>
+static void WriteCache(const std::string& path, const std::string& key, cl_program prog)
+{
+    size_t binlen = 0;
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(binlen), &binlen, NULL) != CL_SUCCESS || binlen == 0) return;
+    std::vector<unsigned char> binary(binlen);
+    unsigned char* ptr = &binary[0];
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, NULL) != CL_SUCCESS) return;
+
+    // Write to a temporary file first, so a concurrent load never sees half a binary
+    std::string tmp = path + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+    if (!file) return;
+    uint64_t keylen = key.size(), len = binlen;
+    bool ok = fwrite(cache_magic, 1, sizeof(cache_magic), file) == sizeof(cache_magic)
+        && fwrite(&keylen, sizeof(keylen), 1, file) == 1
+        && fwrite(key.data(), 1, key.size(), file) == key.size()
+        && fwrite(&len, sizeof(len), 1, file) == 1
+        && fwrite(&binary[0], 1, binary.size(), file) == binary.size();
+    ok = (fclose(file) == 0) && ok;
+    if (ok) {
+        remove(path.c_str());
+        ok = (rename(tmp.c_str(), path.c_str()) == 0);
+    }
+    if (!ok) remove(tmp.c_str());
+}
+
+
+/// <summary> Builds from source, as without the cache </summary>
+static cl_int BuildFromSource(cl_context ctx, cl_device_id dev, const char* source, const char* options, cl_program* prog)
+{
+    cl_int err = CL_SUCCESS;
+    *prog = clCreateProgramWithSource(ctx, 1, &source, NULL, &err);
+    if (err != CL_SUCCESS) {
+        *prog = NULL;
+        return err;
+    }
+    return clBuildProgram(*prog, 1, &dev, options, NULL, NULL);
+}
+
+
+cl_int BuildProgramCached(cl_context ctx, cl_device_id dev, const char* source, const char* options, const char* cache_dir, cl_program* prog)
+{
+    const char* env = getenv("SPADES_CL_CACHE");
+    const char* dir = (env != NULL) ? env : cache_dir;
+    if (dir == NULL || dir[0] == '\0') {
+        return BuildFromSource(ctx, dev, source, options, prog);
+    }
+
+    std::string key = CacheKey(dev, source, options);
+    char name[64];
+    snprintf(name, sizeof(name), "spades_%016llx.clbin", (unsigned long long)Fnv1a(key.data(), key.size(), 14695981039346656037ULL));
+    std::string path = std::string(dir) + PATH_SEP + name;
+
+    std::vector<unsigned char> binary;
+    if (ReadCache(path, key, binary)) {
+        const unsigned char* ptr = &binary[0];
+        size_t len = binary.size();
+        cl_int status = CL_SUCCESS, err = CL_SUCCESS;
+        *prog = clCreateProgramWithBinary(ctx, 1, &dev, &len, &ptr, &status, &err);
+        if (err == CL_SUCCESS && status == CL_SUCCESS) {
+            err = clBuildProgram(*prog, 1, &dev, options, NULL, NULL);
+            if (err == CL_SUCCESS) return CL_SUCCESS;
+        }
+        // Rejected by the driver, e.g. after an update that kept the version string
+        if (*prog != NULL) clReleaseProgram(*prog);
+        *prog = NULL;
+    }
+
+    cl_int err = BuildFromSource(ctx, dev, source, options, prog);
+    if (err == CL_SUCCESS) {
+        WriteCache(path, key, *prog);
+    }
+    return err;
+}
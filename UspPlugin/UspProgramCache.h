@@ -0,0 +1,38 @@
+#pragma once
+/**\file UspProgramCache.h
+ * On-disk cache of OpenCL program binaries, shared by the plug-ins.
+ *
+ * Building a program from source takes seconds on some drivers and is done
+ * every time a DLL is loaded. BuildProgramCached builds the program once,
+ * saves the binary from clGetProgramInfo(CL_PROGRAM_BINARIES) and creates
+ * the program with clCreateProgramWithBinary on the next load.
+ *
+ * The cache file name is a hash of the device name, vendor, device and driver
+ * versions, the build options and the source, so any of them changing means
+ * a rebuild from source. A binary the driver rejects is rebuilt and replaced.
+ *
+ * The files are written to cache_dir, or to the directory in the environment
+ * variable SPADES_CL_CACHE if it is set. Setting SPADES_CL_CACHE to an empty
+ * string turns the cache off. Failing to write the cache is not an error.
+ *
+ * Example (inside a plug-in):
+ *
+ *  cl_program prog;
+ *  cl_int err = BuildProgramCached(ctx, dev, source, NULL, path_to_dll, &prog);
+ *  if (prog == NULL)            -> could not create the program
+ *  else if (err != CL_SUCCESS)  -> build failed, see CL_PROGRAM_BUILD_LOG
+ */
+
+#include "UspPlugin.h"
+
+
+/// <summary> Creates and builds a program for one device, from the cache when possible.
+/// Returns the error of clBuildProgram, or of clCreateProgramWithSource if *prog is NULL.
+/// @param ctx Context to create the program in
+/// @param dev Device to build for
+/// @param source Zero-terminated OpenCL source
+/// @param options Build options passed to clBuildProgram, may be NULL
+/// @param cache_dir Directory for the cache files, may be NULL to only use SPADES_CL_CACHE
+/// @param prog OUTPUT the program, also when the build fails so the log can be read
+/// </summary>
+cl_int BuildProgramCached(cl_context ctx, cl_device_id dev, const char* source, const char* options, const char* cache_dir, cl_program* prog);
@@ -0,0 +1,190 @@
+#include "UspRecording.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// First bytes of a recording
+static const char recording_magic[8] = {'S','P','A','D','E','S','R','C'};
+
+
+/// <summary> Checks that the header is complete and describes a file of fileLen bytes </summary>
+static bool ValidHeader(const RecordingHeader* h, uint64_t fileLen)
+{
+    if (fileLen < sizeof(RecordingHeader)) return false;
+    if (memcmp(h->magic, recording_magic, sizeof(recording_magic)) != 0 || h->version != 1) return false;
+    if (h->numFloatParams > RECORDING_MAX_PARAMS || h->numIntParams > RECORDING_MAX_PARAMS) return false;
+    if (h->frameStride < h->depthLen || h->frameStride % RECORDING_ALIGN != 0) return false;
+    if (h->dataOffset < sizeof(RecordingHeader) || h->dataOffset % RECORDING_ALIGN != 0) return false;
+    if (h->numFrames == 0) return true;
+    // The last frame ends inside the file, written so that it cannot overflow
+    return h->frameStride > 0 && fileLen >= h->dataOffset + h->depthLen
+        && (fileLen - h->dataOffset - h->depthLen) / h->frameStride >= h->numFrames - 1;
+}
+
+
+#ifdef WIN32
+
+int OpenRecording(const char* path, Recording* rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return -1;
+
+    LARGE_INTEGER len;
+    HANDLE mapping = NULL;
+    void* base = NULL;
+    if (GetFileSizeEx(file, &len) && len.QuadPart > 0) {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping != NULL) {
+        base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (base == NULL) {
+        if (mapping != NULL) CloseHandle(mapping);
+        CloseHandle(file);
+        return -1;
+    }
+
+    rec->header = (const RecordingHeader*)base;
+    rec->fileLen = (uint64_t)len.QuadPart;
+    rec->file = file;
+    rec->mapping = mapping;
+    if (!ValidHeader(rec->header, rec->fileLen)) {
+        CloseRecording(rec);
+        return -2;
+    }
+    return 0;
+}
+
+
+void CloseRecording(Recording* rec)
+{
+    if (rec->header != NULL) UnmapViewOfFile(rec->header);
+    if (rec->mapping != NULL) CloseHandle(rec->mapping);
+    if (rec->file != NULL) CloseHandle(rec->file);
+    memset(rec, 0, sizeof(*rec));
+}
+
+#else
+
+int OpenRecording(const char* path, Recording* rec)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = open(path, O_RDONLY);
+    if (rec->fd < 0) return -1;
+
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(rec->fd, &st) == 0 && st.st_size > 0) {
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, rec->fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        close(rec->fd);
+        rec->fd = -1;
+        return -1;
+    }
+    // Frames are replayed front to back; let the kernel read ahead
+    madvise(base, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    rec->header = (const RecordingHeader*)base;
+    rec->fileLen = (uint64_t)st.st_size;
+    if (!ValidHeader(rec->header, rec->fileLen)) {
+        CloseRecording(rec);
+        return -2;
+    }
+    return 0;
+}
+
+
+void CloseRecording(Recording* rec)
+{
+    if (rec->header != NULL) munmap((void*)rec->header, (size_t)rec->fileLen);
+    if (rec->fd >= 0) close(rec->fd);
+    memset(rec, 0, sizeof(*rec));
+    rec->fd = -1;
+}
+
+#endif
+
+
+const void* RecordingFrame(const Recording* rec, uint32_t n)
+{
+    if (rec->header == NULL || n >= rec->header->numFrames) return NULL;
+    return (const char*)rec->header + rec->header->dataOffset + n * rec->header->frameStride;
+}
+
+
+void RecordingFrameSize(const Recording* rec, BuffSize* size)
+{
+    const RecordingHeader* h = rec->header;
+    size->sampleType = (SampleType)h->sampleType;
+    size->width     = (size_t)h->width;
+    size->height    = (size_t)h->height;
+    size->depth     = (size_t)h->depth;
+    size->widthLen  = (size_t)h->widthLen;
+    size->heightLen = (size_t)h->heightLen;
+    size->depthLen  = (size_t)h->depthLen;
+}
+
+
+/// <summary> Appends one frame file to out, padded with zeros to stride bytes </summary>
+static int CopyFrame(FILE* out, const char* name, std::vector<char>& buf, size_t len, size_t stride)
+{
+    FILE* in = fopen(name, "rb");
+    if (!in) return -1;
+    buf.assign(stride + 1, 0);
+    size_t count = fread(&buf[0], 1, len + 1, in);   // One byte more, to notice a longer file
+    fclose(in);
+    if (count != len) return -2;
+    return (fwrite(&buf[0], 1, stride, out) == stride) ? 0 : -1;
+}
+
+
+int WriteRecording(const char* path, const BuffSize* size,
+                   const float* floatParams, uint32_t numFloatParams,
+                   const int* intParams, uint32_t numIntParams,
+                   const char* const* frameFiles, uint32_t numFrames)
+{
+    if (numFloatParams > RECORDING_MAX_PARAMS || numIntParams > RECORDING_MAX_PARAMS || size->depthLen == 0) return -2;
+
+    RecordingHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, recording_magic, sizeof(h.magic));
+    h.version = 1;
+    h.numFrames = numFrames;
+    h.sampleType = (uint32_t)size->sampleType;
+    h.numFloatParams = numFloatParams;
+    h.numIntParams = numIntParams;
+    h.width = size->width;
+    h.height = size->height;
+    h.depth = size->depth;
+    h.widthLen = size->widthLen;
+    h.heightLen = size->heightLen;
+    h.depthLen = size->depthLen;
+    h.frameStride = (size->depthLen + RECORDING_ALIGN - 1) / RECORDING_ALIGN * RECORDING_ALIGN;
+    h.dataOffset = (sizeof(h) + RECORDING_ALIGN - 1) / RECORDING_ALIGN * RECORDING_ALIGN;
+    if (numFloatParams > 0) memcpy(h.floatParams, floatParams, numFloatParams * sizeof(float));
+    for (uint32_t n = 0; n < numIntParams; n++) h.intParams[n] = intParams[n];
+
+    FILE* out = fopen(path, "wb");
+    if (!out) return -1;
+    std::vector<char> buf((size_t)h.dataOffset, 0);
+    memcpy(&buf[0], &h, sizeof(h));
+    int err = (fwrite(&buf[0], 1, buf.size(), out) == buf.size()) ? 0 : -1;
+    for (uint32_t n = 0; n < numFrames && err == 0; n++) {
+        err = CopyFrame(out, frameFiles[n], buf, (size_t)h.depthLen, (size_t)h.frameStride);
+    }
+    if (fclose(out) != 0 && err == 0) err = -1;
+    if (err != 0) remove(path);
+    return err;
+}
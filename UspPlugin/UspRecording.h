@@ -0,0 +1,100 @@
+#pragma once
+/**\file UspRecording.h
+ * Recordings of input frames, memory-mapped for offline replay through a plug-in.
+ *
+ * A recording is one file: a RecordingHeader with the size of an input frame
+ * and the parameters for SetParams, followed by the frames. Every frame starts
+ * at a multiple of RECORDING_ALIGN bytes, so the mapped frames can be passed
+ * to clEnqueueWriteBuffer as they are, or wrapped in a CL_MEM_USE_HOST_PTR
+ * buffer without a copy.
+ *
+ * OpenRecording maps the whole file read-only; the pages are read by the OS
+ * when a frame is first touched, so opening a multi-gigabyte recording is
+ * instant and replay runs at the speed of the storage.
+ *
+ * Example (for the host application):
+ *
+ *  Recording rec;
+ *  if (OpenRecording("scan.rec", &rec) != 0) -> error
+ *  PluginSetParams(&plugin, rec.header->floatParams, rec.header->numFloatParams,
+ *                  rec.header->intParams, rec.header->numIntParams);
+ *  BuffSize size;
+ *  RecordingFrameSize(&rec, &size);
+ *  PluginSetInBufSize(&plugin, &size, 0);
+ *  for (uint32_t n = 0; n < rec.header->numFrames; n++){
+ *      clEnqueueWriteBuffer(queue, inbuf, CL_FALSE, 0, size.depthLen, RecordingFrame(&rec, n), ...);
+ *  }
+ *  ... wait for the writes ...
+ *  CloseRecording(&rec);
+ */
+
+#include "UspPlugin.h"
+
+#define RECORDING_ALIGN       4096  ///< Alignment of the frames in the file, one page
+#define RECORDING_MAX_PARAMS  32    ///< Room for the float and the int parameters
+
+/** Start of a recording file. Fixed-size fields, so the file is the same on every platform */
+typedef struct RecordingHeader {
+    char magic[8];             ///< "SPADESRC"
+    uint32_t version;          ///< 1
+    uint32_t numFrames;
+    uint32_t sampleType;       ///< SampleType of the frames
+    uint32_t numFloatParams;
+    uint32_t numIntParams;
+    uint32_t reserved;
+    uint64_t width;            ///< As in BuffSize
+    uint64_t height;
+    uint64_t depth;
+    uint64_t widthLen;
+    uint64_t heightLen;
+    uint64_t depthLen;         ///< Length of one frame in bytes
+    uint64_t frameStride;      ///< Distance between two frames in the file, depthLen rounded up to RECORDING_ALIGN
+    uint64_t dataOffset;       ///< Offset of the first frame in the file
+    float floatParams[RECORDING_MAX_PARAMS];
+    int32_t intParams[RECORDING_MAX_PARAMS];
+} RecordingHeader;
+
+
+/** An open recording. The fields after header are private */
+typedef struct Recording {
+    const RecordingHeader* header;  ///< Start of the mapped file
+    uint64_t fileLen;
+#ifdef WIN32
+    void* file;      ///< HANDLE of the file
+    void* mapping;   ///< HANDLE of the file mapping
+#else
+    int fd;
+#endif
+} Recording;
+
+
+/// <summary> Maps a recording into memory.
+/// Returns 0, -1 if the file cannot be opened or mapped, -2 if it is not a recording
+/// or is shorter than its header says.
+/// @param path File name
+/// @param rec OUTPUT the mapped recording, to be closed with CloseRecording
+/// </summary>
+int OpenRecording(const char* path, Recording* rec);
+
+/// <summary> Unmaps a recording. Frames returned by RecordingFrame must not be used after this. </summary>
+void CloseRecording(Recording* rec);
+
+/// <summary> Returns the start of frame n, aligned to RECORDING_ALIGN. NULL if n is out of range. </summary>
+const void* RecordingFrame(const Recording* rec, uint32_t n);
+
+/// <summary> Fills in the size of a frame, for SetInBufSize </summary>
+void RecordingFrameSize(const Recording* rec, BuffSize* size);
+
+/// <summary> Writes a recording from raw frames in separate files, e.g. the FromLive_%02d.bin of TheApplication.
+/// Returns 0, -1 if a file cannot be read or written, -2 if a frame file is not size->depthLen bytes
+/// or there are too many parameters.
+/// @param path Recording to write
+/// @param size Size of one frame
+/// @param floatParams, numFloatParams, intParams, numIntParams Parameters for SetParams
+/// @param frameFiles Names of the files with the frames, in order
+/// @param numFrames Number of frame files
+/// </summary>
+int WriteRecording(const char* path, const BuffSize* size,
+                   const float* floatParams, uint32_t numFloatParams,
+                   const int* intParams, uint32_t numIntParams,
+                   const char* const* frameFiles, uint32_t numFrames);
@@ -0,0 +1,143 @@
+#define USP_PLUGIN_DLL   1
+#include "UspPlugin.h"
+#include "UspTiming.h"
+#undef USP_PLUGIN_DLL
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+/** Durations of one kernel, a ring of the last USP_TIMING_WINDOW */
+typedef struct KernelSamples {
+    const char* name;
+    std::vector<double> us;
+    uint32_t next;
+    uint32_t total;
+    double last_us;
+} KernelSamples;
+
+/** A kernel that has not finished yet */
+typedef struct PendingEvent {
+    const char* name;
+    cl_event ev;
+} PendingEvent;
+
+/* Global, module-wide variables. Several instances may run in different threads. */
+static std::mutex g_TimingMutex;
+static std::vector<PendingEvent> g_Pending;
+static std::vector<KernelSamples> g_Samples;
+static std::vector<KernelTiming> g_Timings;
+
+
+static void AddSample(const char* name, double us)
+{
+    size_t n;
+    for (n = 0; n < g_Samples.size(); n++) {
+        if (strcmp(g_Samples[n].name, name) == 0) break;
+    }
+    if (n == g_Samples.size()) {
+        KernelSamples s;
+        s.name = name;
+        s.next = 0;
+        s.total = 0;
+        s.last_us = 0;
+        g_Samples.push_back(s);
+    }
+
+    KernelSamples& s = g_Samples[n];
+    if (s.us.size() < USP_TIMING_WINDOW) {
+        s.us.push_back(us);
+    } else {
+        s.us[s.next] = us;
+    }
+    s.next = (s.next + 1) % USP_TIMING_WINDOW;
+    s.total++;
+    s.last_us = us;
+}
+
+
+/// <summary> Moves the finished kernels from g_Pending to g_Samples. Call with g_TimingMutex held. </summary>
+static void CollectFinished()
+{
+    size_t kept = 0;
+    for (size_t n = 0; n < g_Pending.size(); n++) {
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(g_Pending[n].ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        if (status > CL_COMPLETE) {
+            g_Pending[kept++] = g_Pending[n];   // Still running
+            continue;
+        }
+        cl_ulong start = 0, end = 0;
+        if (status == CL_COMPLETE
+            && clGetEventProfilingInfo(g_Pending[n].ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(g_Pending[n].ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS) {
+            AddSample(g_Pending[n].name, (end - start) * 1e-3);
+        }
+        clReleaseEvent(g_Pending[n].ev);
+    }
+    g_Pending.resize(kept);
+}
+
+
+void TimingEnqueued(const char* name, cl_command_queue queue, cl_event ev)
+{
+    if (ev == NULL) return;
+
+    cl_command_queue_properties props = 0;
+    if (clGetCommandQueueInfo(queue, CL_QUEUE_PROPERTIES, sizeof(props), &props, NULL) != CL_SUCCESS
+        || (props & CL_QUEUE_PROFILING_ENABLE) == 0) return;
+
+    std::lock_guard<std::mutex> lock(g_TimingMutex);
+    CollectFinished();
+    if (clRetainEvent(ev) == CL_SUCCESS) {
+        PendingEvent p = { name, ev };
+        g_Pending.push_back(p);
+    }
+}
+
+
+void TimingReset()
+{
+    std::lock_guard<std::mutex> lock(g_TimingMutex);
+    for (size_t n = 0; n < g_Pending.size(); n++) {
+        clWaitForEvents(1, &g_Pending[n].ev);
+        clReleaseEvent(g_Pending[n].ev);
+    }
+    g_Pending.clear();
+    g_Samples.clear();
+    g_Timings.clear();
+}
+
+
+PLUGIN_API
+KernelTiming*  GetKernelTimings(uint32_t* arrayLen)
+{
+    std::lock_guard<std::mutex> lock(g_TimingMutex);
+    CollectFinished();
+
+    g_Timings.resize(g_Samples.size());
+    std::vector<double> sorted;
+    for (size_t n = 0; n < g_Samples.size(); n++) {
+        const KernelSamples& s = g_Samples[n];
+        KernelTiming& t = g_Timings[n];
+        sorted = s.us;
+        std::sort(sorted.begin(), sorted.end());
+
+        double sum = 0;
+        for (size_t i = 0; i < sorted.size(); i++) sum += sorted[i];
+
+        t.name = (char*)s.name;
+        t.count = (uint32_t)sorted.size();
+        t.total = s.total;
+        t.last_us = s.last_us;
+        t.min_us = sorted[0];
+        t.mean_us = sum / sorted.size();
+        t.p99_us = sorted[(sorted.size() * 99 - 1) / 100];
+    }
+
+    if (arrayLen != NULL){
+        *arrayLen = (uint32_t)g_Timings.size();
+    }
+    return g_Timings.data();
+}
@@ -0,0 +1,76 @@
+#pragma once
+/**
+ * Per-kernel timing of a plug-in, read from the OpenCL profiling counters.
+ *
+ * The plug-in calls TimingEnqueued() with the event of every kernel it
+ * enqueues. If the command queue was created with CL_QUEUE_PROFILING_ENABLE,
+ * the event is kept until the kernel has finished, and its
+ * CL_PROFILING_COMMAND_END - CL_PROFILING_COMMAND_START is added to the
+ * statistics of that kernel. Otherwise the call does nothing, so the
+ * instrumentation costs nothing unless the host asks for it.
+ *
+ * Only the last USP_TIMING_WINDOW durations of each kernel are kept, which
+ * is the last USP_TIMING_WINDOW frames when every kernel runs once per frame.
+ *
+ * The host application reads the statistics with GetKernelTimings().
+ * As with GetDbgMem(), it must not free() the array.
+ * Example (for the host application):
+ *
+ *  cl_command_queue queue = clCreateCommandQueue(ctx, dev, CL_QUEUE_PROFILING_ENABLE, &err);
+ *  ... process some frames ...
+ *  uint32_t num;
+ *  KernelTiming* t = GetKernelTimings(&num);
+ *  for (uint32_t n = 0; n < num; n++){
+ *      printf("%s: mean %.1f us\n", t[n].name, t[n].mean_us);
+ *  }
+ */
+
+
+#include "UspPlugin.h"
+
+#define USP_TIMING_WINDOW 128
+
+
+/** Statistics of one kernel over the last USP_TIMING_WINDOW runs, in microseconds */
+typedef struct KernelTiming {
+    char* name;      ///< Name of the kernel
+    uint32_t count;  ///< Number of runs the statistics are over
+    uint32_t total;  ///< Number of runs since the plug-in was loaded
+    double last_us;  ///< Duration of the last run
+    double min_us;
+    double mean_us;
+    double p99_us;   ///< 99th percentile
+} KernelTiming;
+
+
+
+#ifdef USP_PLUGIN_DLL
+
+/**
+ *  External API
+ */
+
+PLUGIN_API KernelTiming*  GetKernelTimings(uint32_t* arrayLen);
+
+
+/** Internal API */
+
+/// <summary> Records the duration of a kernel once it has finished.
+/// Does nothing if ev is NULL or the queue does not have profiling enabled.
+/// @param name Name of the kernel, must stay valid (a string literal)
+/// @param queue The queue the kernel was enqueued in
+/// @param ev The event returned by clEnqueueNDRangeKernel
+/// </summary>
+void TimingEnqueued(const char* name, cl_command_queue queue, cl_event ev);
+
+/// <summary> Waits for the kernels that have not been collected yet, releases their events and
+/// forgets all statistics. Called by the plug-in's Cleanup, so no event keeps a queue or context
+/// alive once the host releases them or unloads the DLL.
+/// </summary>
+void TimingReset();
+
+#endif
+
+/** Type definitions used by the caller to bind to the API from the DLL */
+
+typedef KernelTiming* (*GetKernelTimingsPtr)(uint32_t* arrayLen);